@@ -0,0 +1,77 @@
+/**
+ * @brief Ordered key-value store on top of the flash memory library, as an append-only B+tree.
+ *
+ * *** Overview ***
+ * - The tree is stored in a range of consecutive logical sectors used as a ring of nodes, one node
+ *   per physical sector.
+ * - Nodes are never modified. Every put or delete is a commit that writes a copy of the path from
+ *   the changed leaf up to a new root, so only O(log n) nodes are programmed and no erase is done.
+ *   The root is flagged in its node header, which makes the commit atomic: nodes written after the
+ *   last root (a commit interrupted by a power loss) are ignored.
+ * - The current root is recovered on `btree_init` by locating the newest node, the same way
+ *   flash_timeseries does, and walking back to the last root.
+ * - When free space runs low the oldest logical sector is reclaimed: the live nodes it holds are
+ *   copied to the head of the log (along with their ancestors) and the sector is erased.
+ *   The live tree must fit in the range minus two logical sectors.
+ * - Point lookups read O(log n) nodes, values and scanned entries are passed straight from XIP.
+ * - Keys are compared byte-wise, shorter keys first on a common prefix. Deletes do not rebalance,
+ *   empty leaves are simply dropped from their parent.
+ *
+ * *** Usage ***
+ *     BTree tree;
+ *     btree_init(&tree, 20, 8);
+ *     btree_put(&tree, (const uint8_t *)"sensor/1", 8, value, sizeof(value));
+ *     btree_get(&tree, (const uint8_t *)"sensor/1", 8, &value_pointer, &value_len);
+ *     btree_scan_prefix(&tree, (const uint8_t *)"sensor/", 7, print_entry, NULL);
+ */
+
+#ifndef FLASH_BTREE_H
+#define FLASH_BTREE_H
+
+#include "flash_lib.h"
+#include "hardware/flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BTREE_MAX_KEY_SIZE 64
+#define BTREE_MAX_VALUE_SIZE 200
+#define BTREE_MAX_HEIGHT 8
+#define BTREE_NO_NODE 0xFFFFFFFF
+
+#define BTREE_NODE_SIZE FLASH_LIB_SECTOR_SIZE
+
+typedef struct BTree {
+    uint16_t first_logical_id;
+    uint16_t sectors_count;
+    uint32_t nodes_per_sector;
+
+    uint32_t root;
+    uint16_t oldest_sector;
+    uint16_t head_sector;
+    uint32_t head_slot;
+    uint32_t next_sequence;
+
+    uint8_t node_buffer[BTREE_NODE_SIZE] __attribute__((aligned(4)));
+} BTree;
+
+/**
+ * @brief Called for every entry found by a scan.
+ *
+ * @return false to stop the scan.
+ */
+typedef bool (*btree_callback_t)(const uint8_t *key, uint8_t key_len, const uint8_t *value, uint8_t value_len, void *context);
+
+void btree_init(BTree *tree, uint16_t first_logical_id, uint16_t sectors_count);
+bool btree_get(BTree *tree, const uint8_t *key, uint8_t key_len, const uint8_t **value, uint8_t *value_len);
+bool btree_put(BTree *tree, const uint8_t *key, uint8_t key_len, const uint8_t *value, uint8_t value_len);
+bool btree_delete(BTree *tree, const uint8_t *key, uint8_t key_len);
+uint32_t btree_scan(BTree *tree, const uint8_t *start, uint8_t start_len, const uint8_t *end, uint8_t end_len, btree_callback_t callback, void *context);
+uint32_t btree_scan_prefix(BTree *tree, const uint8_t *prefix, uint8_t prefix_len, btree_callback_t callback, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,20 +14,31 @@
  *   between power-ups, skipping already initialized sectors.
  * 
  * *** Logical Sectors ***
- * - Flash memory is divided into physical sectors, each 4096 bytes in size.
+ * - Flash memory is divided into physical sectors, each FLASH_LIB_SECTOR_SIZE bytes in size (4096 on
+ *   the Pico boards).
  * - Logical sectors are how you interact with the library, providing a simplified interface for 
  *   managing flash memory.
  * - Logical sectors are an abstraction created by the library, consisting of multiple physical sectors 
  *   determined by the `group_by` attribute. For example, if `group_by` is 64, each logical sector 
  *   will be 4096 * 64 = 256 KB in size.
- * - The first 8 bytes of every logical sector are reserved for the header, so the usable size of 
- *   a logical sector is 4096 * `group_by` - 8 bytes.
+ * - Logical sectors hold no header, the whole 4096 * `group_by` bytes are usable and contiguous in
+ *   memory, so the pointer returned by `read_sector` can be used as an aligned struct overlay.
+ *   A logical sector that reads as blank (erased, or not provisioned yet) is served from a blank
+ *   buffer, and only FLASH_LIB_SECTOR_SIZE bytes can be read from the pointer: overlays larger
+ *   than a physical sector are read one physical sector at a time, or with `flash_lib_read_copy`.
  * - The library supports up to 65535 logical sectors, but using larger logical sector sizes is 
  *   recommended to reduce execution time.
  * - The library will use memory sectors starting from the `lower_bound` and extending upwards.
- *   The total number of sectors used is determined by `logical_sectors_count` multiplied by 
- *   `group_by`. For example, if `lower_bound` is 100, `logical_sectors_count` is 10, and 
- *   `group_by` is 4, the library will use sectors 100 to 139.
+ *   The first FLASH_LIB_METADATA_SECTORS sectors hold the metadata of the library (which physical
+ *   sectors back which logical sector, flags and erase counts) as a log of small records, read once
+ *   by the initialization and kept in RAM afterwards. The logical sectors follow, the number of
+ *   sectors they use is `logical_sectors_count` multiplied by `group_by`. For example, if
+ *   `lower_bound` is 100, `logical_sectors_count` is 10, and `group_by` is 4, the library will use
+ *   sectors 100 to 143.
+ * - Each half of the metadata region must fit a snapshot of 8 bytes per logical sector and per
+ *   physical sector (8 more per logical sector with `content_hashes`, and with `merkle_tree`),
+ *   plus as much room for the log. Large configurations must set
+ *   `metadata_sectors_count` with `init_flash_lib_with_config`.
  * 
  * *** Usage ***
  * - Before writing or reading from a sector, an ID is required. This ID can be any number between
@@ -35,7 +46,89 @@
  * - The ID is fixed and never changes, even after shutdowns or physical sector changes due to 
  *   wear leveling. The library ensures data can be accessed with the same ID consistently.
  * - The user must keep track of the IDs being used, as the library does not manage or verify ID 
- *   uniqueness across different programs or functions.
+ *   uniqueness across different programs or functions. C++ code can name its logical sectors with
+ *   `flash_registry` from flash_registry.hpp instead, which assigns the IDs at compile time and
+ *   fails the build on collisions.
+ * - Data is programmed with `write_sector` into erased areas only. The library keeps track in RAM of
+ *   which physical sectors received data, so `erase_logical_sector` only erases those and its cost
+ *   scales with the amount of data written instead of the logical sector size. Data programmed
+ *   directly with the SDK flash functions is not tracked and may be skipped by the erase.
+ * - `erase_logical_sector` only marks the logical sector as erased (a tombstone in its metadata),
+ *   the logical sector reads as blank right away and the physical erase happens later, on the next
+ *   write to it or from `flash_lib_maintenance`, which should be called when the application is idle.
+ * - Several logical sectors can be replaced atomically with a transaction (`transaction_begin`,
+ *   `transaction_write`, `transaction_commit`). This requires `spare_sectors_count` spare groups,
+ *   set with `init_flash_lib_with_config`. Staged writes go to spare groups, a single commit
+ *   record in the metadata log switches all of them, and the replaced groups become spares again
+ *   once `flash_lib_maintenance` erased them.
+ * - C++ code can store small structs with `persistent<T, logical_id>` from flash_persistent.hpp,
+ *   which handles the erase/write sequence, skips unchanged values and batches writes.
+ * - Items of a few dozen bytes can share logical sectors with the record store of flash_records.h:
+ *   updates append a new version and clear a bit of the previous one, without an erase.
+ * - Messages waiting for an uplink can be buffered in the persistent FIFO of flash_queue.h, where a
+ *   pop clears an ack byte and a logical sector is only erased once all its messages are popped.
+ * - New groups are placed by the allocator selected in FlashLibConfig: random (default), round-robin,
+ *   least worn, wear aware or a custom function. A non-zero `seed` makes the random placements
+ *   reproducible, for benchmarks and simulations.
+ * - Defining FLASH_LIB_TRACE records every operation in a RAM ring, see flash_trace.h. The trace
+ *   can be replayed on the host with tools/flash_replay.c.
+ * - Interrupt handlers and the other core can use `flash_lib_lookup` and `flash_lib_read_copy`,
+ *   which take no lock and never wait: the mapping is read under a sequence lock, and they return
+ *   FLASH_LOOKUP_BUSY while it changes or while the logical sector is being erased or written. On
+ *   the other core they are only safe if the flash operations pause it (FLASH_LIB_FREERTOS, or
+ *   multicore_lockout in bare-metal builds), as nothing can read the flash while XIP is disabled.
+ * - `rewrite_sector` replaces the whole content of a logical sector. With `content_hashes` set, a
+ *   rewrite with the same content as the previous one is detected with a hash kept in the metadata
+ *   and costs no erase, which suits periodic saves of settings that rarely change.
+ * - With `merkle_tree` set, the write paths keep a digest of every logical sector up to date and
+ *   roll them up into a Merkle tree, see `flash_lib_get_merkle_node`. A backup peer compares the
+ *   tree with its copy from the root down and fetches only the logical sectors whose digest
+ *   changed, see tools/flash_sync.c. Each write then appends two metadata records.
+ * - Firmware without an RTOS can run init, writes, erases and maintenance step by step: start them
+ *   with `flash_lib_start_*` and call `flash_lib_poll` from the main loop until it returns
+ *   FLASH_POLL_DONE (or FLASH_POLL_FAILED). Each call does at most one page program or one sector erase, so the loop keeps
+ *   serving its peripherals between steps with a bounded jitter.
+ * - The flash geometry is set at build time for the sizes (FLASH_LIB_SECTOR_SIZE, FLASH_LIB_PAGE_SIZE)
+ *   and at init time for the erase units, their costs and the program granularity (`geometry` in
+ *   FlashLibConfig). The defaults match the flash of the Pico boards, where the SDK issues 4 KB
+ *   sector and 64 KB block erases. Parts with other commands provide their own drivers.
+ * - Large writes can be pipelined: with `flash_lib_start_pipelined_write`, the data is produced
+ *   page by page into the buffers of a FlashPipeline, by core1 or between the polls, while
+ *   `flash_lib_poll` programs the pages already submitted. With core1 as the producer, the
+ *   preparation (copy, CRC, compression) overlaps the programs and the throughput approaches the
+ *   program bandwidth of the flash. The producer must then run from RAM, as XIP is disabled during
+ *   the programs. FLASH_LIB_FREERTOS pauses the other core during the programs, so there the
+ *   preparation only runs between them, see tools/flash_pipeline_bench.c.
+ * - Boards with PSRAM or FRAM can put a front tier ahead of the flash (`tier` in FlashLibConfig).
+ *   Writes, rewrites and erases then land in a tier slot in microseconds, and the flash is only
+ *   written when the tier is full: the least recently written logical sectors are demoted in
+ *   batches of FLASH_LIB_TIER_DEMOTE_BATCH, each as a single rewrite of its group, so a hot logical
+ *   sector costs one erase per demotion instead of one per write. `flash_lib_tier_flush` demotes
+ *   on demand, before a power down with a volatile tier or before a sync, as the digests and
+ *   content hashes describe the flash. Transactions and the step operations work on the flash and
+ *   demote their logical sector first.
+ * - Without PSRAM, a `retained` tier in `__uninitialized_ram` stages the writes in RAM that survives
+ *   watchdog and soft resets, and init_sectors() merges it into the flash at the next boot. On a
+ *   brownout, `flash_lib_flush_for_power_loss` writes back the slots that fit in the hold-up time,
+ *   highest priority first (`flash_lib_set_tier_priority`), programming appends in place.
+ * - With `thin_provisioning` set, the init claims no group for the logical sectors that have none:
+ *   they read as blank, and the first write, rewrite or transaction claims a free group, while
+ *   `erase_logical_sector` gives the group back. The first boot then only formats the groups, and
+ *   `groups_count` can be lower than `logical_sectors_count` for sparsely used ID ranges. Once every
+ *   group is used, writes to logical sectors without a group return false and are counted in
+ *   FlashLibStats, which also reports the groups still free.
+ * - A wear budget (`wear_budget` in FlashLibConfig) caps the erase rate to what the rated cycles of
+ *   the part allow over a target lifetime. Over budget, writes are held and coalesced in the front
+ *   tier and maintenance erases are postponed, and `flash_lib_get_wear_state` reports the rate and
+ *   the budget left of every region so the application can slow down a runaway writer.
+ * - `flash_lib_scrub` checks a few groups per call in the background: states that disagree with
+ *   the mapping, free groups that are not blank, payloads that no longer match their digest (with
+ *   `merkle_tree`) and the tail of the metadata log. It repairs what it can, retires free groups
+ *   that fail to erase and reports the logical sectors it finds lost (`loss_callback` in
+ *   FlashLibConfig), and its cursor is persisted so the coverage continues across reboots, see
+ *   `flash_lib_get_scrub_stats`.
+ * - Defining FLASH_LIB_FREERTOS makes the library safe to call from several tasks, on one or both
+ *   cores: lookups run in parallel and modifications are serialized, see flash_lock.h.
  * 
  * *** Note ***
  * - It is recommended to use large logical sector sizes to improve performance and decrease 
@@ -49,13 +142,369 @@
 #ifndef FLASH_LIB_H
 #define FLASH_LIB_H
 
+#include "hardware/flash.h"
 #include "pico/stdlib.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Geometry of the flash fixed at build time, as buffers and the on-flash layout depend on it. The
+// defaults are those of the Pico boards, other parts override them in the build.
+#ifndef FLASH_LIB_SECTOR_SIZE
+#define FLASH_LIB_SECTOR_SIZE FLASH_SECTOR_SIZE // Smallest erase unit
+#endif
+
+#ifndef FLASH_LIB_PAGE_SIZE
+#define FLASH_LIB_PAGE_SIZE FLASH_PAGE_SIZE // Largest single program command
+#endif
+
+// Size of the RAM buffer of the program bursts, see FlashGeometry
+#ifndef FLASH_LIB_MAX_PROGRAM_BURST
+#define FLASH_LIB_MAX_PROGRAM_BURST (4 * FLASH_LIB_PAGE_SIZE)
+#endif
+
+// Typical duration of a page program of the flash of the Pico boards, see FlashGeometry
+#ifndef FLASH_LIB_PROGRAM_COST_US
+#define FLASH_LIB_PROGRAM_COST_US 400
+#endif
+
+#define FLASH_LIB_MAX_ERASE_UNITS 4
+
 #define GROUP_BY_1 1
 #define GROUP_BY_8 8
 #define GROUP_BY_16 16
 #define GROUP_BY_64 64
 
+// Default size of the metadata region, must be even
+#ifndef FLASH_LIB_METADATA_SECTORS
+#define FLASH_LIB_METADATA_SECTORS 4
+#endif
+
+#ifndef FLASH_LIB_MAX_TRANSACTION_SECTORS
+#define FLASH_LIB_MAX_TRANSACTION_SECTORS 8
+#endif
+
+#ifndef FLASH_LIB_WEAR_HYSTERESIS
+#define FLASH_LIB_WEAR_HYSTERESIS 32
+#endif
+
+// Attempts of flash_lib_lookup() before it reports FLASH_LOOKUP_BUSY
+#ifndef FLASH_LIB_LOOKUP_RETRIES
+#define FLASH_LIB_LOOKUP_RETRIES 4
+#endif
+
+// Results of flash_lib_lookup() and flash_lib_read_copy()
+#define FLASH_LOOKUP_OK 0
+#define FLASH_LOOKUP_BUSY 1    // Mapping being changed or logical sector being modified, try again later
+#define FLASH_LOOKUP_INVALID 2 // Logical sector or range out of bounds
+
+// Group returned by custom allocators when no group fits
+#define FLASH_LIB_NO_GROUP 0xFFFF
+
+// Placement policies for the groups assigned to logical sectors and transactions
+#define FLASH_ALLOCATOR_RANDOM 0      // Random free group
+#define FLASH_ALLOCATOR_ROUND_ROBIN 1 // Next free group after the previous one, the cursor survives power cycles
+#define FLASH_ALLOCATOR_LEAST_WORN 2  // Free group with the lowest erase count
+#define FLASH_ALLOCATOR_WEAR_AWARE 3  // Random free group, unless it is worn `wear_hysteresis` above the least worn
+#define FLASH_ALLOCATOR_CUSTOM 4      // `custom_allocator`
+
+// Page buffers of a FlashPipeline, one being programmed while the others are prepared
+#ifndef FLASH_LIB_PIPELINE_DEPTH
+#define FLASH_LIB_PIPELINE_DEPTH 3
+#endif
+
+// Node of flash_lib_get_merkle_node() covering the whole region
+#define FLASH_LIB_MERKLE_ROOT 1
+
+// Flags of rewrite_sector()
+#define FLASH_REWRITE_VERIFY 0x01 // Compares the data with the flash before skipping an unchanged rewrite
+
+// Logical sectors demoted together when the front tier is full, the least recently written first
+#ifndef FLASH_LIB_TIER_DEMOTE_BATCH
+#define FLASH_LIB_TIER_DEMOTE_BATCH 4
+#endif
+
+// Bytes of a FlashTier holding `slots_count` logical sectors: a directory, then the slots
+#define FLASH_LIB_TIER_SIZE(slots_count, logical_sector_size) (16 + (slots_count) * (8 + (logical_sector_size)))
+
+// Credit of the wear budget governor, in hours of budget, see FlashWearBudget
+#ifndef FLASH_LIB_WEAR_BURST_HOURS
+#define FLASH_LIB_WEAR_BURST_HOURS 24
+#endif
+
+// Sector erases charged to the wear budget between two records of its debts in the metadata log
+#ifndef FLASH_LIB_WEAR_CHECKPOINT
+#define FLASH_LIB_WEAR_CHECKPOINT 16
+#endif
+
+// Levels of the wear budget governor, see FlashWearState
+#define FLASH_WEAR_OK 0    // Erase rate within the budget
+#define FLASH_WEAR_DEFER 1 // Over budget: writes are held in the front tier, maintenance postpones its erases
+#define FLASH_WEAR_HOLD 2  // Over budget by more than the credit: the full front tier demotes one slot at a time,
+                           // rewrite_sector() refuses the rewrites without a front tier
+
+// Groups checked by flash_lib_scrub() between two records of its cursor in the metadata log
+#ifndef FLASH_LIB_SCRUB_CHECKPOINT
+#define FLASH_LIB_SCRUB_CHECKPOINT 16
+#endif
+
+// Results of flash_lib_get_tier()
+#define FLASH_TIER_FLASH 0 // Current version in the flash
+#define FLASH_TIER_FRONT 1 // Current version in the front tier
+
+// Operations run step by step by flash_lib_poll()
+#define FLASH_STEP_NONE 0
+#define FLASH_STEP_INIT 1
+#define FLASH_STEP_WRITE 2
+#define FLASH_STEP_ERASE 3
+#define FLASH_STEP_MAINTENANCE 4
+
+// Results of flash_lib_poll()
+#define FLASH_POLL_IDLE 0   // No operation running
+#define FLASH_POLL_BUSY 1   // Step done, call again
+#define FLASH_POLL_DONE 2   // Last step of the operation done
+#define FLASH_POLL_FAILED 3 // Last step done, but the init found no free group for some logical sectors:
+                            // they read as blank and their writes return false until a group is freed
+
+/**
+ * @brief Custom placement policy, see flash_lib_is_group_free() and flash_lib_get_group_wear().
+ *
+ * @return Index of a free group, or FLASH_LIB_NO_GROUP.
+ */
+typedef uint16_t (*flash_allocator_t)(uint16_t groups_count, void *context);
+
+// Losses reported to a flash_loss_t
+#define FLASH_LOSS_CORRUPT 0  // Payload of the group does not match its digest, left in place with its errors
+#define FLASH_LOSS_REVERTED 1 // Front tier slot dropped on a checksum mismatch, the flash holds the previous version
+
+/**
+ * @brief Called for every logical sector whose current content was found lost, by
+ * flash_lib_scrub() or by the mount of the front tier. It runs under the lock of the library, so
+ * it must not call it, only take note of the logical sector, e.g. to rewrite it later.
+ *
+ * @param loss FLASH_LOSS_*
+ */
+typedef void (*flash_loss_t)(uint16_t logical_sector, uint8_t loss, void *context);
+
+/**
+ * @brief Flash drivers of a FlashGeometry. They run with interrupts disabled while XIP is
+ * unavailable, so they must be placed in RAM (`__not_in_flash_func`).
+ */
+typedef void (*flash_erase_t)(uint32_t memory_addr, uint32_t count);
+typedef void (*flash_program_t)(uint32_t memory_addr, const uint8_t *data, uint32_t count);
+
+typedef struct FlashEraseUnit {
+    uint32_t size;    // Bytes, FLASH_LIB_SECTOR_SIZE times a power of two
+    uint32_t cost_us; // Typical duration of one erase, see program_cost_us
+} FlashEraseUnit;
+
+/**
+ * @brief Erase and program capabilities of the flash part, picked at init time.
+ *
+ * Every erase is split into aligned erase units, using a larger unit only where it costs less than
+ * the smaller ones it covers. Whole pages are programmed in bursts of up to `program_burst` bytes,
+ * and partial pages only over the granules they touch, padded with 0xFF. A granularity of 8 bytes or
+ * less never programs a metadata record twice, as required by parts with ECC. The ratios between
+ * the erase costs pick the units, and the absolute costs estimate the duration of the demotions of
+ * flash_lib_flush_for_power_loss().
+ */
+typedef struct FlashGeometry {
+    uint8_t erase_units_count;
+    FlashEraseUnit erase_units[FLASH_LIB_MAX_ERASE_UNITS]; // Increasing sizes, starting at FLASH_LIB_SECTOR_SIZE
+    uint32_t program_granularity; // Alignment and size multiple of the programs, a power of two up to FLASH_LIB_PAGE_SIZE
+    uint32_t program_burst;       // Largest program of whole pages, up to FLASH_LIB_MAX_PROGRAM_BURST
+    flash_erase_t erase;          // Erases one erase unit, NULL uses flash_range_erase
+    flash_program_t program;      // NULL uses flash_range_program
+    uint32_t program_cost_us;     // Typical duration of one page program, 0 uses FLASH_LIB_PROGRAM_COST_US
+} FlashGeometry;
+
+/**
+ * @brief Fast memory in front of the flash (PSRAM, FRAM, RAM), where the writes land first.
+ *
+ * It holds whole logical sectors in slots, see FLASH_LIB_TIER_SIZE(). The tier must be memory
+ * mapped, reads are served straight from `base` like from XIP. Every slot has a checksum, a slot
+ * whose content does not match it on init is dropped and the flash keeps the previous version.
+ *
+ * A `persistent` tier keeps its slots across power cycles. A `retained` tier is RAM left alone by
+ * the startup code, which survives watchdog and soft resets but not power loss: init_sectors()
+ * merges its slots into the flash, and flash_lib_flush_for_power_loss() saves the most important
+ * ones when a brownout is detected. Other tiers are emptied on init and must be flushed before
+ * power is lost.
+ *
+ *     static uint8_t __uninitialized_ram(tier_buffer)[FLASH_LIB_TIER_SIZE(4, FLASH_SECTOR_SIZE)]
+ *         __attribute__((aligned(4)));
+ *     FlashTier tier = {tier_buffer, sizeof(tier_buffer), .retained = true};
+ */
+typedef struct FlashTier {
+    uint8_t *base;   // Word aligned
+    uint32_t size;   // Bytes
+    bool persistent; // The content survives power cycles (FRAM), the directory is mounted on init
+    bool retained;   // The content survives resets (__uninitialized_ram), merged into the flash on init
+} FlashTier;
+
+/**
+ * @brief Target of the wear budget governor: the rated erase cycles of the part spread evenly over
+ * the target lifetime give the erase rate every region may sustain, the groups and the metadata
+ * log being tracked separately.
+ *
+ * Each region runs a budget of erases, which allows bursts of up to `burst_hours` of its budget
+ * after an idle time. Over budget, the governor defers and coalesces writes progressively, see
+ * FLASH_WEAR_*. The front tier takes no writes while within budget, and holds them in RAM once over
+ * it, so repeated writes to a logical sector cost a single demotion, while flash_lib_maintenance()
+ * postpones its erases. Without a front tier, the erases of the maintenance are postponed, and
+ * rewrite_sector() refuses the rewrites at FLASH_WEAR_HOLD, so the application should slow its
+ * writes down on its own, from flash_lib_get_wear_state().
+ *
+ * The budget is measured in uptime. The debt of every region is recorded in the metadata log every
+ * FLASH_LIB_WEAR_CHECKPOINT erases and restored on init, the time the device was off is not
+ * credited. A device that is often off gets a stricter budget than needed, never a looser one.
+ */
+typedef struct FlashWearBudget {
+    uint32_t lifetime_days; // Target lifetime of the device
+    uint32_t rated_cycles;  // Erase cycles per sector of the flash part, e.g. 100000
+    uint32_t burst_hours;   // Credit of an idle region, 0 uses FLASH_LIB_WEAR_BURST_HOURS
+} FlashWearBudget;
+
+typedef struct FlashLibConfig {
+    uint32_t lower_bound;            // The starting sector ID for the library
+    uint16_t logical_sectors_count;  // The number of logical sectors to be managed
+    uint8_t group_by;                // Number of physical sectors to group into one logical sector
+    uint16_t spare_sectors_count;    // Extra groups used to stage transactions, 0 disables transactions
+    uint16_t metadata_sectors_count; // Sectors of the metadata region, 0 uses FLASH_LIB_METADATA_SECTORS
+    uint8_t allocator;               // FLASH_ALLOCATOR_*
+    uint32_t seed;                   // Seed of the random placements, 0 seeds from the timer
+    uint16_t wear_hysteresis;        // For FLASH_ALLOCATOR_WEAR_AWARE, 0 uses FLASH_LIB_WEAR_HYSTERESIS
+    flash_allocator_t custom_allocator;
+    void *allocator_context;         // Passed to custom_allocator
+    bool content_hashes;             // Stores a content hash per logical sector, see rewrite_sector()
+    const FlashGeometry *geometry;   // NULL uses the flash of the Pico boards, see flash_lib_get_geometry()
+    bool merkle_tree;                // Tracks the digest of every logical sector, see flash_lib_get_merkle_node()
+    const FlashTier *tier;           // Front tier where the writes land first, NULL writes to the flash
+    bool thin_provisioning;          // Logical sectors get a group on their first write, see write_sector()
+    uint16_t groups_count;           // Groups of the region, 0 uses logical_sectors_count + spare_sectors_count.
+                                     // Fewer than the logical sectors requires thin_provisioning
+    const FlashWearBudget *wear_budget; // Erase rate governor, NULL disables it
+    flash_loss_t loss_callback;      // Reports the logical sectors found lost, NULL disables it
+    void *loss_context;              // Passed to loss_callback
+} FlashLibConfig;
+
+typedef struct FlashLibStats {
+    uint16_t pending_erases;     // Tombstoned logical sectors waiting for their physical erase
+    uint16_t max_pending_erases; // Backlog bound, see FLASH_LIB_MAX_PENDING_ERASES
+    uint32_t deferred_erases;    // Erases deferred with a tombstone since init
+    uint32_t forced_erases;      // Deferred erases completed early because the backlog was full
+    uint16_t released_sectors;   // Groups replaced by transactions or freed by erases, waiting to be erased as spares
+    uint16_t tier_slots_count;   // Slots of the front tier, 0 without one
+    uint16_t tier_slots_used;    // Logical sectors whose current version is in the front tier
+    uint32_t tier_demotions;     // Logical sectors written back from the front tier to the flash since init
+    uint16_t tier_slots_dropped; // Slots dropped on init because their checksum did not match
+    uint16_t free_sectors;       // Groups left for logical sectors not provisioned yet and transactions
+    uint32_t out_of_space;       // Writes refused since init because no group was free to provision their logical sector
+} FlashLibStats;
+
+typedef struct FlashWearRegion {
+    uint16_t sectors_count;   // Physical sectors of the region
+    uint32_t erases;          // Sector erases since init
+    uint32_t allowed_per_day; // Sector erases per day within the budget
+    int32_t balance;          // Sector erases left ahead of the budget, negative when over it
+} FlashWearRegion;
+
+typedef struct FlashWearState {
+    uint8_t level;            // FLASH_WEAR_*
+    FlashWearRegion payload;  // Groups of the logical sectors and spares
+    FlashWearRegion metadata; // Metadata log
+    uint16_t max_wear;        // Erase count of the most erased physical sector of the groups
+    uint32_t held_writes;     // Writes taken by the front tier instead of the flash because of the budget
+    uint32_t refused_writes;  // Rewrites refused at FLASH_WEAR_HOLD because there is no front tier
+} FlashWearState;
+
+typedef struct FlashScrubStats {
+    uint16_t cursor;          // Next group checked, the metadata log is checked at `groups_count`
+    uint16_t groups_count;    // Groups of the region
+    uint32_t passes;          // Complete passes over the region, persisted
+    uint32_t checked;         // Groups checked since init
+    uint32_t state_errors;    // Orphan, duplicate or stale staged groups released since init
+    uint32_t payload_errors;  // Groups or front tier slots that did not match their digest or checksum since init
+    uint32_t blank_errors;    // Free groups or metadata log tails found programmed since init
+    uint32_t repairs;         // Problems fixed since init: groups released or erased again, slots dropped
+    uint32_t lost_sectors;    // Live groups that did not match their digest since init, see FLASH_LOSS_CORRUPT
+    uint32_t reverted_slots;  // Front tier slots dropped since init, see FLASH_LOSS_REVERTED
+    uint16_t retired_groups;  // Groups retired for good, persisted
+} FlashScrubStats;
+
+typedef struct FlashLibProgress {
+    uint8_t operation; // FLASH_STEP_*
+    uint32_t steps;    // Calls of flash_lib_poll() so far
+    uint32_t done;     // Bytes written, sectors erased by maintenance, or groups and IDs checked by init
+    uint32_t total;
+} FlashLibProgress;
+
+/**
+ * @brief Ring of page buffers of a pipelined write, see flash_lib_start_pipelined_write(). The
+ * producer fills the buffers with flash_pipeline_acquire() and flash_pipeline_submit(), and
+ * flash_lib_poll() programs them in order.
+ */
+typedef struct FlashPipeline {
+    uint8_t buffers[FLASH_LIB_PIPELINE_DEPTH][FLASH_LIB_PAGE_SIZE] __attribute__((aligned(4)));
+    uint32_t offset_bytes;         // Where the write starts in the logical sector
+    uint32_t count;                // Bytes of the whole write
+    uint32_t submitted_bytes;      // Owned by the producer
+    volatile uint32_t submitted;   // Buffers submitted by the producer
+    volatile uint32_t programmed;  // Buffers programmed, their buffer is free again
+} FlashPipeline;
+
+typedef struct FlashTransaction {
+    uint16_t id;
+    uint8_t sectors_count;
+    uint16_t logical_ids[FLASH_LIB_MAX_TRANSACTION_SECTORS];
+    uint32_t groups[FLASH_LIB_MAX_TRANSACTION_SECTORS];
+} FlashTransaction;
+
+void init_flash_lib(uint32_t lower_bound, uint16_t logical_sectors_count, uint8_t group_by);
+void init_flash_lib_with_config(const FlashLibConfig *config);
+uint8_t *read_sector(uint16_t logical_sector, uint32_t offset_bytes);
+uint8_t flash_lib_lookup(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t **data);
+uint8_t flash_lib_read_copy(uint16_t logical_sector, uint32_t offset_bytes, void *buffer, uint32_t count);
+uint32_t get_logical_sector_size();
+bool write_sector(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count);
+bool rewrite_sector(uint16_t logical_sector, const uint8_t *data, uint32_t count, uint8_t flags);
+void erase_logical_sector(uint16_t logical_sector);
+void erase_physical_sector(uint16_t logical_sector, uint8_t physical_sector_id);
+uint16_t flash_lib_maintenance(uint16_t max_sectors);
+void get_flash_lib_stats(FlashLibStats *stats);
+bool flash_lib_is_group_free(uint16_t group);
+uint16_t flash_lib_get_group_wear(uint16_t group);
+const FlashGeometry *flash_lib_get_geometry();
+uint32_t flash_lib_get_digest(uint16_t logical_sector);
+uint32_t flash_lib_get_merkle_leaves();
+bool flash_lib_get_merkle_node(uint32_t node, uint32_t *digest);
+uint8_t flash_lib_get_tier(uint16_t logical_sector);
+uint16_t flash_lib_tier_flush(uint16_t max_sectors);
+void flash_lib_set_tier_priority(uint16_t logical_sector, uint8_t priority);
+uint16_t flash_lib_flush_for_power_loss(uint32_t budget_us);
+void flash_lib_get_wear_state(FlashWearState *state);
+uint16_t flash_lib_scrub(uint16_t max_sectors);
+void flash_lib_get_scrub_stats(FlashScrubStats *stats);
+
+bool flash_lib_start_init(const FlashLibConfig *config);
+bool flash_lib_start_write(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count);
+bool flash_lib_start_erase(uint16_t logical_sector);
+bool flash_lib_start_maintenance(uint16_t max_sectors);
+bool flash_lib_start_pipelined_write(uint16_t logical_sector, uint32_t offset_bytes, uint32_t count, FlashPipeline *pipeline);
+uint8_t *flash_pipeline_acquire(FlashPipeline *pipeline, uint32_t *count);
+void flash_pipeline_submit(FlashPipeline *pipeline);
+uint8_t flash_lib_poll(FlashLibProgress *progress);
+
+void transaction_begin(FlashTransaction *transaction);
+bool transaction_write(FlashTransaction *transaction, uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count);
+void transaction_commit(FlashTransaction *transaction);
+void transaction_abort(FlashTransaction *transaction);
+
 void flash_lib_example();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
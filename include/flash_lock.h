@@ -0,0 +1,48 @@
+/**
+ * @brief Reader/writer lock of the flash memory library region.
+ *
+ * *** Overview ***
+ * - Enabled by defining FLASH_LIB_FREERTOS (FreeRTOS, SMP or not) or FLASH_LIB_PTHREAD (host builds,
+ *   used by tools/flash_lock_bench.c). In bare-metal builds the macros below compile to nothing.
+ * - Lookups (`read_sector`, `get_flash_lib_stats`) take the lock shared, so any number of tasks
+ *   resolve logical sectors in parallel. Everything that changes the mapping or the flash (init,
+ *   writes, erases, maintenance, transactions) takes it exclusive and is serialized.
+ * - The lock covers the library state, not the data: the pointer returned by `read_sector` stays
+ *   valid only until the logical sector is erased or replaced, the application must order those
+ *   with its readers.
+ * - With FLASH_LIB_FREERTOS the flash operations go through `flash_safe_execute`, which pauses the
+ *   other core while XIP is unavailable.
+ */
+
+#ifndef FLASH_LOCK_H
+#define FLASH_LOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(FLASH_LIB_FREERTOS) || defined(FLASH_LIB_PTHREAD)
+#define FLASH_LIB_LOCKING
+
+void flash_lock_init();
+void flash_lock_read();
+void flash_unlock_read();
+void flash_lock_write();
+void flash_unlock_write();
+
+#define FLASH_LOCK_READ() flash_lock_read()
+#define FLASH_UNLOCK_READ() flash_unlock_read()
+#define FLASH_LOCK_WRITE() flash_lock_write()
+#define FLASH_UNLOCK_WRITE() flash_unlock_write()
+#else
+#define FLASH_LOCK_READ() ((void)0)
+#define FLASH_UNLOCK_READ() ((void)0)
+#define FLASH_LOCK_WRITE() ((void)0)
+#define FLASH_UNLOCK_WRITE() ((void)0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,206 @@
+/**
+ * @brief Typed persistent variables stored in flash_lib logical sectors.
+ *
+ * *** Overview ***
+ * - `persistent<T, logical_id>` binds a trivially copyable type to a logical sector and behaves
+ *   like a value of type T. Reads are served straight from the flash through XIP, with no copy.
+ * - Assigning a value equal to the stored one costs nothing, no erase and no program.
+ * - Changed values are kept in RAM and written according to the flush policy:
+ *   - `flush_policy::immediate`: written on every assignment that changes the value.
+ *   - `flush_policy::deferred`: written once `delay_ms` have passed since the first change, by
+ *     `persistent_base::poll()`. Several assignments in that window cost a single write.
+ *   - `flush_policy::manual`: only written by `flush()` or `persistent_base::flush_all()`.
+ *
+ * *** Storage ***
+ * - The value lives at the start of the logical sector, which is sector aligned. It is followed by
+ *   a 4 byte tag holding the size of T. The tag is programmed after the value, so a write
+ *   interrupted by a power loss reads as "never written" and the variable falls back to its
+ *   default value.
+ * - Each variable must own its logical sector, the library does not verify ID uniqueness.
+ *
+ * *** Example ***
+ *     struct Config { uint32_t baud; uint8_t mode; };
+ *     persistent<Config, 3> config(flush_policy::deferred, 5000);
+ *
+ *     uint32_t baud = config.get().baud;
+ *     config = Config{115200, 1};
+ *     ...
+ *     persistent_base::poll(); // in the main loop
+ */
+
+#ifndef FLASH_PERSISTENT_HPP
+#define FLASH_PERSISTENT_HPP
+
+#include "flash_lib.h"
+#include "hardware/flash.h"
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+enum class flush_policy {
+    immediate,
+    deferred,
+    manual,
+};
+
+/**
+ * @brief Type independent part of persistent variables, keeps every instance in a list so pending
+ * writes can be flushed together.
+ */
+class persistent_base {
+  public:
+    /**
+     * @brief Writes every variable with a pending change, regardless of its policy.
+     */
+    static void flush_all() {
+        for (persistent_base *node = _head; node != nullptr; node = node->_next) {
+            node->flush();
+        }
+    }
+
+    /**
+     * @brief Writes the deferred variables whose delay has passed. Should be called periodically.
+     */
+    static void poll() {
+        uint32_t now_ms = time_us_32() / 1000;
+        for (persistent_base *node = _head; node != nullptr; node = node->_next) {
+            if (node->_dirty && node->_policy == flush_policy::deferred &&
+                (uint32_t)(now_ms - node->_dirty_since_ms) >= node->_delay_ms) {
+                node->flush();
+            }
+        }
+    }
+
+    virtual void flush() = 0;
+
+    bool has_pending_write() const {
+        return _dirty;
+    }
+
+  protected:
+    persistent_base(flush_policy policy, uint32_t delay_ms) : _policy(policy), _delay_ms(delay_ms) {
+        _next = _head;
+        _head = this;
+    }
+
+    ~persistent_base() {
+        for (persistent_base **node = &_head; *node != nullptr; node = &(*node)->_next) {
+            if (*node == this) {
+                *node = _next;
+                break;
+            }
+        }
+    }
+
+    persistent_base(const persistent_base &) = delete;
+    persistent_base &operator=(const persistent_base &) = delete;
+
+    void mark_dirty() {
+        if (!_dirty) {
+            _dirty = true;
+            _dirty_since_ms = time_us_32() / 1000;
+        }
+        if (_policy == flush_policy::immediate) {
+            flush();
+        }
+    }
+
+    flush_policy _policy;
+    uint32_t _delay_ms;
+    uint32_t _dirty_since_ms = 0;
+    bool _dirty = false;
+
+  private:
+    persistent_base *_next;
+    static inline persistent_base *_head = nullptr;
+};
+
+template <typename T, uint16_t logical_id>
+class persistent : public persistent_base {
+    static_assert(std::is_trivially_copyable<T>::value, "persistent<T> requires a trivially copyable type");
+    static_assert(alignof(T) <= FLASH_LIB_PAGE_SIZE, "persistent<T> alignment is limited to a flash page");
+
+    static constexpr uint32_t align_up(uint32_t value, uint32_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    static constexpr uint32_t TAG = 0x50000000u | sizeof(T);
+    static constexpr uint32_t VALUE_OFFSET = 0;
+    static constexpr uint32_t TAG_OFFSET = align_up(sizeof(T), sizeof(uint32_t));
+
+    static_assert(TAG_OFFSET + sizeof(uint32_t) <= FLASH_LIB_SECTOR_SIZE, "persistent<T> must fit in one physical sector");
+
+  public:
+    explicit persistent(flush_policy policy = flush_policy::immediate, uint32_t delay_ms = 1000)
+        : persistent_base(policy, delay_ms) {}
+
+    ~persistent() {
+        flush();
+    }
+
+    /**
+     * @brief Current value. Points into the flash when there is no pending write, so the
+     * reference is only valid until the next assignment.
+     */
+    const T &get() const {
+        if (_dirty) {
+            return _pending;
+        }
+
+        const T *stored = stored_value();
+        return stored != nullptr ? *stored : _default;
+    }
+
+    operator const T &() const {
+        return get();
+    }
+
+    persistent &operator=(const T &value) {
+        if (memcmp(&get(), &value, sizeof(T)) == 0) {
+            return *this;
+        }
+
+        _pending = value;
+        mark_dirty();
+        return *this;
+    }
+
+    /**
+     * @brief Writes the pending value, if any. The value stays pending if the flash library refused
+     * a write, so the next flush tries again.
+     */
+    void flush() override {
+        if (!_dirty) {
+            return;
+        }
+
+        // A deferred flush may end up with the value already stored, after changing it back
+        const T *stored = stored_value();
+        if (stored != nullptr && memcmp(stored, &_pending, sizeof(T)) == 0) {
+            _dirty = false;
+            return;
+        }
+
+        erase_logical_sector(logical_id);
+        if (!write_sector(logical_id, VALUE_OFFSET, reinterpret_cast<const uint8_t *>(&_pending), sizeof(T)) ||
+            !write_sector(logical_id, TAG_OFFSET, reinterpret_cast<const uint8_t *>(&TAG), sizeof(TAG))) {
+            return;
+        }
+        _dirty = false;
+    }
+
+  private:
+    static const T *stored_value() {
+        uint32_t tag;
+        memcpy(&tag, read_sector(logical_id, TAG_OFFSET), sizeof(tag));
+        if (tag != TAG) {
+            return nullptr;
+        }
+        return reinterpret_cast<const T *>(read_sector(logical_id, VALUE_OFFSET));
+    }
+
+    T _pending{};
+    T _default{};
+};
+
+#endif
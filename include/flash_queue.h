@@ -0,0 +1,69 @@
+/**
+ * @brief Persistent FIFO queue on top of the flash memory library.
+ *
+ * *** Overview ***
+ * - A queue uses a range of consecutive logical sectors as a ring of fixed size slots, one message
+ *   of up to `message_size` bytes per slot.
+ * - `queue_push` programs the next slot, `queue_pop` acknowledges the oldest message by clearing
+ *   the ack byte of its slot. Neither erases: a logical sector is erased once all its messages are
+ *   acknowledged, so a message costs about one program of its pages and one of its ack byte.
+ * - Pushes and acks both progress in slot order, so the programmed slots and the acknowledged
+ *   slots of a logical sector are prefixes. `queue_init` recovers the head and the tail with a
+ *   binary search in the newest and the oldest logical sector, O(log n) slot reads.
+ * - Every message carries a checksum. A push torn by a power loss leaves a slot that fails it,
+ *   which `queue_peek` acknowledges and skips. A power loss before an ack delivers the message
+ *   again, the queue is at-least-once.
+ * - Clearing the ack byte programs a byte a second time, which the NOR flash of the Pico boards
+ *   allows but flash parts with ECC (program_granularity of a FlashGeometry) do not.
+ *
+ * *** Usage ***
+ *     FlashQueue queue;
+ *     queue_init(&queue, 50, 4, 64);
+ *     queue_push(&queue, message, length);
+ *     while (queue_peek(&queue, &data, &length) && uplink_send(data, length)) {
+ *         queue_pop(&queue);
+ *     }
+ */
+
+#ifndef FLASH_QUEUE_H
+#define FLASH_QUEUE_H
+
+#include "flash_lib.h"
+#include "hardware/flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest message, a slot then takes up to a page
+#ifndef QUEUE_MAX_MESSAGE_SIZE
+#define QUEUE_MAX_MESSAGE_SIZE (FLASH_LIB_PAGE_SIZE - 12)
+#endif
+
+typedef struct FlashQueue {
+    uint16_t first_logical_id;
+    uint16_t sectors_count;
+    uint16_t message_size;
+    uint32_t slot_size;
+    uint32_t slots_per_sector;
+
+    uint16_t head_sector; // Next slot pushed
+    uint32_t head_slot;
+    uint16_t tail_sector; // Oldest slot not acknowledged
+    uint32_t tail_slot;
+    uint32_t next_sequence;
+
+    uint8_t slot_buffer[12 + QUEUE_MAX_MESSAGE_SIZE] __attribute__((aligned(4))); // Header and payload of a slot
+} FlashQueue;
+
+void queue_init(FlashQueue *queue, uint16_t first_logical_id, uint16_t sectors_count, uint16_t message_size);
+bool queue_push(FlashQueue *queue, const void *data, uint16_t length);
+bool queue_peek(FlashQueue *queue, const uint8_t **data, uint16_t *length);
+bool queue_pop(FlashQueue *queue);
+uint32_t queue_get_count(FlashQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * @brief Store of small versioned records on top of the flash memory library.
+ *
+ * *** Overview ***
+ * - A record store uses a range of consecutive logical sectors as a ring. Records are identified
+ *   by a number below `ids_count` and hold up to RECORDS_MAX_SIZE bytes.
+ * - Every write appends a new version of the record after the previous records of the head logical
+ *   sector, then marks the previous version stale by clearing a bit of its header. Neither needs an
+ *   erase, so a logical sector of 4 KB takes about a hundred updates of a 16 byte record per erase,
+ *   instead of one erase per update for a record in its own logical sector.
+ * - A RAM index, provided by the caller, gives the location of the current version of every record.
+ *   Reads are served straight from XIP.
+ * - When the head logical sector is full, the store moves to the next one. The ring always keeps an
+ *   erased logical sector: when none is left, the live records of the oldest logical sector are
+ *   copied to the head and the oldest one is erased. The live records must fit in the range minus
+ *   one logical sector, writes that would exceed it fail.
+ * - Every record carries a checksum and a version. `records_init` rebuilds the index by scanning
+ *   the range: a torn record is ignored and the previous version is used, and when a power loss
+ *   left two versions live, the older one is marked stale.
+ * - Clearing the stale bit programs a byte a second time, which the NOR flash of the Pico boards
+ *   allows but flash parts with ECC (program_granularity of a FlashGeometry) do not.
+ *
+ * *** Usage ***
+ *     RecordStore store;
+ *     uint32_t index[32];
+ *     records_init(&store, 40, 4, index, 32);
+ *     records_write(&store, CONFIG_RECORD, &config, sizeof(config));
+ *     records_read(&store, CONFIG_RECORD, &data, &length);
+ */
+
+#ifndef FLASH_RECORDS_H
+#define FLASH_RECORDS_H
+
+#include "flash_lib.h"
+#include "hardware/flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest payload of a record
+#ifndef RECORDS_MAX_SIZE
+#define RECORDS_MAX_SIZE 240
+#endif
+
+// Index entry of a record that was never written or was deleted
+#define RECORDS_NO_RECORD 0xFFFFFFFF
+
+typedef struct RecordStore {
+    uint16_t first_logical_id;
+    uint16_t sectors_count;
+    uint32_t sector_size;
+    uint32_t *index; // Location of the current version of every record: logical sector * sector_size + offset
+    uint16_t ids_count;
+
+    uint16_t oldest_sector;
+    uint16_t head_sector;
+    uint32_t head_offset;
+    uint32_t next_sequence;
+    uint32_t live_bytes; // Bytes of the current versions, headers included
+
+    uint8_t record_buffer[16 + RECORDS_MAX_SIZE] __attribute__((aligned(4))); // Header and payload of a record
+} RecordStore;
+
+void records_init(RecordStore *store, uint16_t first_logical_id, uint16_t sectors_count, uint32_t *index, uint16_t ids_count);
+bool records_read(RecordStore *store, uint16_t id, const uint8_t **data, uint16_t *length);
+bool records_write(RecordStore *store, uint16_t id, const void *data, uint16_t length);
+bool records_delete(RecordStore *store, uint16_t id);
+uint32_t records_get_free_bytes(RecordStore *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+/**
+ * @brief Compile-time directory of logical IDs, looked up by name through a perfect hash.
+ *
+ * *** Overview ***
+ * - `flash_registry<Names>` maps a fixed list of names to logical IDs. `Names` is a struct
+ *   holding the names, the number of logical sectors of the library and a hash seed.
+ * - The logical ID of a name is `hash(name, seed) % logical_sectors_count`. Everything is
+ *   computed by the compiler, `FLASH_ID(registry, "name")` is a constant and costs nothing at
+ *   runtime. It can be used as a template argument, e.g. for `persistent<T, logical_id>`.
+ * - The build fails if a name is listed twice, if two names hash to the same logical ID, if there
+ *   are more names than logical sectors or if `FLASH_ID` is given a name that is not listed.
+ *
+ * *** Stability ***
+ * - The ID of a name only depends on the name, the seed and `logical_sectors_count`, not on the
+ *   other names or their order. Adding a name never moves the existing ones, it can only collide.
+ * - Changing the seed or the count moves every name to another logical sector, so both are part of
+ *   the layout stored in flash. `flash_registry_seed()` finds a collision-free seed for the first
+ *   release, the returned value should then be written as a literal. A later collision is solved
+ *   by renaming the new name, not by changing the seed.
+ * - Every logical ID may be taken by a name, so logical sectors should not be numbered by hand
+ *   next to a registry covering the same range.
+ *
+ * *** Example ***
+ *     struct AppNames {
+ *         static constexpr const char *names[] = {"config", "calibration", "event_log"};
+ *         static constexpr uint16_t logical_sectors_count = 16;
+ *         static constexpr uint32_t seed = 0;
+ *     };
+ *     using app_ids = flash_registry<AppNames>;
+ *
+ *     persistent<Config, FLASH_ID(app_ids, "config")> config;
+ *     write_sector(FLASH_ID(app_ids, "event_log"), 0, data, size);
+ */
+
+#ifndef FLASH_REGISTRY_HPP
+#define FLASH_REGISTRY_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+/**
+ * @brief Logical ID of a listed name, as a compile-time constant.
+ */
+#define FLASH_ID(registry, name) (flash_registry_constant<registry::id(name)>::value)
+
+namespace flash_registry_detail {
+
+constexpr uint16_t INVALID_ID = 0xFFFF;
+
+// FNV-1a with the seed folded into the offset basis, then the murmur3 finalizer so the low bits
+// used by the modulo depend on every character
+constexpr uint32_t hash(const char *name, uint32_t seed) {
+    uint32_t value = 2166136261u ^ seed * 0x9E3779B9u;
+    for (; *name != '\0'; ++name) {
+        value = (value ^ (uint8_t)*name) * 16777619u;
+    }
+    value ^= value >> 16;
+    value *= 0x85EBCA6Bu;
+    value ^= value >> 13;
+    value *= 0xC2B2AE35u;
+    value ^= value >> 16;
+    return value;
+}
+
+constexpr bool equal(const char *a, const char *b) {
+    for (; *a != '\0' && *a == *b; ++a, ++b) {
+    }
+    return *a == *b;
+}
+
+template <size_t N>
+constexpr bool has_duplicates(const char *const (&names)[N]) {
+    for (size_t i = 0; i < N; ++i) {
+        for (size_t j = i + 1; j < N; ++j) {
+            if (equal(names[i], names[j])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+template <size_t N>
+constexpr bool is_perfect(const char *const (&names)[N], uint16_t logical_sectors_count, uint32_t seed) {
+    for (size_t i = 0; i < N; ++i) {
+        for (size_t j = i + 1; j < N; ++j) {
+            if (hash(names[i], seed) % logical_sectors_count == hash(names[j], seed) % logical_sectors_count) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace flash_registry_detail
+
+/**
+ * @brief First seed, below `max_seed`, that gives every name its own logical ID. Returns
+ * 0xFFFFFFFF if there is none, the registry then needs more logical sectors.
+ */
+template <size_t N>
+constexpr uint32_t flash_registry_seed(const char *const (&names)[N], uint16_t logical_sectors_count,
+                                       uint32_t max_seed = 4096) {
+    for (uint32_t seed = 0; seed < max_seed; ++seed) {
+        if (flash_registry_detail::is_perfect(names, logical_sectors_count, seed)) {
+            return seed;
+        }
+    }
+    return 0xFFFFFFFF;
+}
+
+template <typename Names>
+class flash_registry {
+    static constexpr size_t COUNT = std::extent<decltype(Names::names)>::value;
+
+    static_assert(Names::logical_sectors_count > 0 && Names::logical_sectors_count < flash_registry_detail::INVALID_ID,
+                  "flash_registry needs between 1 and 65534 logical sectors");
+    static_assert(COUNT <= Names::logical_sectors_count, "flash_registry has more names than logical sectors");
+    static_assert(!flash_registry_detail::has_duplicates(Names::names), "flash_registry lists a name twice");
+    static_assert(flash_registry_detail::is_perfect(Names::names, Names::logical_sectors_count, Names::seed),
+                  "flash_registry: two names share a logical ID with this seed, rename the new one");
+
+  public:
+    /**
+     * @brief Logical ID of `name`, 0xFFFF if it is not listed. Prefer FLASH_ID(), which evaluates
+     * it at compile time and rejects unknown names.
+     */
+    static constexpr uint16_t id(const char *name) {
+        for (size_t i = 0; i < COUNT; ++i) {
+            if (flash_registry_detail::equal(Names::names[i], name)) {
+                return flash_registry_detail::hash(name, Names::seed) % Names::logical_sectors_count;
+            }
+        }
+        return flash_registry_detail::INVALID_ID;
+    }
+
+    static constexpr size_t size() {
+        return COUNT;
+    }
+};
+
+template <uint16_t logical_id>
+struct flash_registry_constant {
+    static_assert(logical_id != flash_registry_detail::INVALID_ID, "FLASH_ID: the name is not in the registry");
+    static constexpr uint16_t value = logical_id;
+};
+
+#endif
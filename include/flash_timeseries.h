@@ -0,0 +1,78 @@
+/**
+ * @brief Time-series store on top of the flash memory library.
+ *
+ * *** Overview ***
+ * - A time series uses a range of consecutive logical sectors as a ring of flash pages. Records are
+ *   a 4 byte timestamp followed by a fixed size payload, appended with non decreasing timestamps.
+ * - Records are gathered in a RAM page and programmed one full page at a time. `timeseries_flush`
+ *   programs a partially filled page, the rest of that page is left unused.
+ * - Every page starts with a small header holding a sequence number, the first and last timestamps
+ *   of its records and optionally the min/max/sum of one int32_t field of the payload. These
+ *   headers are the sparse index: locating a time range is a binary search over pages, O(log n)
+ *   page header reads, and aggregates over a range only decode the records of its boundary pages.
+ * - When the last logical sector is full, the oldest logical sector is erased and reused.
+ * - The state (oldest and newest page) is recovered on `timeseries_init` by reading the first page
+ *   header of every logical sector and a binary search in the newest one.
+ *
+ * *** Usage ***
+ *     TimeSeries ts;
+ *     timeseries_init(&ts, 10, 4, sizeof(Sample), offsetof(Sample, temperature));
+ *     timeseries_append(&ts, now, &sample);
+ *     timeseries_query(&ts, t1, t2, print_sample, NULL);
+ *     timeseries_aggregate(&ts, t1, t2, &summary);
+ */
+
+#ifndef FLASH_TIMESERIES_H
+#define FLASH_TIMESERIES_H
+
+#include "flash_lib.h"
+#include "hardware/flash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMESERIES_NO_SUMMARY -1
+
+typedef struct TimeSeriesSummary {
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+} TimeSeriesSummary;
+
+typedef struct TimeSeries {
+    uint16_t first_logical_id;
+    uint16_t sectors_count;
+    uint16_t record_size;
+    int16_t value_offset;
+
+    uint16_t records_per_page;
+    uint32_t pages_per_sector;
+    uint16_t oldest_sector;
+    uint16_t head_sector;
+    uint32_t head_page;
+    uint32_t next_sequence;
+
+    uint16_t buffered_records;
+    uint8_t page_buffer[FLASH_LIB_PAGE_SIZE] __attribute__((aligned(8)));
+} TimeSeries;
+
+/**
+ * @brief Called for every record found by timeseries_query().
+ *
+ * @return false to stop the query.
+ */
+typedef bool (*timeseries_callback_t)(uint32_t timestamp, const uint8_t *payload, void *context);
+
+void timeseries_init(TimeSeries *ts, uint16_t first_logical_id, uint16_t sectors_count, uint16_t record_size, int16_t value_offset);
+bool timeseries_append(TimeSeries *ts, uint32_t timestamp, const void *payload);
+bool timeseries_flush(TimeSeries *ts);
+uint32_t timeseries_query(TimeSeries *ts, uint32_t t1, uint32_t t2, timeseries_callback_t callback, void *context);
+bool timeseries_aggregate(TimeSeries *ts, uint32_t t1, uint32_t t2, TimeSeriesSummary *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
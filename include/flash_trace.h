@@ -0,0 +1,82 @@
+/**
+ * @brief Optional trace of the flash memory library operations.
+ *
+ * *** Overview ***
+ * - Enabled by defining FLASH_LIB_TRACE (the FLASH_LIB_TRACE CMake option). Without it the hooks
+ *   compile to nothing and the functions below do nothing.
+ * - Every API call of the library (init, writes, erases, maintenance and transactions) and every
+ *   erase and program it issues to the flash is recorded as a 20 byte entry in a RAM ring of
+ *   FLASH_LIB_TRACE_ENTRIES entries, with its start time and duration in microseconds. When the
+ *   ring is full the oldest entries are overwritten and counted as dropped.
+ * - API calls are recorded when they return, so the flash operations issued by a call are found
+ *   right before it. Reads are not recorded, read_sector only returns a pointer.
+ * - `flash_trace_drain` prints the entries over stdio as text lines starting with "FLT", so they can
+ *   be captured from the serial console along with any other output. tools/flash_replay.c replays a
+ *   captured trace against the library on an emulated flash image.
+ *
+ * *** Usage ***
+ *     init_flash_lib(100, 10, GROUP_BY_8);
+ *     ...
+ *     flash_trace_drain(); // periodically, or on a console command
+ */
+
+#ifndef FLASH_TRACE_H
+#define FLASH_TRACE_H
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef FLASH_LIB_TRACE_ENTRIES
+#define FLASH_LIB_TRACE_ENTRIES 128
+#endif
+
+// API calls. Unless noted, logical_id, offset and length are the arguments of the call.
+#define FLASH_OP_INIT 1               // logical_id: logical sectors, offset: lower bound, arg: group_by, length: spare | metadata << 16
+#define FLASH_OP_WRITE 2              // arg: 1 if refused because no group was free to provision the logical sector
+#define FLASH_OP_ERASE_LOGICAL 3
+#define FLASH_OP_ERASE_PHYSICAL 4     // arg: physical sector ID
+#define FLASH_OP_MAINTENANCE 5        // length: max_sectors, arg: erases still pending (saturated)
+#define FLASH_OP_TRANSACTION_BEGIN 6  // logical_id: transaction ID
+#define FLASH_OP_TRANSACTION_WRITE 7  // arg: 1 if the write succeeded
+#define FLASH_OP_TRANSACTION_COMMIT 8 // logical_id: transaction ID, length: sectors count
+#define FLASH_OP_TRANSACTION_ABORT 9  // logical_id: transaction ID, length: sectors count
+#define FLASH_OP_REWRITE 10           // arg: 0 if skipped because the content was unchanged or no group was free
+#define FLASH_OP_TIER_FLUSH 11        // length: max_sectors, arg: front tier slots still used (saturated)
+#define FLASH_OP_POWER_LOSS_FLUSH 12  // length: budget_us, offset: slots demoted, arg: front tier slots still used (saturated)
+#define FLASH_OP_SCRUB 13             // length: max_sectors, offset: scrub cursor after the call, arg: problems found (saturated)
+
+// Operations issued to the flash, offset is the flash address and length the number of bytes
+#define FLASH_OP_FLASH_ERASE 16
+#define FLASH_OP_FLASH_PROGRAM 17
+
+typedef struct FlashTraceEntry {
+    uint32_t timestamp; // Start of the operation, from time_us_32()
+    uint32_t duration;  // Microseconds
+    uint32_t offset;
+    uint32_t length;
+    uint16_t logical_id;
+    uint8_t op;
+    uint8_t arg;
+} FlashTraceEntry;
+
+#ifdef FLASH_LIB_TRACE
+#define FLASH_TRACE_BEGIN() uint32_t _trace_start = time_us_32()
+#define FLASH_TRACE_END(op, arg, logical_id, offset, length) flash_trace_record(op, arg, logical_id, offset, length, _trace_start)
+#else
+#define FLASH_TRACE_BEGIN() ((void)0)
+#define FLASH_TRACE_END(op, arg, logical_id, offset, length) ((void)0)
+#endif
+
+void flash_trace_record(uint8_t op, uint8_t arg, uint16_t logical_id, uint32_t offset, uint32_t length, uint32_t start);
+uint16_t flash_trace_read(FlashTraceEntry *entries, uint16_t max_entries);
+void flash_trace_drain();
+uint32_t flash_trace_dropped();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,676 @@
+#include "flash_btree.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE_MAGIC 0xB7EE2024
+
+#define NODE_FLAG_LEAF 0x01
+#define NODE_FLAG_ROOT 0x02
+
+// Entries of inner nodes hold the smallest key of a child and its node address as value
+#define CHILD_SIZE sizeof(uint32_t)
+
+typedef struct NodeHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint8_t flags;
+    uint8_t reserved;
+    uint16_t count;
+    uint16_t offsets[];
+} NodeHeader;
+
+typedef struct Entry {
+    const uint8_t *key;
+    uint8_t key_len;
+    const uint8_t *value;
+    uint8_t value_len;
+} Entry;
+
+/**
+ * @brief Describes a node as a source node with entries [index, index + removed) replaced by
+ * the added entries, which is all a commit ever changes in a node.
+ */
+typedef struct NodeEdit {
+    const NodeHeader *source;
+    uint16_t index;
+    uint16_t removed;
+    uint8_t added_count;
+    Entry added[2];
+    uint32_t children[2];
+} NodeEdit;
+
+typedef struct ScanRange {
+    const uint8_t *start;
+    uint8_t start_len;
+    const uint8_t *end;
+    uint8_t end_len;
+    const uint8_t *prefix;
+    uint8_t prefix_len;
+} ScanRange;
+
+const NodeHeader *_btree_get_node(BTree *tree, uint32_t node);
+uint32_t _btree_get_used_nodes(BTree *tree);
+Entry _btree_get_entry(const NodeHeader *node, uint16_t index);
+uint32_t _btree_get_child(const NodeHeader *node, uint16_t index);
+int _btree_compare_keys(const uint8_t *a, uint8_t a_len, const uint8_t *b, uint8_t b_len);
+uint16_t _btree_lower_bound(const NodeHeader *node, const uint8_t *key, uint8_t key_len);
+uint16_t _btree_find_child(const NodeHeader *node, const uint8_t *key, uint8_t key_len);
+uint16_t _btree_get_edit_count(const NodeEdit *edit);
+Entry _btree_get_edit_entry(const NodeEdit *edit, uint16_t index);
+uint32_t _btree_get_entry_size(Entry entry);
+uint32_t _btree_write_node(BTree *tree, const NodeEdit *edit, uint16_t from, uint16_t to, uint8_t flags);
+uint8_t _btree_commit_edit(BTree *tree, NodeEdit *edit, uint8_t flags, bool is_root, uint32_t *nodes);
+uint8_t _btree_get_height(BTree *tree);
+bool _btree_commit_path(BTree *tree, uint32_t *path, uint16_t *path_index, uint8_t depth, NodeEdit *edit);
+bool _btree_ensure_free_nodes(BTree *tree);
+uint32_t _btree_relocate(BTree *tree, uint32_t node, uint32_t victim_begin, uint32_t victim_end, bool is_root);
+bool _btree_scan_node(BTree *tree, uint32_t node, const ScanRange *range, btree_callback_t callback, void *context, uint32_t *found);
+
+/**
+ * @brief Mounts a tree over a range of logical sectors, recovering its root from flash.
+ *
+ * @param tree Tree to initialize.
+ * @param first_logical_id First logical sector of the range.
+ * @param sectors_count Number of logical sectors in the range, at least 3.
+ */
+void btree_init(BTree *tree, uint16_t first_logical_id, uint16_t sectors_count) {
+    assert(sectors_count >= 3);
+
+    tree->first_logical_id = first_logical_id;
+    tree->sectors_count = sectors_count;
+    tree->nodes_per_sector = get_logical_sector_size() / FLASH_LIB_SECTOR_SIZE;
+    tree->root = BTREE_NO_NODE;
+
+    // Newest logical sector is the one whose first node has the highest sequence
+    bool found = false;
+    uint32_t newest_sequence = 0;
+    tree->head_sector = 0;
+    for (uint16_t sector = 0; sector < sectors_count; ++sector) {
+        const NodeHeader *node = _btree_get_node(tree, sector * tree->nodes_per_sector);
+        if (node->magic == NODE_MAGIC && (!found || node->sequence > newest_sequence)) {
+            found = true;
+            newest_sequence = node->sequence;
+            tree->head_sector = sector;
+        }
+    }
+
+    // Empty tree, the first logical sector may hold stale data and is erased before the first node
+    if (!found) {
+        tree->oldest_sector = 0;
+        tree->head_slot = 0;
+        tree->next_sequence = 0;
+        erase_logical_sector(first_logical_id);
+        return;
+    }
+
+    // Nodes are programmed in order, so the programmed ones are a prefix of the sector
+    uint32_t first_node = tree->head_sector * tree->nodes_per_sector;
+    uint32_t low = 1;
+    uint32_t high = tree->nodes_per_sector;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (_btree_get_node(tree, first_node + middle)->magic == NODE_MAGIC) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    tree->head_slot = low;
+    tree->next_sequence = _btree_get_node(tree, first_node + low - 1)->sequence + 1;
+
+    // Reclaimed sectors are erased, the oldest one is the first programmed sector after the head
+    tree->oldest_sector = tree->head_sector;
+    for (uint16_t i = 1; i < sectors_count; ++i) {
+        uint16_t sector = (tree->head_sector + i) % sectors_count;
+        if (_btree_get_node(tree, sector * tree->nodes_per_sector)->magic == NODE_MAGIC) {
+            tree->oldest_sector = sector;
+            break;
+        }
+    }
+
+    // Last committed root, walking back from the newest node
+    uint32_t used_nodes = _btree_get_used_nodes(tree);
+    uint32_t total_nodes = tree->sectors_count * tree->nodes_per_sector;
+    uint32_t head = tree->head_sector * tree->nodes_per_sector + tree->head_slot;
+    for (uint32_t i = 1; i <= used_nodes; ++i) {
+        uint32_t node = (head + total_nodes - i) % total_nodes;
+        if (_btree_get_node(tree, node)->flags & NODE_FLAG_ROOT) {
+            tree->root = node;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Looks up a key.
+ *
+ * @param value Set to the value, pointing straight into the flash. Valid until the next commit.
+ * @param value_len Set to the value length.
+ * @return false if the key is not in the tree.
+ */
+bool btree_get(BTree *tree, const uint8_t *key, uint8_t key_len, const uint8_t **value, uint8_t *value_len) {
+    if (tree->root == BTREE_NO_NODE) {
+        return false;
+    }
+
+    const NodeHeader *node = _btree_get_node(tree, tree->root);
+    while (!(node->flags & NODE_FLAG_LEAF)) {
+        if (node->count == 0) {
+            return false;
+        }
+        node = _btree_get_node(tree, _btree_get_child(node, _btree_find_child(node, key, key_len)));
+    }
+
+    uint16_t index = _btree_lower_bound(node, key, key_len);
+    if (index == node->count) {
+        return false;
+    }
+
+    Entry entry = _btree_get_entry(node, index);
+    if (_btree_compare_keys(entry.key, entry.key_len, key, key_len) != 0) {
+        return false;
+    }
+
+    if (value != NULL) {
+        *value = entry.value;
+    }
+    if (value_len != NULL) {
+        *value_len = entry.value_len;
+    }
+    return true;
+}
+
+/**
+ * @brief Inserts or replaces a key, committing the change.
+ *
+ * @return false if the key or value is too large, the tree is out of space, or the flash library
+ * refused a write (thin provisioning without a free group).
+ */
+bool btree_put(BTree *tree, const uint8_t *key, uint8_t key_len, const uint8_t *value, uint8_t value_len) {
+    if (key_len > BTREE_MAX_KEY_SIZE || value_len > BTREE_MAX_VALUE_SIZE) {
+        return false;
+    }
+
+    // Skips the commit if the key already holds the same value
+    const uint8_t *stored_value;
+    uint8_t stored_value_len;
+    if (btree_get(tree, key, key_len, &stored_value, &stored_value_len) && stored_value_len == value_len &&
+        memcmp(stored_value, value, value_len) == 0) {
+        return true;
+    }
+
+    if (!_btree_ensure_free_nodes(tree)) {
+        return false;
+    }
+
+    uint32_t path[BTREE_MAX_HEIGHT];
+    uint16_t path_index[BTREE_MAX_HEIGHT];
+    uint8_t depth = 0;
+
+    NodeEdit edit = {.added_count = 1, .added = {{key, key_len, value, value_len}}};
+
+    if (tree->root == BTREE_NO_NODE) {
+        edit.source = NULL;
+        edit.index = 0;
+        edit.removed = 0;
+        return _btree_commit_path(tree, path, path_index, 0, &edit);
+    }
+
+    uint32_t node_address = tree->root;
+    const NodeHeader *node = _btree_get_node(tree, node_address);
+    while (!(node->flags & NODE_FLAG_LEAF)) {
+        assert(depth < BTREE_MAX_HEIGHT);
+        path[depth] = node_address;
+        path_index[depth] = _btree_find_child(node, key, key_len);
+        node_address = _btree_get_child(node, path_index[depth]);
+        node = _btree_get_node(tree, node_address);
+        depth++;
+    }
+
+    edit.source = node;
+    edit.index = _btree_lower_bound(node, key, key_len);
+    Entry existing = edit.index < node->count ? _btree_get_entry(node, edit.index) : (Entry){0};
+    edit.removed = edit.index < node->count && _btree_compare_keys(existing.key, existing.key_len, key, key_len) == 0;
+    return _btree_commit_path(tree, path, path_index, depth, &edit);
+}
+
+/**
+ * @brief Removes a key, committing the change.
+ *
+ * @return false if the key is not in the tree, the tree is out of space, or the flash library
+ * refused a write.
+ */
+bool btree_delete(BTree *tree, const uint8_t *key, uint8_t key_len) {
+    if (!btree_get(tree, key, key_len, NULL, NULL) || !_btree_ensure_free_nodes(tree)) {
+        return false;
+    }
+
+    uint32_t path[BTREE_MAX_HEIGHT];
+    uint16_t path_index[BTREE_MAX_HEIGHT];
+    uint8_t depth = 0;
+
+    uint32_t node_address = tree->root;
+    const NodeHeader *node = _btree_get_node(tree, node_address);
+    while (!(node->flags & NODE_FLAG_LEAF)) {
+        path[depth] = node_address;
+        path_index[depth] = _btree_find_child(node, key, key_len);
+        node_address = _btree_get_child(node, path_index[depth]);
+        node = _btree_get_node(tree, node_address);
+        depth++;
+    }
+
+    NodeEdit edit = {
+        .source = node,
+        .index = _btree_lower_bound(node, key, key_len),
+        .removed = 1,
+        .added_count = 0,
+    };
+    return _btree_commit_path(tree, path, path_index, depth, &edit);
+}
+
+/**
+ * @brief Calls the callback, in key order, for every entry between start and end, inclusive.
+ *
+ * @param start Smallest key to visit, NULL to start from the first key.
+ * @param end Largest key to visit, NULL to go up to the last key.
+ * @return Number of entries visited.
+ */
+uint32_t btree_scan(BTree *tree, const uint8_t *start, uint8_t start_len, const uint8_t *end, uint8_t end_len, btree_callback_t callback, void *context) {
+    ScanRange range = {start, start_len, end, end_len, NULL, 0};
+    uint32_t found = 0;
+    if (tree->root != BTREE_NO_NODE) {
+        _btree_scan_node(tree, tree->root, &range, callback, context, &found);
+    }
+    return found;
+}
+
+/**
+ * @brief Calls the callback, in key order, for every entry whose key starts with the prefix.
+ *
+ * @return Number of entries visited.
+ */
+uint32_t btree_scan_prefix(BTree *tree, const uint8_t *prefix, uint8_t prefix_len, btree_callback_t callback, void *context) {
+    ScanRange range = {prefix, prefix_len, NULL, 0, prefix, prefix_len};
+    uint32_t found = 0;
+    if (tree->root != BTREE_NO_NODE) {
+        _btree_scan_node(tree, tree->root, &range, callback, context, &found);
+    }
+    return found;
+}
+
+const NodeHeader *_btree_get_node(BTree *tree, uint32_t node) {
+    uint16_t logical_id = tree->first_logical_id + node / tree->nodes_per_sector;
+    uint32_t offset = (node % tree->nodes_per_sector) * FLASH_LIB_SECTOR_SIZE;
+    return (const NodeHeader *)read_sector(logical_id, offset);
+}
+
+uint32_t _btree_get_used_nodes(BTree *tree) {
+    uint16_t full_sectors = (tree->head_sector + tree->sectors_count - tree->oldest_sector) % tree->sectors_count;
+    return full_sectors * tree->nodes_per_sector + tree->head_slot;
+}
+
+Entry _btree_get_entry(const NodeHeader *node, uint16_t index) {
+    const uint8_t *data = (const uint8_t *)node + node->offsets[index];
+    Entry entry = {
+        .key = data + 2,
+        .key_len = data[0],
+        .value = data + 2 + data[0],
+        .value_len = data[1],
+    };
+    return entry;
+}
+
+uint32_t _btree_get_child(const NodeHeader *node, uint16_t index) {
+    uint32_t child;
+    memcpy(&child, _btree_get_entry(node, index).value, CHILD_SIZE);
+    return child;
+}
+
+int _btree_compare_keys(const uint8_t *a, uint8_t a_len, const uint8_t *b, uint8_t b_len) {
+    int result = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (result != 0) {
+        return result;
+    }
+    return (int)a_len - (int)b_len;
+}
+
+/**
+ * @brief Index of the first entry with a key greater or equal to the given key.
+ */
+uint16_t _btree_lower_bound(const NodeHeader *node, const uint8_t *key, uint8_t key_len) {
+    uint16_t low = 0;
+    uint16_t high = node->count;
+    while (low < high) {
+        uint16_t middle = (low + high) / 2;
+        Entry entry = _btree_get_entry(node, middle);
+        if (_btree_compare_keys(entry.key, entry.key_len, key, key_len) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Index of the child that may hold the key, the first child also takes keys smaller than
+ * every separator.
+ */
+uint16_t _btree_find_child(const NodeHeader *node, const uint8_t *key, uint8_t key_len) {
+    uint16_t index = _btree_lower_bound(node, key, key_len);
+    if (index < node->count) {
+        Entry entry = _btree_get_entry(node, index);
+        if (_btree_compare_keys(entry.key, entry.key_len, key, key_len) == 0) {
+            return index;
+        }
+    }
+    return index > 0 ? index - 1 : 0;
+}
+
+uint16_t _btree_get_edit_count(const NodeEdit *edit) {
+    uint16_t source_count = edit->source != NULL ? edit->source->count : 0;
+    return source_count - edit->removed + edit->added_count;
+}
+
+Entry _btree_get_edit_entry(const NodeEdit *edit, uint16_t index) {
+    if (index < edit->index) {
+        return _btree_get_entry(edit->source, index);
+    }
+    if (index < edit->index + edit->added_count) {
+        return edit->added[index - edit->index];
+    }
+    return _btree_get_entry(edit->source, index - edit->added_count + edit->removed);
+}
+
+uint32_t _btree_get_entry_size(Entry entry) {
+    return sizeof(uint16_t) + 2 + entry.key_len + entry.value_len;
+}
+
+/**
+ * @brief Builds a node from entries [from, to) of an edit and appends it to the log.
+ *
+ * @return Address of the new node, or BTREE_NO_NODE if the flash library refused the write.
+ */
+uint32_t _btree_write_node(BTree *tree, const NodeEdit *edit, uint16_t from, uint16_t to, uint8_t flags) {
+    // Moves to the next logical sector, which is always free thanks to _btree_ensure_free_nodes()
+    if (tree->head_slot == tree->nodes_per_sector) {
+        tree->head_sector = (tree->head_sector + 1) % tree->sectors_count;
+        tree->head_slot = 0;
+        erase_logical_sector(tree->first_logical_id + tree->head_sector);
+    }
+
+    NodeHeader *node = (NodeHeader *)tree->node_buffer;
+    node->magic = NODE_MAGIC;
+    node->sequence = tree->next_sequence;
+    node->flags = flags;
+    node->reserved = 0xFF;
+    node->count = to - from;
+
+    uint32_t used = sizeof(NodeHeader) + node->count * sizeof(uint16_t);
+    for (uint16_t i = from; i < to; ++i) {
+        Entry entry = _btree_get_edit_entry(edit, i);
+        uint8_t *data = tree->node_buffer + used;
+        data[0] = entry.key_len;
+        data[1] = entry.value_len;
+        memcpy(data + 2, entry.key, entry.key_len);
+        memcpy(data + 2 + entry.key_len, entry.value, entry.value_len);
+        node->offsets[i - from] = used;
+        used += 2 + entry.key_len + entry.value_len;
+    }
+    assert(used <= BTREE_NODE_SIZE);
+
+    uint32_t address = tree->head_sector * tree->nodes_per_sector + tree->head_slot;
+    uint32_t offset = tree->head_slot * FLASH_LIB_SECTOR_SIZE;
+    if (!write_sector(tree->first_logical_id + tree->head_sector, offset, tree->node_buffer, used)) {
+        return BTREE_NO_NODE;
+    }
+    tree->next_sequence++;
+    tree->head_slot++;
+    return address;
+}
+
+/**
+ * @brief Writes the node described by an edit, split in two if it does not fit.
+ *
+ * @param is_root Flags the node as root if it is not split. Split halves are never flagged, so a
+ * power loss before their new root is written falls back to the previous commit.
+ * @param nodes Set to the addresses of the written nodes, BTREE_NO_NODE for a failed write.
+ * @return Number of nodes written, 0 if the edit leaves no entries.
+ */
+uint8_t _btree_commit_edit(BTree *tree, NodeEdit *edit, uint8_t flags, bool is_root, uint32_t *nodes) {
+    uint16_t count = _btree_get_edit_count(edit);
+    if (count == 0) {
+        return 0;
+    }
+
+    uint32_t total = sizeof(NodeHeader);
+    for (uint16_t i = 0; i < count; ++i) {
+        total += _btree_get_entry_size(_btree_get_edit_entry(edit, i));
+    }
+
+    if (total <= BTREE_NODE_SIZE) {
+        nodes[0] = _btree_write_node(tree, edit, 0, count, is_root ? flags | NODE_FLAG_ROOT : flags);
+        return 1;
+    }
+
+    // Splits where the first half reaches half of the entries size
+    uint32_t left = sizeof(NodeHeader);
+    uint16_t split = 0;
+    while (split < count - 1 && left < total / 2) {
+        left += _btree_get_entry_size(_btree_get_edit_entry(edit, split));
+        split++;
+    }
+    if (split == 0) {
+        split = 1;
+    }
+
+    nodes[0] = _btree_write_node(tree, edit, 0, split, flags);
+    nodes[1] = _btree_write_node(tree, edit, split, count, flags);
+    return 2;
+}
+
+/**
+ * @brief Applies a leaf edit and copies the path up to a new root, which commits the change.
+ *
+ * @return false if the flash library refused a write. The root is unchanged, and the nodes written
+ * so far are ignored like the ones of a commit interrupted by a power loss.
+ */
+bool _btree_commit_path(BTree *tree, uint32_t *path, uint16_t *path_index, uint8_t depth, NodeEdit *edit) {
+    uint8_t flags = NODE_FLAG_LEAF;
+    uint32_t nodes[2];
+
+    while (true) {
+        uint8_t written = _btree_commit_edit(tree, edit, flags, depth == 0, nodes);
+        for (uint8_t i = 0; i < written; ++i) {
+            if (nodes[i] == BTREE_NO_NODE) {
+                return false;
+            }
+        }
+
+        if (depth == 0) {
+            uint32_t root = nodes[0];
+            if (written == 0) {
+                // Tree is now empty, an empty leaf keeps the commit marker
+                NodeEdit empty = {.source = NULL};
+                root = _btree_write_node(tree, &empty, 0, 0, NODE_FLAG_LEAF | NODE_FLAG_ROOT);
+            } else if (written == 2) {
+                // Root was split, the two halves get a new root above them
+                NodeEdit split = {.source = NULL, .index = 0, .removed = 0, .added_count = 2};
+                for (uint8_t i = 0; i < 2; ++i) {
+                    Entry first = _btree_get_entry(_btree_get_node(tree, nodes[i]), 0);
+                    split.children[i] = nodes[i];
+                    split.added[i] = (Entry){first.key, first.key_len, (const uint8_t *)&split.children[i], CHILD_SIZE};
+                }
+                root = _btree_write_node(tree, &split, 0, 2, NODE_FLAG_ROOT);
+            }
+
+            if (root == BTREE_NO_NODE) {
+                return false;
+            }
+            tree->root = root;
+            return true;
+        }
+
+        // Parent now points to the written nodes instead of the old child
+        depth--;
+        const NodeHeader *parent = _btree_get_node(tree, path[depth]);
+        NodeEdit parent_edit = {
+            .source = parent,
+            .index = path_index[depth],
+            .removed = 1,
+            .added_count = written,
+        };
+        // Separators are the actual first keys, the old one may be above every key of a split child 0
+        for (uint8_t i = 0; i < written; ++i) {
+            Entry first = _btree_get_entry(_btree_get_node(tree, nodes[i]), 0);
+            parent_edit.children[i] = nodes[i];
+            parent_edit.added[i] = (Entry){first.key, first.key_len, (const uint8_t *)&parent_edit.children[i], CHILD_SIZE};
+        }
+        *edit = parent_edit;
+        for (uint8_t i = 0; i < written; ++i) {
+            edit->added[i].value = (const uint8_t *)&edit->children[i];
+        }
+        flags = 0;
+    }
+}
+
+/**
+ * @brief Makes sure a commit has room, reclaiming the oldest logical sectors if needed.
+ *
+ * One logical sector is always kept free on top of the worst case commit (a split at every
+ * level), so neither a commit nor a relocation runs out of space while in progress.
+ *
+ * @return false if there is no room, or if a relocation failed, in which case the oldest logical
+ * sector is kept and the tree is unchanged.
+ */
+bool _btree_ensure_free_nodes(BTree *tree) {
+    uint32_t total_nodes = tree->sectors_count * tree->nodes_per_sector;
+    uint32_t reserve = tree->nodes_per_sector + 2 * _btree_get_height(tree) + 2;
+
+    for (uint16_t i = 0; i < tree->sectors_count && total_nodes - _btree_get_used_nodes(tree) < reserve; ++i) {
+        if (tree->oldest_sector == tree->head_sector) {
+            return false;
+        }
+
+        // Once its live nodes are copied, nothing references the oldest sector anymore
+        uint32_t victim_begin = tree->oldest_sector * tree->nodes_per_sector;
+        uint32_t victim_end = victim_begin + tree->nodes_per_sector;
+        if (tree->root != BTREE_NO_NODE) {
+            uint32_t root = _btree_relocate(tree, tree->root, victim_begin, victim_end, true);
+            if (root == BTREE_NO_NODE) {
+                return false;
+            }
+            tree->root = root;
+        }
+
+        erase_logical_sector(tree->first_logical_id + tree->oldest_sector);
+        tree->oldest_sector = (tree->oldest_sector + 1) % tree->sectors_count;
+    }
+
+    // Still short after a full round, the live tree is too large for the range
+    return total_nodes - _btree_get_used_nodes(tree) >= reserve;
+}
+
+uint8_t _btree_get_height(BTree *tree) {
+    if (tree->root == BTREE_NO_NODE) {
+        return 0;
+    }
+
+    uint8_t height = 1;
+    const NodeHeader *node = _btree_get_node(tree, tree->root);
+    while (!(node->flags & NODE_FLAG_LEAF) && node->count > 0) {
+        node = _btree_get_node(tree, _btree_get_child(node, 0));
+        height++;
+    }
+    return height;
+}
+
+/**
+ * @brief Copies to the head of the log every node of a subtree stored in the victim range, along
+ * with their ancestors.
+ *
+ * @return Address of the subtree root, unchanged if nothing had to move, or BTREE_NO_NODE if the
+ * flash library refused a write or the RAM copy of a node could not be allocated.
+ */
+uint32_t _btree_relocate(BTree *tree, uint32_t node_address, uint32_t victim_begin, uint32_t victim_end, bool is_root) {
+    const NodeHeader *node = _btree_get_node(tree, node_address);
+    bool in_victim = node_address >= victim_begin && node_address < victim_end;
+    uint8_t flags = (node->flags & NODE_FLAG_LEAF) | (is_root ? NODE_FLAG_ROOT : 0);
+
+    if (node->flags & NODE_FLAG_LEAF) {
+        if (!in_victim) {
+            return node_address;
+        }
+        NodeEdit copy = {.source = node};
+        return _btree_write_node(tree, &copy, 0, node->count, flags);
+    }
+
+    // Children addresses are patched in a RAM copy, one per tree level while relocating
+    uint8_t *copy = NULL;
+    for (uint16_t i = 0; i < node->count; ++i) {
+        uint32_t child = _btree_get_child(node, i);
+        uint32_t relocated = _btree_relocate(tree, child, victim_begin, victim_end, false);
+        if (relocated == BTREE_NO_NODE) {
+            free(copy);
+            return BTREE_NO_NODE;
+        }
+        if (relocated == child) {
+            continue;
+        }
+
+        if (copy == NULL) {
+            copy = (uint8_t *)malloc(BTREE_NODE_SIZE);
+            if (copy == NULL) {
+                return BTREE_NO_NODE;
+            }
+            memcpy(copy, node, BTREE_NODE_SIZE);
+        }
+        const NodeHeader *copy_node = (const NodeHeader *)copy;
+        memcpy((uint8_t *)_btree_get_entry(copy_node, i).value, &relocated, CHILD_SIZE);
+    }
+
+    if (copy == NULL && !in_victim) {
+        return node_address;
+    }
+
+    NodeEdit edit = {.source = copy != NULL ? (const NodeHeader *)copy : node};
+    uint32_t relocated = _btree_write_node(tree, &edit, 0, node->count, flags);
+    free(copy);
+    return relocated;
+}
+
+bool _btree_scan_node(BTree *tree, uint32_t node_address, const ScanRange *range, btree_callback_t callback, void *context, uint32_t *found) {
+    const NodeHeader *node = _btree_get_node(tree, node_address);
+    bool leaf = node->flags & NODE_FLAG_LEAF;
+
+    uint16_t first = 0;
+    if (range->start != NULL && node->count > 0) {
+        first = leaf ? _btree_lower_bound(node, range->start, range->start_len) : _btree_find_child(node, range->start, range->start_len);
+    }
+
+    for (uint16_t i = first; i < node->count; ++i) {
+        Entry entry = _btree_get_entry(node, i);
+
+        // Every key of an entry (or of a child after the first) is at least its separator key
+        bool past_end = range->end != NULL && _btree_compare_keys(entry.key, entry.key_len, range->end, range->end_len) > 0;
+        bool past_prefix = range->prefix != NULL && _btree_compare_keys(entry.key, entry.key_len, range->prefix, range->prefix_len) > 0 &&
+                           (entry.key_len < range->prefix_len || memcmp(entry.key, range->prefix, range->prefix_len) != 0);
+        if ((leaf || i > first) && (past_end || past_prefix)) {
+            return false;
+        }
+
+        if (!leaf) {
+            if (!_btree_scan_node(tree, _btree_get_child(node, i), range, callback, context, found)) {
+                return false;
+            }
+            continue;
+        }
+
+        (*found)++;
+        if (!callback(entry.key, entry.key_len, entry.value, entry.value_len, context)) {
+            return false;
+        }
+    }
+    return true;
+}
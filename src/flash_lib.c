@@ -1,313 +1,3913 @@
 #include "flash_lib.h"
+#include "flash_lock.h"
+#include "flash_trace.h"
 #include "hardware/flash.h"
 #include "hardware/sync.h"
+#ifdef FLASH_LIB_FREERTOS
+#include "pico/flash.h"
+#endif
 #include <assert.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define MEMORY_SIGNATURE 0x27062021
-#define SIGNATURE_SIZE_BYTES 4
-#define SIGNATURE_POSITION 0
-#define LOGICAL_ID_POSITION 1
-#define WRITE_COUNT_POSITION 2
-#define PHYSICAL_ID_POSITION 3
 
-typedef struct SectorHeader {
+// Logical ID of formatted groups not assigned to any logical sector
+#define FREE_LOGICAL_ID 0xFFFF
+// Entry of _logical_map for logical IDs without a group
+#define NO_GROUP FLASH_LIB_NO_GROUP
+
+// Group flags, kept in RAM and persisted by the group records of the metadata log
+#define GROUP_FLAG_TOMBSTONE 0x01 // Logical sector erased, physical erase pending
+#define GROUP_FLAG_STAGED 0x02    // Written by a transaction, only live once committed
+#define GROUP_FLAG_RELEASED 0x04  // Replaced by a newer group, waiting to be formatted as free
+#define GROUP_FLAG_RETIRED 0x08   // Failed a check of the scrubber, never used again
+#define GROUP_FLAG_UNKNOWN 0x80   // No record of the group was found, its payload must be checked
+
+// Metadata record types, an erased record ends the log
+#define RECORD_GROUP 0x01       // New state of a group
+#define RECORD_ERASE_COUNT 0x02 // Erase count of a physical sector, only written by snapshots
+#define RECORD_ERASE 0x03       // Run of physical sectors erased once more
+#define RECORD_COMMIT 0x04      // Commit point of a transaction
+#define RECORD_HASH 0x05        // Content hash of a group, split in logical_id (low) and transaction (high)
+#define RECORD_DIGEST 0x06      // Digest of a group for the Merkle tree, split like RECORD_HASH
+#define RECORD_SCRUB 0x07       // Cursor of the scrubber in index, completed passes split like RECORD_HASH
+#define RECORD_WEAR 0x08        // Wear budget debt of the region in index, in seconds split like RECORD_HASH
+#define RECORD_NONE 0xFF
+
+// Content hash of a group whose content is unknown, never produced by _content_hash()
+#define CONTENT_HASH_NONE 0
+
+// Digest of a group being programmed, recomputed from the flash on init if a power loss left it so
+#define DIGEST_UNKNOWN 0xFFFFFFFF
+
+#ifndef FLASH_LIB_MAX_PENDING_ERASES
+#define FLASH_LIB_MAX_PENDING_ERASES 8
+#endif
+
+// Directory of the front tier: signature of a formatted tier, slot of logical IDs outside of the
+// tier and entry of a free slot. An entry holds the logical ID and its complement, so a torn or
+// stray entry is never taken for a slot.
+#define TIER_SIGNATURE 0x54494552
+#define TIER_NO_SLOT 0xFFFF
+#define TIER_ENTRY_FREE 0xFFFFFFFF
+
+// Metadata records a single step of flash_lib_poll() can defer
+#define STEP_MAX_RECORDS 4
+
+// Phases of a step-by-step initialization, see init_sectors()
+#define STEP_INIT_MOUNT 0
+#define STEP_INIT_SWEEP 1
+#define STEP_INIT_BOOKKEEPING 2
+#define STEP_INIT_CLAIM 3
+#define STEP_INIT_SNAPSHOT 4
+#define STEP_INIT_DONE 5
+
+// Regions tracked by the wear budget governor
+#define WEAR_PAYLOAD 0
+#define WEAR_METADATA 1
+#define WEAR_REGIONS_COUNT 2
+
+#define US_PER_DAY 86400000000ull
+#define US_PER_HOUR 3600000000ull
+#define US_PER_SECOND 1000000ll
+
+/**
+ * Start of each half of the metadata region. A half is only used once `complete` was programmed to
+ * zero, after its snapshot, and the complete half with the highest sequence is the current one.
+ */
+typedef struct MetadataHeader {
+    uint32_t signature;
+    uint32_t sequence;
+    uint32_t complete;
+    uint32_t cursor; // Round-robin allocator cursor at the time of the snapshot
+} MetadataHeader;
+
+typedef struct MetadataRecord {
+    uint8_t type;
+    uint8_t flags;        // Group flags, or number of sectors erased
+    uint16_t index;       // Group index, or physical sector index from _lower_bound
+    uint16_t logical_id;  // Logical ID of the group, or erase count
+    uint16_t transaction; // Transaction of a staged group or of a commit
+} MetadataRecord;
+
+// Start of the front tier, followed by one directory entry per slot, then the slots
+typedef struct TierHeader {
     uint32_t signature;
-    uint16_t logicalID;
-    uint16_t writeCount;
-    uint8_t id;
-} SectorHeader;
+    uint32_t slot_size;
+    uint32_t slots_count;
+    uint32_t reserved;
+} TierHeader;
+
+typedef struct TierEntry {
+    uint32_t logical_id; // Logical ID and its complement, or TIER_ENTRY_FREE
+    uint32_t checksum;   // Sum of the word digests of the slot, see _tier_checksum()
+} TierEntry;
+
+typedef struct GroupState {
+    uint16_t logical_id;
+    uint16_t transaction;
+    uint8_t flags;
+} GroupState;
+
+// Operation run by flash_lib_poll()
+typedef struct StepState {
+    uint8_t operation; // FLASH_STEP_*
+    uint8_t phase;
+    bool finished;
+    uint16_t logical_sector;
+    uint32_t offset_bytes;
+    const uint8_t *data;
+    uint32_t count;
+    uint16_t max_sectors;
+    uint32_t cursor; // Group or logical ID reached by the initialization
+    bool mounted;
+    bool failed;          // The init left logical sectors without a group, see FLASH_POLL_FAILED
+    uint16_t erase_group; // Group erased one physical sector per step, or NO_GROUP
+    bool erase_to_free;   // The erased group is formatted as free instead of losing its tombstone
+    uint32_t trace_start;
+    FlashPipeline *pipeline; // Source of a pipelined write instead of `data`, or NULL
+    FlashLibProgress progress;
+} StepState;
+
+uint32_t _lower_bound;
+uint32_t _upper_bound;
+uint16_t _logical_sectors_count;
+uint16_t _spare_sectors_count;
+uint8_t _group_by;
+uint16_t _groups_count;
+
+// Metadata log, in the sectors right before the groups, split into two halves used alternately
+uint32_t _metadata_lower_bound;
+uint16_t _metadata_sectors_count;
+uint8_t _metadata_half;
+uint32_t _metadata_sequence;
+uint32_t _metadata_head; // Offset of the next record in the current half
+bool _metadata_mounted = false;
+// Half being written by a compaction done in steps, -1 if none, and sectors erased plus pages
+// programmed so far
+int8_t _compact_half = -1;
+uint32_t _compact_position;
+
+// State of every group and erase count of every physical sector, rebuilt from the metadata log on init
+GroupState *_groups = NULL;
+uint16_t *_erase_counts = NULL;
+// Content hash of every group written by rewrite_sector(), NULL unless content_hashes is set
+uint32_t *_content_hashes = NULL;
+// Group index of every logical ID
+uint16_t *_logical_map = NULL;
+// Digest of the content of every group, and Merkle tree of the digests of the logical sectors:
+// node 1 is the root, the children of node n are 2n and 2n + 1, and logical sector i is the leaf
+// _merkle_leaves + i. NULL unless merkle_tree is set.
+uint32_t *_digests = NULL;
+uint32_t *_merkle_nodes = NULL;
+uint32_t _merkle_leaves = 0;
+
+// Front tier, see FlashTier. Slot i holds the current version of logical sector _tier_slots[i],
+// and _tier_map gives the slot of every logical ID. No slots without a tier.
+uint8_t *_tier_base = NULL;
+bool _tier_persistent = false;
+bool _tier_retained = false;
+uint16_t _tier_slots_count = 0;
+uint16_t *_tier_slots = NULL;
+uint16_t *_tier_map = NULL;
+// Write clock of every slot at its last write, the oldest slots are demoted first
+uint32_t *_tier_ages = NULL;
+uint32_t _tier_clock = 0;
+uint32_t _tier_demotions_total = 0;
+uint32_t _tier_dropped_total = 0;
+// Priority of every logical ID for flash_lib_flush_for_power_loss(), 0 by default
+uint8_t *_tier_priorities = NULL;
+
+// Wear budget governor, see FlashWearBudget. Each region owes the time its erases took out of the
+// budget, minus the time elapsed since: a positive debt means it erases faster than the budget.
+// The debts are persisted every FLASH_LIB_WEAR_CHECKPOINT erases and by the compactions.
+bool _wear_budget_set = false;
+uint64_t _wear_us_per_erase[WEAR_REGIONS_COUNT];
+int64_t _wear_debt_us[WEAR_REGIONS_COUNT];
+uint32_t _wear_erases[WEAR_REGIONS_COUNT];
+uint16_t _wear_sectors_count[WEAR_REGIONS_COUNT];
+int64_t _wear_burst_us;
+uint64_t _wear_last_us;
+uint32_t _wear_held_total = 0;
+uint32_t _wear_refused_total = 0;
+uint32_t _wear_unsaved_erases = 0;
+
+// Next group checked by flash_lib_scrub() and completed passes over the region, persisted every
+// FLASH_LIB_SCRUB_CHECKPOINT groups, and the problems found since init
+uint16_t _scrub_cursor = 0;
+uint32_t _scrub_passes = 0;
+uint32_t _scrub_checked_total = 0;
+uint32_t _scrub_state_errors = 0;
+uint32_t _scrub_payload_errors = 0;
+uint32_t _scrub_blank_errors = 0;
+uint32_t _scrub_repairs = 0;
+uint32_t _scrub_lost_total = 0;
+uint32_t _scrub_reverted_total = 0;
+
+// Sequence lock of the mapping, read without any lock by flash_lib_lookup(). It is odd while the
+// mapping is being changed or a flash operation has XIP disabled. Updates nest, only the outermost
+// one moves the sequence.
+volatile uint32_t _map_sequence = 0;
+uint8_t _map_update_depth = 0;
+// Group whose payload is being erased or programmed, lookups of its logical sector are busy
+volatile uint16_t _busy_group = NO_GROUP;
+
+uint16_t _next_transaction = 0;
+bool _transaction_active = false;
+
+// Placement of new groups, see FLASH_ALLOCATOR_*
+uint8_t _allocator;
+flash_allocator_t _custom_allocator;
+void *_allocator_context;
+flash_loss_t _loss_callback;
+void *_loss_context;
+uint16_t _wear_hysteresis;
+uint32_t _random_state;
+// Next group tried by the round-robin allocator, persisted by the metadata log
+uint16_t _allocation_cursor = 0;
+
+// One bit per physical sector of the region. A set bit means the sector may hold programmed
+// payload and must be checked before being skipped by an erase.
+uint8_t *_dirty_slots = NULL;
+
+// Logical sectors that were tombstoned and still wait for their physical erase, oldest first
+uint16_t _pending_erases[FLASH_LIB_MAX_PENDING_ERASES];
+uint16_t _pending_erases_count = 0;
+uint32_t _deferred_erases_total = 0;
+uint32_t _forced_erases_total = 0;
+
+// Groups replaced by a transaction, formatted back into free groups by flash_lib_maintenance()
+uint16_t _released_groups_count = 0;
+
+// With thin provisioning, logical sectors get a group on their first write and give it back when
+// they are erased
+bool _thin_provisioning = false;
+uint32_t _out_of_space_total = 0;
+// Set once the init rebuilt the logical map, a logical sector still without a group reads as blank
+bool _map_built = false;
+
+StepState _step = {.operation = FLASH_STEP_NONE, .erase_group = NO_GROUP};
+// While a step runs, metadata records are queued and programmed by the next steps, one per step
+bool _step_defer_records = false;
+MetadataRecord _step_records[STEP_MAX_RECORDS];
+uint8_t _step_records_count = 0;
+bool _step_compact_requested = false;
+
+// Geometry of the flash part, and whether each erase unit is used or left to the smaller ones
+// because it costs more than them
+const FlashGeometry _default_geometry = {
+    .erase_units_count = 2,
+    .erase_units = {{FLASH_LIB_SECTOR_SIZE, 45000}, {FLASH_BLOCK_SIZE, 150000}},
+    .program_granularity = FLASH_LIB_PAGE_SIZE,
+    .program_burst = FLASH_LIB_MAX_PROGRAM_BURST,
+    .erase = NULL,
+    .program = NULL,
+    .program_cost_us = FLASH_LIB_PROGRAM_COST_US,
+};
+FlashGeometry _geometry;
+bool _erase_unit_used[FLASH_LIB_MAX_ERASE_UNITS];
+// Whole pages of a program burst, copied to RAM as the source may be in flash
+uint8_t _program_buffer[FLASH_LIB_MAX_PROGRAM_BURST];
+
+// Served by read_sector() for logical sectors that read as blank, lives in flash so it costs no
+// RAM. Two physical sectors long, so a whole physical sector can be read from any offset into it.
+const uint8_t _blank_sector[2 * FLASH_LIB_SECTOR_SIZE] = {[0 ... 2 * FLASH_LIB_SECTOR_SIZE - 1] = 0xFF};
+
+uint32_t _get_random_physical_sector();
+uint32_t _get_round_robin_group();
+uint32_t _get_least_worn_group();
+uint32_t _get_wear_aware_group();
+uint32_t _allocate_group();
+uint32_t _random();
+uint8_t *get_sector_read_pointer(uint32_t physical_sector_address);
+void init_sectors();
+void _configure(const FlashLibConfig *config);
+void delete_sectors(uint32_t begin, uint32_t end);
+void delete_sector(uint32_t physical_sector);
+bool get_first_sector_from_logical_id(uint16_t logical_id, uint32_t *physical_addr);
+bool get_physical_sector_from_logical_id(uint16_t logical_id, uint8_t physical_sector_id, uint32_t *physical_addr);
+uint32_t get_memory_addr_from_physical_sector(uint32_t physical_sector);
+void _configure_geometry(const FlashGeometry *geometry);
+void _flash_erase(uint32_t memory_addr, uint32_t count);
+void _flash_erase_unit(uint32_t memory_addr, uint32_t count);
+void _flash_program(uint32_t memory_addr, const uint8_t *data, uint32_t count);
+void _program_padded(uint32_t memory_addr, const uint8_t *data, uint32_t count);
+void prepare_buffer_to_write(uint8_t *buffer, const void *data, uint8_t data_size);
+bool _is_slot_dirty(uint32_t physical_sector);
+void _mark_slot_dirty(uint32_t physical_sector);
+void _mark_slot_clean(uint32_t physical_sector);
+bool _is_payload_blank(uint32_t physical_sector);
+bool _is_tombstoned(uint16_t logical_id);
+bool _is_group_live(uint16_t group);
+bool _is_group_free(uint16_t group);
+uint16_t _get_group_index(uint32_t first_physical_sector);
+uint32_t _get_group_first_sector(uint16_t group);
+void _set_group_state(uint16_t group, uint16_t logical_id, uint8_t flags, uint16_t transaction);
+void _program_group(uint32_t first_physical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count);
+void _erase_dirty_slots(uint32_t first_physical_sector);
+bool _erase_next_dirty_run(uint32_t first_physical_sector, uint8_t max_sectors);
+bool _is_slot_erased(uint32_t physical_sector);
+void _record_erase(uint32_t physical_sector, uint8_t sectors_count);
+void _complete_deferred_erase(uint16_t logical_sector);
+void _push_pending_erase(uint16_t logical_sector);
+void _remove_pending_erase(uint16_t logical_sector);
+void _claim_group(uint32_t first_physical_sector, uint16_t logical_id, uint8_t flags, uint16_t transaction);
+void _format_free_group(uint32_t first_physical_sector);
+void _release_group(uint32_t first_physical_sector);
+uint32_t _get_free_group();
+void _apply_transaction(uint16_t transaction);
+bool _provision_logical_sector(uint16_t logical_sector);
+uint16_t _get_free_groups_count();
+uint32_t _get_metadata_half_size();
+uint32_t _get_metadata_addr(uint8_t half, uint32_t offset);
+bool _metadata_mount();
+void _metadata_replay(const MetadataRecord *record);
+void _metadata_append(const MetadataRecord *record);
+void _metadata_compact();
+bool _metadata_compact_step(uint16_t max_sectors);
+uint32_t _get_metadata_snapshot_size();
+void _metadata_snapshot_page(uint32_t page, uint8_t *pageBuffer);
+void _map_update_begin();
+void _map_update_end();
+void _set_busy_group(uint16_t group);
+void _set_content_hash(uint16_t group, uint32_t hash);
+void _content_hash_record(uint16_t group, MetadataRecord *record);
+uint32_t _content_hash(const uint8_t *data, uint32_t count);
+uint32_t _digest_word(uint32_t index, uint32_t word);
+uint32_t _digest_delta(const uint8_t *content, uint32_t offset_bytes, const uint8_t *data, uint32_t count);
+void _add_digest(uint16_t group, uint32_t delta);
+void _log_digest(uint16_t group, uint32_t digest);
+void _digest_record(uint16_t group, uint32_t digest, MetadataRecord *record);
+void _merkle_update(uint16_t logical_id);
+void _merkle_rebuild();
+uint32_t _merkle_combine(uint32_t left, uint32_t right);
+void _tombstone_logical_sector(uint16_t logical_sector);
+void _rewrite_group(uint16_t logical_sector, const uint8_t *data, uint32_t count, uint32_t hash);
+void _tier_mount();
+volatile TierEntry *_tier_entries();
+uint8_t *_tier_slot_data(uint16_t slot);
+uint32_t _tier_checksum(uint16_t slot);
+void _tier_set_entry(uint16_t slot, uint16_t logical_id);
+uint16_t _tier_promote(uint16_t logical_sector, const uint8_t *data, uint32_t count);
+uint16_t _tier_get_free_slot();
+uint16_t _tier_slots_used();
+void _tier_write(uint16_t slot, uint32_t offset_bytes, const uint8_t *data, uint32_t count);
+bool _tier_fill(uint16_t slot, const uint8_t *data, uint32_t count);
+bool _tier_can_program_in_place(uint16_t slot);
+uint32_t _tier_demote_cost_us(uint16_t slot);
+void _tier_demote(uint16_t slot);
+void _tier_demote_oldest(uint16_t max_sectors);
+void _tier_demote_logical(uint16_t logical_sector);
+void _tier_discard(uint16_t logical_sector);
+bool _tier_takes_writes();
+void _wear_configure(const FlashWearBudget *budget);
+int64_t _wear_debt_at(uint8_t region, uint64_t now);
+void _wear_update();
+void _wear_record_erase(uint32_t memory_addr, uint32_t count);
+uint8_t _wear_level();
+void _wear_checkpoint();
+void _wear_record(uint8_t region, MetadataRecord *record);
+uint32_t _scrub_problems();
+void _scrub_group(uint16_t group);
+void _scrub_metadata();
+void _report_loss(uint16_t logical_sector, uint8_t loss);
+void _scrub_retire(uint16_t group);
+bool _is_group_blank(uint32_t first_physical_sector);
+void _scrub_record(MetadataRecord *record);
+uint8_t _lookup_address(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t **data);
+void _step_start(uint8_t operation);
+void _step_finish();
+bool _step_housekeeping();
+void _step_erase();
+void _step_begin_erase(uint16_t group, bool to_free);
+bool _step_force_pending_erase();
+void _step_advance();
+void _step_init();
+void _step_write();
+void _step_erase_logical();
+void _step_maintenance();
+
+/**
+ * @brief Initializes the flash memory library.
+ *
+ * @param lower_bound The starting sector ID for the library.
+ * @param logical_sectors_count The number of logical sectors to be managed.
+ * @param group_by Number of physical sectors to group into one logical sector.
+ */
+void init_flash_lib(uint32_t lower_bound, uint16_t logical_sectors_count, uint8_t group_by) {
+    FlashLibConfig config = {
+        .lower_bound = lower_bound,
+        .logical_sectors_count = logical_sectors_count,
+        .group_by = group_by,
+        .spare_sectors_count = 0,
+        .metadata_sectors_count = 0,
+        .allocator = FLASH_ALLOCATOR_RANDOM,
+        .seed = 0,
+    };
+    init_flash_lib_with_config(&config);
+}
+
+/**
+ * @brief Initializes the flash memory library with the optional features of FlashLibConfig.
+ */
+void init_flash_lib_with_config(const FlashLibConfig *config) {
+#ifdef FLASH_LIB_LOCKING
+    flash_lock_init();
+#endif
+    FLASH_LOCK_WRITE();
+    assert(_step.operation == FLASH_STEP_NONE);
+    FLASH_TRACE_BEGIN();
+    _map_update_begin();
+    _configure(config);
+    init_sectors();
+    _map_update_end();
+
+    FLASH_TRACE_END(FLASH_OP_INIT, _group_by, _logical_sectors_count, _metadata_lower_bound,
+                    _spare_sectors_count | (uint32_t)_metadata_sectors_count << 16);
+    FLASH_UNLOCK_WRITE();
+}
+
+/**
+ * @brief Sets up the configuration and the RAM state of the library, before the metadata is mounted.
+ */
+void _configure(const FlashLibConfig *config) {
+    _logical_sectors_count = config->logical_sectors_count;
+    _spare_sectors_count = config->spare_sectors_count;
+    _group_by = config->group_by;
+    _groups_count = config->groups_count > 0 ? config->groups_count : _logical_sectors_count + _spare_sectors_count;
+    _thin_provisioning = config->thin_provisioning;
+    _out_of_space_total = 0;
+    _map_built = false;
+    _metadata_lower_bound = config->lower_bound;
+    _metadata_sectors_count = config->metadata_sectors_count > 0 ? config->metadata_sectors_count : FLASH_LIB_METADATA_SECTORS;
+    _lower_bound = _metadata_lower_bound + _metadata_sectors_count;
+    _upper_bound = _lower_bound + _groups_count * _group_by;
+    _transaction_active = false;
+    _metadata_mounted = false;
+    _compact_half = -1;
+    _allocator = config->allocator;
+    _custom_allocator = config->custom_allocator;
+    _allocator_context = config->allocator_context;
+    _loss_callback = config->loss_callback;
+    _loss_context = config->loss_context;
+    _wear_hysteresis = config->wear_hysteresis > 0 ? config->wear_hysteresis : FLASH_LIB_WEAR_HYSTERESIS;
+    _allocation_cursor = 0;
+    assert(_allocator != FLASH_ALLOCATOR_CUSTOM || _custom_allocator != NULL);
+    // Without thin provisioning, every logical sector gets a group on init
+    assert(_thin_provisioning || _groups_count >= _logical_sectors_count + _spare_sectors_count);
+    _configure_geometry(config->geometry != NULL ? config->geometry : &_default_geometry);
+
+    // Each half must hold a snapshot and leave at least as much room for the log
+    assert(_metadata_sectors_count % 2 == 0);
+    assert(_get_metadata_snapshot_size() <= _get_metadata_half_size() / 2);
+
+    // Every group starts as unknown, init_sectors() resolves the groups without a record
+    free(_groups);
+    _groups = (GroupState *)malloc(_groups_count * sizeof(GroupState));
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        _groups[group] = (GroupState){FREE_LOGICAL_ID, 0xFFFF, GROUP_FLAG_UNKNOWN};
+    }
+
+    free(_content_hashes);
+    _content_hashes = config->content_hashes ? (uint32_t *)calloc(_groups_count, sizeof(uint32_t)) : NULL;
+
+    free(_digests);
+    free(_merkle_nodes);
+    _digests = NULL;
+    _merkle_nodes = NULL;
+    _merkle_leaves = 0;
+    if (config->merkle_tree) {
+        _merkle_leaves = 1;
+        while (_merkle_leaves < _logical_sectors_count) {
+            _merkle_leaves *= 2;
+        }
+        _digests = (uint32_t *)calloc(_groups_count, sizeof(uint32_t));
+        _merkle_nodes = (uint32_t *)calloc(2 * _merkle_leaves, sizeof(uint32_t));
+    }
+
+    free(_tier_slots);
+    free(_tier_map);
+    free(_tier_ages);
+    free(_tier_priorities);
+    _tier_slots = NULL;
+    _tier_map = NULL;
+    _tier_ages = NULL;
+    _tier_priorities = NULL;
+    _tier_slots_count = 0;
+    _tier_demotions_total = 0;
+    if (config->tier != NULL) {
+        uint32_t slot_size = FLASH_LIB_SECTOR_SIZE * _group_by;
+        assert(((uintptr_t)config->tier->base & 3) == 0);
+        assert(config->tier->size >= FLASH_LIB_TIER_SIZE(1, slot_size));
+
+        // More slots than logical sectors would never be used
+        uint32_t slots_count = (config->tier->size - sizeof(TierHeader)) / (sizeof(TierEntry) + slot_size);
+        _tier_slots_count = slots_count < _logical_sectors_count ? slots_count : _logical_sectors_count;
+        _tier_base = config->tier->base;
+        _tier_persistent = config->tier->persistent;
+        _tier_retained = config->tier->retained;
+        _tier_slots = (uint16_t *)malloc(_tier_slots_count * sizeof(uint16_t));
+        _tier_map = (uint16_t *)malloc(_logical_sectors_count * sizeof(uint16_t));
+        _tier_ages = (uint32_t *)calloc(_tier_slots_count, sizeof(uint32_t));
+        _tier_priorities = (uint8_t *)calloc(_logical_sectors_count, sizeof(uint8_t));
+        memset(_tier_slots, 0xFF, _tier_slots_count * sizeof(uint16_t));
+        memset(_tier_map, 0xFF, _logical_sectors_count * sizeof(uint16_t));
+    }
+
+    _wear_configure(config->wear_budget);
+
+    _scrub_cursor = 0;
+    _scrub_passes = 0;
+    _scrub_checked_total = 0;
+    _scrub_state_errors = 0;
+    _scrub_payload_errors = 0;
+    _scrub_blank_errors = 0;
+    _scrub_repairs = 0;
+    _scrub_lost_total = 0;
+    _scrub_reverted_total = 0;
+
+    free(_erase_counts);
+    _erase_counts = (uint16_t *)calloc(_upper_bound - _lower_bound, sizeof(uint16_t));
+
+    free(_logical_map);
+    _logical_map = (uint16_t *)malloc(_logical_sectors_count * sizeof(uint16_t));
+    memset(_logical_map, 0xFF, _logical_sectors_count * sizeof(uint16_t));
+
+    // Every slot starts as "maybe dirty", the first erase of each slot resolves it with a blank check
+    uint32_t dirty_slots_bytes = (_upper_bound - _lower_bound + 7) / 8;
+    free(_dirty_slots);
+    _dirty_slots = (uint8_t *)malloc(dirty_slots_bytes);
+    memset(_dirty_slots, 0xFF, dirty_slots_bytes);
+    _pending_erases_count = 0;
+    _released_groups_count = 0;
+
+    // xorshift needs a non-zero state
+    _random_state = config->seed != 0 ? config->seed : time_us_32() | 1;
+}
+
+/**
+ * @brief Checks and applies the geometry of the flash part. A larger erase unit is used only if it
+ * costs less than covering it with the best mix of the smaller ones.
+ */
+void _configure_geometry(const FlashGeometry *geometry) {
+    assert(geometry->erase_units_count > 0 && geometry->erase_units_count <= FLASH_LIB_MAX_ERASE_UNITS);
+    assert(geometry->erase_units[0].size == FLASH_LIB_SECTOR_SIZE);
+    assert(geometry->program_granularity > 0 && geometry->program_granularity <= FLASH_LIB_PAGE_SIZE);
+    assert((geometry->program_granularity & (geometry->program_granularity - 1)) == 0);
+    assert(geometry->program_burst >= FLASH_LIB_PAGE_SIZE && geometry->program_burst <= FLASH_LIB_MAX_PROGRAM_BURST);
+    assert(geometry->program_burst % FLASH_LIB_PAGE_SIZE == 0);
+    _geometry = *geometry;
+    if (_geometry.program_cost_us == 0) {
+        _geometry.program_cost_us = FLASH_LIB_PROGRAM_COST_US;
+    }
+
+    // Best cost of erasing one aligned unit of each size
+    uint64_t best_cost = _geometry.erase_units[0].cost_us;
+    _erase_unit_used[0] = true;
+    for (uint8_t unit = 1; unit < _geometry.erase_units_count; ++unit) {
+        uint32_t ratio = _geometry.erase_units[unit].size / _geometry.erase_units[unit - 1].size;
+        assert(ratio >= 2 && (ratio & (ratio - 1)) == 0 && _geometry.erase_units[unit].size == ratio * _geometry.erase_units[unit - 1].size);
+
+        uint64_t split_cost = ratio * best_cost;
+        _erase_unit_used[unit] = _geometry.erase_units[unit].cost_us < split_cost;
+        best_cost = _erase_unit_used[unit] ? _geometry.erase_units[unit].cost_us : split_cost;
+    }
+}
+
+/**
+ * @brief Geometry of the flash used by the library, the one of FlashLibConfig or the default one.
+ */
+const FlashGeometry *flash_lib_get_geometry() {
+    return &_geometry;
+}
+
+/**
+ * @brief Initializes flash memory sectors during startup.
+ *
+ * This function performs the following operations:
+ *
+ * 1. **Mount**: The state of every group is rebuilt in RAM by replaying the metadata log, which
+ *    only reads the metadata region. Transactions with a commit record are applied by the replay.
+ *
+ * 2. **Validation Sweep**: Groups without any record (first power up or a larger configuration)
+ *    are formatted as free groups, groups out of the ID range are released, and groups staged by a
+ *    transaction that never committed are released.
+ *
+ * 3. **Bookkeeping**: Tombstoned sectors are queued again for their deferred erase and released
+ *    groups are counted for flash_lib_maintenance().
+ *
+ * 4. **Initialization**: If some logical IDs have no group, they are assigned a free group, unless
+ *    thin provisioning leaves them to their first write. If groups retired by the scrubber left too
+ *    few, the remaining ones are left to their first write as well. When no metadata was found, a first
+ *    snapshot of the metadata is written. The slots of a retained front tier are then merged into
+ *    the flash, as the next power loss would lose them.
+ */
+void init_sectors() {
+    bool mounted = _metadata_mount();
+    _metadata_mounted = mounted;
+    memset(_logical_map, 0xFF, _logical_sectors_count * sizeof(uint16_t));
+
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        GroupState *state = &_groups[group];
+        uint32_t first_physical_sector = _get_group_first_sector(group);
+
+        if (state->flags & GROUP_FLAG_UNKNOWN) {
+            _format_free_group(first_physical_sector);
+            continue;
+        }
+
+        if (state->logical_id == FREE_LOGICAL_ID || (state->flags & GROUP_FLAG_RELEASED)) {
+            continue;
+        }
+
+        // Makes the group available to be reinitialized. Groups still staged here belong to a
+        // transaction that was interrupted before its commit record.
+        if (state->logical_id >= _logical_sectors_count || (state->flags & GROUP_FLAG_STAGED) ||
+            _logical_map[state->logical_id] != NO_GROUP) {
+            _release_group(first_physical_sector);
+            continue;
+        }
+
+        _logical_map[state->logical_id] = group;
+    }
+
+    _released_groups_count = 0;
+    uint16_t initialized_sectors_count = 0;
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        if (_groups[group].flags & GROUP_FLAG_RELEASED) {
+            _released_groups_count++;
+            continue;
+        }
+
+        if (!_is_group_live(group)) {
+            continue;
+        }
+
+        initialized_sectors_count++;
+        if (_groups[group].flags & GROUP_FLAG_TOMBSTONE) {
+            _push_pending_erase(_groups[group].logical_id);
+        }
+    }
+
+    for (uint32_t logical_id = 0; !_thin_provisioning && logical_id < _logical_sectors_count &&
+                                  initialized_sectors_count < _logical_sectors_count;
+         logical_id++) {
+        if (_logical_map[logical_id] != NO_GROUP) {
+            continue;
+        }
+
+        // Retired groups left too few, the rest stays without a group like with thin provisioning
+        uint32_t group = _get_free_group();
+        if (group == _upper_bound) {
+            break;
+        }
+        _claim_group(group, logical_id, 0, 0xFFFF);
+        initialized_sectors_count++;
+    }
+    _map_built = true;
+
+    _merkle_rebuild();
+    _tier_mount();
+    if (!mounted) {
+        _metadata_compact();
+        _metadata_mounted = true;
+    }
+
+    if (_tier_retained) {
+        _tier_demote_oldest(_tier_slots_count);
+    }
+}
+
+/**
+ * @brief Address of `offset_bytes` in a logical sector, pointing straight into the flash.
+ *
+ * A tombstoned or not provisioned logical sector reads from a blank buffer instead, which only
+ * covers FLASH_LIB_SECTOR_SIZE bytes from the returned address. Larger spans of a logical sector
+ * that may be blank are read one physical sector at a time, or with flash_lib_read_copy().
+ */
+uint8_t *read_sector(uint16_t logical_sector, uint32_t offset_bytes) {
+    uint32_t physical_sector_address;
+    uint32_t physical_sector_id = offset_bytes / FLASH_LIB_SECTOR_SIZE;
+    uint32_t physical_sector_offset = offset_bytes % FLASH_LIB_SECTOR_SIZE;
+    FLASH_LOCK_READ();
+    if (_tier_map != NULL && _tier_map[logical_sector] != TIER_NO_SLOT) {
+        uint8_t *data = _tier_slot_data(_tier_map[logical_sector]) + offset_bytes;
+        FLASH_UNLOCK_READ();
+        return data;
+    }
+    // Without a group, not provisioned yet or left out by an init short of groups, reads as blank
+    if (_is_tombstoned(logical_sector) || _logical_map[logical_sector] == NO_GROUP) {
+        FLASH_UNLOCK_READ();
+        return (uint8_t *)_blank_sector + physical_sector_offset;
+    }
+    if (!get_physical_sector_from_logical_id(logical_sector, physical_sector_id, &physical_sector_address)) {
+        FLASH_UNLOCK_READ();
+        return (uint8_t *)_blank_sector + physical_sector_offset;
+    }
+    FLASH_UNLOCK_READ();
+    return get_sector_read_pointer(physical_sector_address) + physical_sector_offset;
+}
+
+/**
+ * @brief Wait-free lookup of a logical sector, callable from interrupt handlers and from the other
+ * core while the library is modifying the flash.
+ *
+ * Reads the mapping under its sequence lock and gives up after FLASH_LIB_LOOKUP_RETRIES attempts
+ * instead of waiting, so it never blocks, and it never touches the flash itself. Like with
+ * read_sector(), `*data` points to flash and stays valid until the logical sector is modified,
+ * use flash_lib_read_copy() to get a consistent copy, and only FLASH_LIB_SECTOR_SIZE bytes can be
+ * read from it when the logical sector reads as blank.
+ *
+ * @param data Receives the address of `offset_bytes` in the logical sector.
+ * @return FLASH_LOOKUP_OK, FLASH_LOOKUP_BUSY if the mapping is being changed, the flash is being
+ * modified or the logical sector is being erased or written, or FLASH_LOOKUP_INVALID if the
+ * logical sector does not exist.
+ */
+uint8_t __not_in_flash_func(flash_lib_lookup)(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t **data) {
+    for (uint8_t attempt = 0; attempt < FLASH_LIB_LOOKUP_RETRIES; ++attempt) {
+        uint32_t sequence = _map_sequence;
+        if (sequence & 1) {
+            continue;
+        }
+        __dmb();
+
+        uint8_t result = _lookup_address(logical_sector, offset_bytes, data);
+
+        __dmb();
+        if (_map_sequence != sequence) {
+            continue;
+        }
+
+        if (result == FLASH_LOOKUP_OK && *data == NULL) {
+            *data = _blank_sector + offset_bytes % FLASH_LIB_SECTOR_SIZE;
+        }
+        return result;
+    }
+    return FLASH_LOOKUP_BUSY;
+}
+
+/**
+ * @brief Wait-free copy of `count` bytes of a logical sector, see flash_lib_lookup().
+ *
+ * The copy is done inside the read section of the sequence lock, so it is only returned as
+ * FLASH_LOOKUP_OK if the logical sector was not modified while it was copied.
+ */
+uint8_t __not_in_flash_func(flash_lib_read_copy)(uint16_t logical_sector, uint32_t offset_bytes, void *buffer, uint32_t count) {
+    for (uint8_t attempt = 0; attempt < FLASH_LIB_LOOKUP_RETRIES; ++attempt) {
+        uint32_t sequence = _map_sequence;
+        if (sequence & 1) {
+            continue;
+        }
+        __dmb();
+
+        const uint8_t *data;
+        uint8_t result = _lookup_address(logical_sector, offset_bytes, &data);
+        if (result == FLASH_LOOKUP_INVALID || offset_bytes + count > FLASH_LIB_SECTOR_SIZE * _group_by) {
+            return FLASH_LOOKUP_INVALID;
+        }
+
+        // Byte loop, memcpy may run from flash
+        for (uint32_t i = 0; result == FLASH_LOOKUP_OK && i < count; ++i) {
+            ((uint8_t *)buffer)[i] = data == NULL ? 0xFF : data[i];
+        }
+
+        __dmb();
+        if (_map_sequence == sequence) {
+            return result;
+        }
+    }
+    return FLASH_LOOKUP_BUSY;
+}
+
+/**
+ * @brief Read section of flash_lib_lookup(), resolves the address without any function from flash.
+ * `*data` is NULL for a tombstoned or not provisioned logical sector, which reads as blank.
+ */
+uint8_t __not_in_flash_func(_lookup_address)(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t **data) {
+    if (_logical_map == NULL || logical_sector >= _logical_sectors_count || offset_bytes >= FLASH_LIB_SECTOR_SIZE * _group_by) {
+        return FLASH_LOOKUP_INVALID;
+    }
+
+    // The tier keeps serving its slot while the slot is demoted to the flash
+    if (_tier_map != NULL && _tier_map[logical_sector] != TIER_NO_SLOT) {
+        *data = _tier_slot_data(_tier_map[logical_sector]) + offset_bytes;
+        return FLASH_LOOKUP_OK;
+    }
+
+    // Without a group once the map is rebuilt, the logical sector is not provisioned, either with
+    // thin provisioning or because the init ran out of free groups
+    uint16_t group = _logical_map[logical_sector];
+    if (group == NO_GROUP && _map_built) {
+        *data = NULL;
+        return FLASH_LOOKUP_OK;
+    }
+
+    if (group == NO_GROUP || group == _busy_group) {
+        return FLASH_LOOKUP_BUSY;
+    }
+
+    if (_groups[group].flags & GROUP_FLAG_TOMBSTONE) {
+        *data = NULL;
+        return FLASH_LOOKUP_OK;
+    }
+
+    *data = (const uint8_t *)XIP_BASE + (_lower_bound + group * _group_by) * FLASH_LIB_SECTOR_SIZE + offset_bytes;
+    return FLASH_LOOKUP_OK;
+}
+
+/**
+ * @brief Size in bytes of every logical sector, all of it is usable payload.
+ */
+uint32_t get_logical_sector_size() {
+    return FLASH_LIB_SECTOR_SIZE * _group_by;
+}
+
+/**
+ * @brief Programs data into an already erased area of a logical sector.
+ *
+ * The data is programmed page by page, bytes outside of the given range are left untouched, so
+ * consecutive calls can fill a page in several steps. Every physical slot touched is marked as
+ * dirty, which is what allows erase_logical_sector() to skip the slots that were never written.
+ * If the logical sector has a deferred erase pending, the erase is completed before programming.
+ * With thin provisioning, the first write to a logical sector claims a free group for it.
+ *
+ * @param logical_sector Logical ID to write to.
+ * @param offset_bytes Offset from the start of the logical sector, same addressing as read_sector().
+ * @param data Data to program.
+ * @param count Number of bytes to program.
+ * @return false if the logical sector has no group and none is free, nothing was written.
+ */
+bool write_sector(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    assert(logical_sector < _logical_sectors_count);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+
+    // Provisioned before the tier takes the write, so its demotion always has a group
+    if (!_provision_logical_sector(logical_sector)) {
+        FLASH_TRACE_END(FLASH_OP_WRITE, 1, logical_sector, offset_bytes, count);
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    if (_tier_takes_writes() || (_tier_map != NULL && _tier_map[logical_sector] != TIER_NO_SLOT)) {
+        _wear_held_total += _wear_budget_set;
+        _tier_write(_tier_promote(logical_sector, NULL, 0), offset_bytes, data, count);
+        FLASH_TRACE_END(FLASH_OP_WRITE, 0, logical_sector, offset_bytes, count);
+        FLASH_UNLOCK_WRITE();
+        return true;
+    }
+
+    if (_is_tombstoned(logical_sector)) {
+        _complete_deferred_erase(logical_sector);
+    }
+
+    uint32_t first_physical_sector;
+    if (!get_first_sector_from_logical_id(logical_sector, &first_physical_sector)) {
+        FLASH_TRACE_END(FLASH_OP_WRITE, 1, logical_sector, offset_bytes, count);
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+    uint16_t group = _logical_map[logical_sector];
+    _set_content_hash(group, CONTENT_HASH_NONE);
+    _log_digest(group, DIGEST_UNKNOWN);
+    _set_busy_group(group);
+    _program_group(first_physical_sector, offset_bytes, data, count);
+    _set_busy_group(NO_GROUP);
+    _log_digest(group, _digests != NULL ? _digests[group] : 0);
+
+    FLASH_TRACE_END(FLASH_OP_WRITE, 0, logical_sector, offset_bytes, count);
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Replaces the whole content of a logical sector by `count` bytes of data, the rest of the
+ * logical sector reads as blank.
+ *
+ * With `content_hashes` set in FlashLibConfig, the hash of the data is stored in the metadata, and
+ * a rewrite with the same hash as the current content returns without erasing or programming
+ * anything. FLASH_REWRITE_VERIFY also compares the data with the flash before skipping, which
+ * rules out hash collisions. A logical sector held by the front tier is compared with its slot.
+ * With thin provisioning, the first rewrite of a logical sector claims a free group for it.
+ *
+ * Without a front tier, a rewrite at FLASH_WEAR_HOLD is refused rather than erasing further over
+ * the wear budget.
+ *
+ * @param flags FLASH_REWRITE_*
+ * @return false if the content was already identical, if the logical sector has no group and none
+ * is free (counted in FlashLibStats), or if the wear budget refused the rewrite (counted in
+ * FlashWearState), and nothing was written.
+ */
+bool rewrite_sector(uint16_t logical_sector, const uint8_t *data, uint32_t count, uint8_t flags) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    assert(logical_sector < _logical_sectors_count);
+    assert(count <= FLASH_LIB_SECTOR_SIZE * _group_by);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+
+    if (_tier_map != NULL && _tier_map[logical_sector] != TIER_NO_SLOT) {
+        _wear_held_total += _wear_budget_set;
+        bool changed = _tier_fill(_tier_map[logical_sector], data, count);
+        FLASH_TRACE_END(FLASH_OP_REWRITE, changed, logical_sector, 0, count);
+        FLASH_UNLOCK_WRITE();
+        return changed;
+    }
+
+    if (!_provision_logical_sector(logical_sector)) {
+        FLASH_TRACE_END(FLASH_OP_REWRITE, 0, logical_sector, 0, count);
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    uint16_t group = _logical_map[logical_sector];
+    uint32_t hash = CONTENT_HASH_NONE;
+    if (_content_hashes != NULL) {
+        hash = _content_hash(data, count);
+        // Compared through the group, read_sector() would take the lock held here. A tombstone
+        // resets the hash, so the group holds the current content when the hash matches.
+        if (_content_hashes[group] == hash &&
+            (!(flags & FLASH_REWRITE_VERIFY) ||
+             memcmp(get_sector_read_pointer(_get_group_first_sector(group)), data, count) == 0)) {
+            FLASH_TRACE_END(FLASH_OP_REWRITE, 0, logical_sector, 0, count);
+            FLASH_UNLOCK_WRITE();
+            return false;
+        }
+    }
+
+    if (_tier_takes_writes()) {
+        _wear_held_total += _wear_budget_set;
+        _tier_promote(logical_sector, data, count);
+    } else if (_wear_budget_set && _wear_level() == FLASH_WEAR_HOLD) {
+        // No front tier to hold the data, the erase would go further over the budget
+        _wear_refused_total++;
+        FLASH_TRACE_END(FLASH_OP_REWRITE, 0, logical_sector, 0, count);
+        FLASH_UNLOCK_WRITE();
+        return false;
+    } else {
+        _rewrite_group(logical_sector, data, count, hash);
+    }
+
+    FLASH_TRACE_END(FLASH_OP_REWRITE, 1, logical_sector, 0, count);
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Erases the group of a logical sector and programs `count` bytes of data into it, see
+ * rewrite_sector().
+ */
+void _rewrite_group(uint16_t logical_sector, const uint8_t *data, uint32_t count, uint32_t hash) {
+    uint16_t group = _logical_map[logical_sector];
+
+    // The tombstone makes a power loss during the erase leave a blank logical sector
+    GroupState *state = &_groups[group];
+    if (!(state->flags & GROUP_FLAG_TOMBSTONE)) {
+        _set_group_state(group, state->logical_id, state->flags | GROUP_FLAG_TOMBSTONE, state->transaction);
+    }
+    _remove_pending_erase(logical_sector);
+    _erase_dirty_slots(_get_group_first_sector(group));
+
+    _log_digest(group, DIGEST_UNKNOWN);
+    _set_busy_group(group);
+    _program_group(_get_group_first_sector(group), 0, data, count);
+    _set_busy_group(NO_GROUP);
+    _log_digest(group, _digests != NULL ? _digests[group] : 0);
+
+    // Appended last, a power loss before it only costs the skip of the next identical rewrite
+    _set_content_hash(group, hash);
+}
+
+/**
+ * @brief Programs data into a group, see write_sector().
+ */
+void _program_group(uint32_t first_physical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count) {
+    assert(offset_bytes + count <= FLASH_LIB_SECTOR_SIZE * _group_by);
+
+    // Computed from the content before it is programmed
+    uint32_t digest_delta = 0;
+    if (_digests != NULL) {
+        digest_delta = _digest_delta(get_sector_read_pointer(first_physical_sector), offset_bytes, data, count);
+    }
+
+    while (count > 0) {
+        uint8_t physical_sector_id = offset_bytes / FLASH_LIB_SECTOR_SIZE;
+        uint32_t physical_sector_offset = offset_bytes % FLASH_LIB_SECTOR_SIZE;
+        uint32_t page_offset = physical_sector_offset % FLASH_LIB_PAGE_SIZE;
+        uint32_t physical_sector_address = first_physical_sector + physical_sector_id;
+        uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address) + physical_sector_offset;
+
+        uint32_t chunk;
+        if (page_offset == 0 && count >= FLASH_LIB_PAGE_SIZE) {
+            // Whole pages, in one burst up to the end of the physical sector
+            chunk = FLASH_LIB_SECTOR_SIZE - physical_sector_offset;
+            if (chunk > _geometry.program_burst) {
+                chunk = _geometry.program_burst;
+            }
+            if (chunk > count) {
+                chunk = count - count % FLASH_LIB_PAGE_SIZE;
+            }
+            memcpy(_program_buffer, data, chunk);
+            _flash_program(memory_addr, _program_buffer, chunk);
+        } else {
+            chunk = FLASH_LIB_PAGE_SIZE - page_offset;
+            if (chunk > count) {
+                chunk = count;
+            }
+            _program_padded(memory_addr, data, chunk);
+        }
+
+        _mark_slot_dirty(physical_sector_address);
+
+        data += chunk;
+        offset_bytes += chunk;
+        count -= chunk;
+    }
+
+    if (_digests != NULL) {
+        _add_digest(_get_group_index(first_physical_sector), digest_delta);
+    }
+}
+
+/**
+ * @brief Physically erases the payload of a group and clears its tombstone.
+ *
+ * Only the physical slots that may hold payload are erased. Slots are tracked as dirty in RAM by
+ * write_sector(), and slots of unknown state (after a power up) are resolved with a blank check,
+ * which is much cheaper than an erase. Adjacent dirty slots are erased with a single call so the
+ * flash can use its larger block erase when possible. The cost is therefore proportional to the
+ * amount of data actually written instead of the logical sector size.
+ *
+ * @param first_physical_sector First physical sector of the group to erase.
+ */
+void _erase_dirty_slots(uint32_t first_physical_sector) {
+    uint16_t group = _get_group_index(first_physical_sector);
+    _set_busy_group(group);
+
+    while (_erase_next_dirty_run(first_physical_sector, _group_by)) {
+    }
+
+    if (_groups[group].flags & GROUP_FLAG_TOMBSTONE) {
+        _set_group_state(group, _groups[group].logical_id, _groups[group].flags & ~GROUP_FLAG_TOMBSTONE, _groups[group].transaction);
+    }
+    _set_busy_group(NO_GROUP);
+}
+
+/**
+ * @brief Erases the next run of adjacent dirty slots of a group, at most `max_sectors` long, with a
+ * single call so the flash can use its larger block erase when possible.
+ *
+ * @return false if no slot of the group is left to erase.
+ */
+bool _erase_next_dirty_run(uint32_t first_physical_sector, uint8_t max_sectors) {
+    uint8_t i = 0;
+    while (i < _group_by && _is_slot_erased(first_physical_sector + i)) {
+        ++i;
+    }
+
+    if (i == _group_by) {
+        return false;
+    }
+
+    uint8_t run_end = i + 1;
+    while (run_end < _group_by && run_end - i < max_sectors && !_is_slot_erased(first_physical_sector + run_end)) {
+        ++run_end;
+    }
+
+    uint32_t memory_addr = get_memory_addr_from_physical_sector(first_physical_sector + i);
+    _flash_erase(memory_addr, FLASH_LIB_SECTOR_SIZE * (run_end - i));
+
+    _record_erase(first_physical_sector + i, run_end - i);
+    return true;
+}
+
+/**
+ * @brief Checks if a physical slot needs no erase. A dirty slot found blank is marked clean.
+ */
+bool _is_slot_erased(uint32_t physical_sector) {
+    if (!_is_slot_dirty(physical_sector)) {
+        return true;
+    }
+
+    if (_is_payload_blank(physical_sector)) {
+        _mark_slot_clean(physical_sector);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Counts an erase of consecutive physical sectors, which are clean afterwards.
+ */
+void _record_erase(uint32_t physical_sector, uint8_t sectors_count) {
+    for (uint8_t i = 0; i < sectors_count; ++i) {
+        _erase_counts[physical_sector + i - _lower_bound]++;
+        _mark_slot_clean(physical_sector + i);
+    }
+
+    MetadataRecord record = {
+        .type = RECORD_ERASE,
+        .flags = sectors_count,
+        .index = physical_sector - _lower_bound,
+        .logical_id = 0xFFFF,
+        .transaction = 0xFFFF,
+    };
+    _metadata_append(&record);
+}
+
+/**
+ * @brief Erases a logical sector.
+ *
+ * The erase is deferred: a tombstone flag is appended to the metadata log, which needs no erase,
+ * and from that point the logical sector reads as blank. The physical erase is done later by
+ * flash_lib_maintenance() or by the next write_sector() on the logical sector.
+ * Only FLASH_LIB_MAX_PENDING_ERASES erases can be pending at once, when the backlog is full the
+ * oldest one is completed first. A logical sector held by the front tier is erased in its slot.
+ * With thin provisioning, the group of the logical sector is released instead, and becomes a free
+ * group again once flash_lib_maintenance() or the next allocation erased it.
+ *
+ * @param logical_sector Logical ID to erase.
+ */
+void erase_logical_sector(uint16_t logical_sector) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    assert(logical_sector < _logical_sectors_count);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+
+    if (_tier_map != NULL && _tier_map[logical_sector] != TIER_NO_SLOT) {
+        _tier_fill(_tier_map[logical_sector], NULL, 0);
+    } else {
+        _tombstone_logical_sector(logical_sector);
+    }
+
+    FLASH_TRACE_END(FLASH_OP_ERASE_LOGICAL, 0, logical_sector, 0, 0);
+    FLASH_UNLOCK_WRITE();
+}
+
+void _tombstone_logical_sector(uint16_t logical_sector) {
+    uint16_t group = _logical_map[logical_sector];
+    if (group == NO_GROUP) {
+        return;
+    }
+
+    // The group goes back to the free groups, released like the groups replaced by a transaction.
+    // The logical sector reads as blank right away, the erase is done with the released groups.
+    if (_thin_provisioning) {
+        _remove_pending_erase(logical_sector);
+        _release_group(_get_group_first_sector(group));
+        _merkle_update(logical_sector);
+        return;
+    }
+
+    if (_is_tombstoned(logical_sector)) {
+        return;
+    }
+
+    GroupState *state = &_groups[_logical_map[logical_sector]];
+    _set_group_state(_logical_map[logical_sector], state->logical_id, state->flags | GROUP_FLAG_TOMBSTONE, state->transaction);
+    _push_pending_erase(logical_sector);
+}
+
+/**
+ * @brief Does the erases deferred by the library, oldest first: tombstoned logical sectors, then
+ * groups released by transactions, which are formatted back into free groups ahead of time.
+ *
+ * Meant to be called when the application is idle. With a wear budget, nothing is erased while
+ * the erase rate is over budget, as the writes complete the erases they need on their own. Within
+ * the budget, the slots of the front tier held while it was over budget are written back too.
+ *
+ * @param max_sectors Maximum number of logical sectors to erase in this call.
+ * @return Number of erases still pending.
+ */
+uint16_t flash_lib_maintenance(uint16_t max_sectors) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+    // Only traced, unused without FLASH_LIB_TRACE
+    uint16_t requested_sectors = max_sectors;
+    (void)requested_sectors;
+    if (_wear_budget_set && _wear_level() != FLASH_WEAR_OK) {
+        max_sectors = 0;
+    }
+
+    while (max_sectors > 0 && _pending_erases_count > 0) {
+        _complete_deferred_erase(_pending_erases[0]);
+        max_sectors--;
+    }
+
+    for (uint16_t group = 0; group < _groups_count && max_sectors > 0 && _released_groups_count > 0; ++group) {
+        if (_groups[group].flags & GROUP_FLAG_RELEASED) {
+            _format_free_group(_get_group_first_sector(group));
+            _released_groups_count--;
+            max_sectors--;
+        }
+    }
+
+    while (_wear_budget_set && max_sectors > 0 && _tier_slots_used() > 0 && _wear_level() == FLASH_WEAR_OK) {
+        _tier_demote_oldest(1);
+        max_sectors--;
+    }
+
+    uint16_t pending = _pending_erases_count + _released_groups_count;
+    FLASH_TRACE_END(FLASH_OP_MAINTENANCE, pending > 0xFF ? 0xFF : pending, 0xFFFF, 0, requested_sectors);
+    FLASH_UNLOCK_WRITE();
+    return pending;
+}
+
+void get_flash_lib_stats(FlashLibStats *stats) {
+    FLASH_LOCK_READ();
+    stats->pending_erases = _pending_erases_count;
+    stats->max_pending_erases = FLASH_LIB_MAX_PENDING_ERASES;
+    stats->deferred_erases = _deferred_erases_total;
+    stats->forced_erases = _forced_erases_total;
+    stats->released_sectors = _released_groups_count;
+    stats->tier_slots_count = _tier_slots_count;
+    stats->tier_slots_used = _tier_slots_used();
+    stats->tier_demotions = _tier_demotions_total;
+    stats->tier_slots_dropped = _tier_dropped_total;
+    stats->free_sectors = _get_free_groups_count();
+    stats->out_of_space = _out_of_space_total;
+    FLASH_UNLOCK_READ();
+}
+
+void _complete_deferred_erase(uint16_t logical_sector) {
+    // A transaction may have replaced the tombstoned group since it was queued
+    uint32_t physical_sector_address;
+    if (_is_tombstoned(logical_sector) && get_first_sector_from_logical_id(logical_sector, &physical_sector_address)) {
+        _erase_dirty_slots(physical_sector_address);
+    }
+
+    _remove_pending_erase(logical_sector);
+}
+
+void _remove_pending_erase(uint16_t logical_sector) {
+    for (uint16_t i = 0; i < _pending_erases_count; ++i) {
+        if (_pending_erases[i] != logical_sector) {
+            continue;
+        }
+
+        memmove(&_pending_erases[i], &_pending_erases[i + 1], (_pending_erases_count - i - 1) * sizeof(uint16_t));
+        _pending_erases_count--;
+        break;
+    }
+}
+
+void _push_pending_erase(uint16_t logical_sector) {
+    // Backlog is full, the oldest erase is done now to make room
+    if (_pending_erases_count == FLASH_LIB_MAX_PENDING_ERASES) {
+        _forced_erases_total++;
+        _complete_deferred_erase(_pending_erases[0]);
+    }
+
+    _pending_erases[_pending_erases_count++] = logical_sector;
+    _deferred_erases_total++;
+}
+
+void erase_physical_sector(uint16_t logical_sector, uint8_t physical_sector_id) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    assert(logical_sector < _logical_sectors_count);
+    assert(physical_sector_id < _group_by);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+
+    if (_tier_map != NULL && _tier_map[logical_sector] != TIER_NO_SLOT) {
+        uint16_t slot = _tier_map[logical_sector];
+        uint32_t offset_bytes = physical_sector_id * FLASH_LIB_SECTOR_SIZE;
+        uint32_t checksum_delta = _digest_delta(_tier_slot_data(slot), offset_bytes, NULL, FLASH_LIB_SECTOR_SIZE);
+        _map_update_begin();
+        memset(_tier_slot_data(slot) + offset_bytes, 0xFF, FLASH_LIB_SECTOR_SIZE);
+        _tier_entries()[slot].checksum += checksum_delta;
+        _map_update_end();
+        _tier_ages[slot] = ++_tier_clock;
+
+        FLASH_TRACE_END(FLASH_OP_ERASE_PHYSICAL, physical_sector_id, logical_sector, 0, 0);
+        FLASH_UNLOCK_WRITE();
+        return;
+    }
+
+    // Not provisioned with thin provisioning, already blank
+    uint32_t physical_sector_address;
+    if (!get_physical_sector_from_logical_id(logical_sector, physical_sector_id, &physical_sector_address)) {
+        FLASH_TRACE_END(FLASH_OP_ERASE_PHYSICAL, physical_sector_id, logical_sector, 0, 0);
+        FLASH_UNLOCK_WRITE();
+        return;
+    }
+    uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
+
+    uint16_t group = _logical_map[logical_sector];
+    _set_content_hash(group, CONTENT_HASH_NONE);
+    _log_digest(group, DIGEST_UNKNOWN);
+    uint32_t digest_delta = 0;
+    if (_digests != NULL) {
+        uint32_t first_physical_sector = physical_sector_address - physical_sector_id;
+        digest_delta = _digest_delta(get_sector_read_pointer(first_physical_sector), physical_sector_id * FLASH_LIB_SECTOR_SIZE, NULL,
+                                     FLASH_LIB_SECTOR_SIZE);
+    }
+
+    _set_busy_group(group);
+    _flash_erase(memory_addr, FLASH_LIB_SECTOR_SIZE);
+    _set_busy_group(NO_GROUP);
+
+    if (_digests != NULL) {
+        _add_digest(group, digest_delta);
+        _log_digest(group, _digests[group]);
+    }
+
+    _record_erase(physical_sector_address, 1);
+
+    FLASH_TRACE_END(FLASH_OP_ERASE_PHYSICAL, physical_sector_id, logical_sector, 0, 0);
+    FLASH_UNLOCK_WRITE();
+}
+
+/**
+ * @brief Starts a transaction. Only one transaction can be active at a time.
+ *
+ * Logical sectors written through the transaction are staged in spare groups and replace their
+ * current group all at once on transaction_commit(). Until then, reads keep returning the current
+ * data, and a power loss simply discards the transaction.
+ */
+void transaction_begin(FlashTransaction *transaction) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    assert(_spare_sectors_count > 0);
+    FLASH_LOCK_WRITE();
+    assert(!_transaction_active);
+    FLASH_TRACE_BEGIN();
+
+    _transaction_active = true;
+    transaction->id = _next_transaction++;
+    transaction->sectors_count = 0;
+
+    FLASH_TRACE_END(FLASH_OP_TRANSACTION_BEGIN, 0, transaction->id, 0, 0);
+    FLASH_UNLOCK_WRITE();
+}
+
+/**
+ * @brief Writes into the staged copy of a logical sector.
+ *
+ * The first write to a logical sector in a transaction takes an erased spare group, so the staged
+ * copy starts blank, like after erase_logical_sector(), and must be written entirely. Erases of
+ * spare groups are done ahead of time by flash_lib_maintenance(). Transactions work on the flash,
+ * a logical sector held by the front tier is demoted first.
+ *
+ * @return false if there is no spare group left or the transaction holds too many sectors.
+ */
+bool transaction_write(FlashTransaction *transaction, uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    assert(logical_sector < _logical_sectors_count);
+    FLASH_LOCK_WRITE();
+    assert(_transaction_active);
+    FLASH_TRACE_BEGIN();
+
+    _tier_demote_logical(logical_sector);
+
+    uint8_t index = 0;
+    while (index < transaction->sectors_count && transaction->logical_ids[index] != logical_sector) {
+        index++;
+    }
+
+    if (index == transaction->sectors_count) {
+        uint32_t group = _upper_bound;
+        if (transaction->sectors_count < FLASH_LIB_MAX_TRANSACTION_SECTORS) {
+            group = _get_free_group();
+        }
+
+        if (group == _upper_bound) {
+            FLASH_TRACE_END(FLASH_OP_TRANSACTION_WRITE, 0, logical_sector, offset_bytes, count);
+            FLASH_UNLOCK_WRITE();
+            return false;
+        }
+
+        _claim_group(group, logical_sector, GROUP_FLAG_STAGED, transaction->id);
+        transaction->logical_ids[index] = logical_sector;
+        transaction->groups[index] = group;
+        transaction->sectors_count++;
+    }
+
+    uint16_t group = _get_group_index(transaction->groups[index]);
+    _log_digest(group, DIGEST_UNKNOWN);
+    _program_group(transaction->groups[index], offset_bytes, data, count);
+    _log_digest(group, _digests != NULL ? _digests[group] : 0);
+
+    FLASH_TRACE_END(FLASH_OP_TRANSACTION_WRITE, 1, logical_sector, offset_bytes, count);
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Atomically replaces the logical sectors written in the transaction by their staged copy.
+ *
+ * A single commit record is appended to the metadata log, which is the commit point: the replay of
+ * the log on init_flash_lib() applies the staged groups of a transaction when it meets its commit
+ * record, and releases them if there is none. The groups they replace are released, to be formatted
+ * back into spare groups by flash_lib_maintenance().
+ */
+void transaction_commit(FlashTransaction *transaction) {
+    FLASH_LOCK_WRITE();
+    assert(_transaction_active);
+    FLASH_TRACE_BEGIN();
+
+    if (transaction->sectors_count > 0) {
+        // Written to the front tier during the transaction, replaced by the staged copy. Dropped
+        // before the commit point, so their slot never hides the committed data.
+        for (uint8_t i = 0; i < transaction->sectors_count; ++i) {
+            _tier_discard(transaction->logical_ids[i]);
+        }
+
+        _apply_transaction(transaction->id);
+
+        MetadataRecord record = {
+            .type = RECORD_COMMIT,
+            .flags = 0xFF,
+            .index = transaction->sectors_count,
+            .logical_id = 0xFFFF,
+            .transaction = transaction->id,
+        };
+        _metadata_append(&record);
+    }
+
+    _transaction_active = false;
+
+    FLASH_TRACE_END(FLASH_OP_TRANSACTION_COMMIT, 0, transaction->id, 0, transaction->sectors_count);
+    FLASH_UNLOCK_WRITE();
+}
+
+/**
+ * @brief Discards the staged copies, the logical sectors keep their current data.
+ */
+void transaction_abort(FlashTransaction *transaction) {
+    FLASH_LOCK_WRITE();
+    assert(_transaction_active);
+    FLASH_TRACE_BEGIN();
+
+    for (uint8_t i = 0; i < transaction->sectors_count; ++i) {
+        _release_group(transaction->groups[i]);
+    }
+
+    _transaction_active = false;
+
+    FLASH_TRACE_END(FLASH_OP_TRANSACTION_ABORT, 0, transaction->id, 0, transaction->sectors_count);
+    FLASH_UNLOCK_WRITE();
+}
+
+/**
+ * @brief Starts a step-by-step init_flash_lib_with_config(), run by flash_lib_poll(). The lookups
+ * report FLASH_LOOKUP_BUSY until it is done. The slots of a retained front tier are kept, and
+ * merged by flash_lib_tier_flush() when there is time for it.
+ *
+ * @return false if another step operation is running.
+ */
+bool flash_lib_start_init(const FlashLibConfig *config) {
+#ifdef FLASH_LIB_LOCKING
+    flash_lock_init();
+#endif
+    FLASH_LOCK_WRITE();
+    if (_step.operation != FLASH_STEP_NONE) {
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    _step_start(FLASH_STEP_INIT);
+    _map_update_begin();
+    _configure(config);
+    _step.progress.total = _groups_count + (_thin_provisioning ? 0 : _logical_sectors_count);
+
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Starts a step-by-step write_sector(), run by flash_lib_poll(). `data` must stay valid
+ * until the operation is done. Step operations work on the flash, a logical sector held by the
+ * front tier is demoted first, within this call. With thin provisioning, a logical sector without
+ * a group gets one within this call too.
+ *
+ * @return false if another step operation is running, or if the logical sector has no group and
+ * none is free.
+ */
+bool flash_lib_start_write(uint16_t logical_sector, uint32_t offset_bytes, const uint8_t *data, uint32_t count) {
+    assert(logical_sector < _logical_sectors_count);
+    assert(offset_bytes + count <= FLASH_LIB_SECTOR_SIZE * _group_by);
+    FLASH_LOCK_WRITE();
+    if (_step.operation != FLASH_STEP_NONE) {
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    if (!_provision_logical_sector(logical_sector)) {
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    _tier_demote_logical(logical_sector);
+    _step_start(FLASH_STEP_WRITE);
+    _step.logical_sector = logical_sector;
+    _step.offset_bytes = offset_bytes;
+    _step.data = data;
+    _step.count = count;
+    _step.progress.total = count;
+
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Starts a step-by-step write_sector() whose data comes from a producer, through the
+ * buffers of `pipeline`. Each flash_lib_poll() programs the next submitted page, or does nothing
+ * while the producer is behind. `pipeline` must stay valid until the operation is done. Like
+ * flash_lib_start_write(), a logical sector held by the front tier is demoted first, and one
+ * without a group gets one.
+ *
+ * @return false if another step operation is running, or if no group is free.
+ */
+bool flash_lib_start_pipelined_write(uint16_t logical_sector, uint32_t offset_bytes, uint32_t count, FlashPipeline *pipeline) {
+    assert(logical_sector < _logical_sectors_count);
+    assert(offset_bytes + count <= FLASH_LIB_SECTOR_SIZE * _group_by);
+    FLASH_LOCK_WRITE();
+    if (_step.operation != FLASH_STEP_NONE) {
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    if (!_provision_logical_sector(logical_sector)) {
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    _tier_demote_logical(logical_sector);
+    pipeline->offset_bytes = offset_bytes;
+    pipeline->count = count;
+    pipeline->submitted_bytes = 0;
+    pipeline->submitted = 0;
+    pipeline->programmed = 0;
+
+    _step_start(FLASH_STEP_WRITE);
+    _step.logical_sector = logical_sector;
+    _step.offset_bytes = offset_bytes;
+    _step.count = count;
+    _step.pipeline = pipeline;
+    _step.progress.total = count;
+
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Next buffer of a pipelined write for the producer, to fill with `count` bytes and pass to
+ * flash_pipeline_submit(). Touches no library state and runs from RAM, so core1 can produce while
+ * core0 programs.
+ *
+ * @return NULL while every buffer waits to be programmed, or once the whole write was submitted.
+ */
+uint8_t *__not_in_flash_func(flash_pipeline_acquire)(FlashPipeline *pipeline, uint32_t *count) {
+    uint32_t remaining = pipeline->count - pipeline->submitted_bytes;
+    if (remaining == 0 || pipeline->submitted - pipeline->programmed == FLASH_LIB_PIPELINE_DEPTH) {
+        return NULL;
+    }
+    // The buffer is free once its program is seen
+    __dmb();
+
+    // Same chunks as the step write: up to the end of the page, so programs never span two pages
+    uint32_t chunk = FLASH_LIB_PAGE_SIZE - (pipeline->offset_bytes + pipeline->submitted_bytes) % FLASH_LIB_PAGE_SIZE;
+    *count = chunk < remaining ? chunk : remaining;
+    return pipeline->buffers[pipeline->submitted % FLASH_LIB_PIPELINE_DEPTH];
+}
+
+/**
+ * @brief Hands the buffer returned by flash_pipeline_acquire() over to flash_lib_poll().
+ */
+void __not_in_flash_func(flash_pipeline_submit)(FlashPipeline *pipeline) {
+    uint32_t remaining = pipeline->count - pipeline->submitted_bytes;
+    uint32_t chunk = FLASH_LIB_PAGE_SIZE - (pipeline->offset_bytes + pipeline->submitted_bytes) % FLASH_LIB_PAGE_SIZE;
+    pipeline->submitted_bytes += chunk < remaining ? chunk : remaining;
+    // The data must be visible before the buffer is
+    __dmb();
+    pipeline->submitted++;
+}
+
+/**
+ * @brief Starts a step-by-step erase_logical_sector(), run by flash_lib_poll(). Like
+ * flash_lib_start_write(), a logical sector held by the front tier is demoted first.
+ *
+ * @return false if another step operation is running.
+ */
+bool flash_lib_start_erase(uint16_t logical_sector) {
+    assert(logical_sector < _logical_sectors_count);
+    FLASH_LOCK_WRITE();
+    if (_step.operation != FLASH_STEP_NONE) {
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    _tier_demote_logical(logical_sector);
+    _step_start(FLASH_STEP_ERASE);
+    _step.logical_sector = logical_sector;
+    _step.progress.total = 1;
+
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Starts a step-by-step flash_lib_maintenance(), run by flash_lib_poll().
+ *
+ * @return false if another step operation is running.
+ */
+bool flash_lib_start_maintenance(uint16_t max_sectors) {
+    FLASH_LOCK_WRITE();
+    if (_step.operation != FLASH_STEP_NONE) {
+        FLASH_UNLOCK_WRITE();
+        return false;
+    }
+
+    _step_start(FLASH_STEP_MAINTENANCE);
+    _step.max_sectors = max_sectors;
+    _step.progress.total = max_sectors;
+
+    FLASH_UNLOCK_WRITE();
+    return true;
+}
+
+/**
+ * @brief Runs one step of the operation started by a flash_lib_start_* function.
+ *
+ * A step does at most one page program or one sector erase, so the time spent in a call is bounded
+ * by the slowest of the two, whatever the operation. Metadata records are programmed in steps of
+ * their own, and a metadata compaction is split into sector erases and page programs as well.
+ * The blocking functions must not be called while an operation is running.
+ *
+ * @param progress Optional, receives the progress of the operation.
+ * @return FLASH_POLL_BUSY while the operation runs, FLASH_POLL_DONE on the step that completes it,
+ * or FLASH_POLL_FAILED if it completed with an error, then FLASH_POLL_IDLE.
+ */
+uint8_t flash_lib_poll(FlashLibProgress *progress) {
+    FLASH_LOCK_WRITE();
+
+    uint8_t result = FLASH_POLL_IDLE;
+    if (_step.operation != FLASH_STEP_NONE) {
+        _step.progress.steps++;
+        result = FLASH_POLL_BUSY;
+
+        if (!_step_housekeeping() && !_step.finished) {
+            _step_defer_records = true;
+            _step_advance();
+            _step_defer_records = false;
+        }
+
+        if (_step.finished && _step_records_count == 0 && _step.erase_group == NO_GROUP && _compact_half < 0 &&
+            !_step_compact_requested) {
+            result = _step.failed ? FLASH_POLL_FAILED : FLASH_POLL_DONE;
+            _step_finish();
+        }
+    }
+
+    if (progress != NULL) {
+        *progress = _step.progress;
+    }
+
+    FLASH_UNLOCK_WRITE();
+    return result;
+}
+
+void _step_start(uint8_t operation) {
+    _step = (StepState){.operation = operation, .erase_group = NO_GROUP};
+    _step.progress.operation = operation;
+    _step_records_count = 0;
+    _step_compact_requested = false;
+#ifdef FLASH_LIB_TRACE
+    _step.trace_start = time_us_32();
+#endif
+}
+
+/**
+ * @brief Ends the operation and records it in the trace like its blocking version.
+ */
+void _step_finish() {
+    if (_step.operation == FLASH_STEP_INIT) {
+        _map_update_end();
+    }
+
+#ifdef FLASH_LIB_TRACE
+    uint16_t pending = _pending_erases_count + _released_groups_count;
+    switch (_step.operation) {
+    case FLASH_STEP_INIT:
+        flash_trace_record(FLASH_OP_INIT, _group_by, _logical_sectors_count, _metadata_lower_bound,
+                           _spare_sectors_count | (uint32_t)_metadata_sectors_count << 16, _step.trace_start);
+        break;
+    case FLASH_STEP_WRITE:
+        flash_trace_record(FLASH_OP_WRITE, 0, _step.logical_sector, _step.offset_bytes - _step.progress.total,
+                           _step.progress.total, _step.trace_start);
+        break;
+    case FLASH_STEP_ERASE:
+        flash_trace_record(FLASH_OP_ERASE_LOGICAL, 0, _step.logical_sector, 0, 0, _step.trace_start);
+        break;
+    case FLASH_STEP_MAINTENANCE:
+        flash_trace_record(FLASH_OP_MAINTENANCE, pending > 0xFF ? 0xFF : pending, 0xFFFF, 0, _step.progress.total,
+                           _step.trace_start);
+        break;
+    }
+#endif
+
+    _step.operation = FLASH_STEP_NONE;
+}
+
+/**
+ * @brief Runs the work left behind by the previous steps: a metadata compaction, the deferred
+ * metadata records, then the erase of a group.
+ *
+ * @return false if there was nothing to do.
+ */
+bool _step_housekeeping() {
+    if (_compact_half >= 0 || _step_compact_requested) {
+        _step_compact_requested = false;
+        if (_metadata_compact_step(1)) {
+            // The snapshot holds the changes of the deferred records
+            _step_records_count = 0;
+        }
+        return true;
+    }
+
+    if (_step_records_count > 0) {
+        if (_metadata_head + sizeof(MetadataRecord) > _get_metadata_half_size()) {
+            _metadata_compact_step(1);
+            return true;
+        }
+
+        _metadata_append(&_step_records[0]);
+        _step_records_count--;
+        memmove(&_step_records[0], &_step_records[1], _step_records_count * sizeof(MetadataRecord));
+        return true;
+    }
+
+    if (_step.erase_group != NO_GROUP) {
+        _step_defer_records = true;
+        _step_erase();
+        _step_defer_records = false;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Erases one more sector of the group being erased, or completes the erase: the tombstone is
+ * cleared, or the group is formatted as free.
+ */
+void _step_erase() {
+    uint16_t group = _step.erase_group;
+    if (_erase_next_dirty_run(_get_group_first_sector(group), 1)) {
+        return;
+    }
+
+    if (_step.erase_to_free) {
+        _set_group_state(group, FREE_LOGICAL_ID, 0, 0xFFFF);
+    } else if (_groups[group].flags & GROUP_FLAG_TOMBSTONE) {
+        _set_group_state(group, _groups[group].logical_id, _groups[group].flags & ~GROUP_FLAG_TOMBSTONE, _groups[group].transaction);
+    }
+
+    _step.erase_group = NO_GROUP;
+    _set_busy_group(NO_GROUP);
+}
+
+void _step_begin_erase(uint16_t group, bool to_free) {
+    _step.erase_group = group;
+    _step.erase_to_free = to_free;
+    _set_busy_group(group);
+}
+
+/**
+ * @brief Step version of the forced erase of _push_pending_erase(), makes room in a full backlog.
+ *
+ * @return true if the backlog was full, the caller must retry once the erase is done.
+ */
+bool _step_force_pending_erase() {
+    if (_pending_erases_count < FLASH_LIB_MAX_PENDING_ERASES) {
+        return false;
+    }
+
+    uint16_t oldest = _pending_erases[0];
+    _forced_erases_total++;
+    _remove_pending_erase(oldest);
+    if (_is_tombstoned(oldest)) {
+        _step_begin_erase(_logical_map[oldest], false);
+    }
+    return true;
+}
+
+void _step_advance() {
+    switch (_step.operation) {
+    case FLASH_STEP_INIT:
+        _step_init();
+        break;
+    case FLASH_STEP_WRITE:
+        _step_write();
+        break;
+    case FLASH_STEP_ERASE:
+        _step_erase_logical();
+        break;
+    case FLASH_STEP_MAINTENANCE:
+        _step_maintenance();
+        break;
+    }
+}
+
+/**
+ * @brief Steps of init_sectors(), see its description. Each group without a record costs one step
+ * per dirty physical sector, each record one step.
+ */
+void _step_init() {
+    switch (_step.phase) {
+    case STEP_INIT_MOUNT:
+        _step.mounted = _metadata_mount();
+        _metadata_mounted = _step.mounted;
+        memset(_logical_map, 0xFF, _logical_sectors_count * sizeof(uint16_t));
+        _step.phase = STEP_INIT_SWEEP;
+        return;
+
+    case STEP_INIT_SWEEP:
+        while (_step.cursor < _groups_count) {
+            uint16_t group = _step.cursor++;
+            GroupState *state = &_groups[group];
+            _step.progress.done++;
+
+            if (state->flags & GROUP_FLAG_UNKNOWN) {
+                _step_begin_erase(group, true);
+                return;
+            }
+
+            if (state->logical_id == FREE_LOGICAL_ID || (state->flags & GROUP_FLAG_RELEASED)) {
+                continue;
+            }
+
+            if (state->logical_id >= _logical_sectors_count || (state->flags & GROUP_FLAG_STAGED) ||
+                _logical_map[state->logical_id] != NO_GROUP) {
+                _release_group(_get_group_first_sector(group));
+                return;
+            }
+
+            _logical_map[state->logical_id] = group;
+        }
+
+        _released_groups_count = 0;
+        _step.cursor = 0;
+        _step.phase = STEP_INIT_BOOKKEEPING;
+        return;
+
+    case STEP_INIT_BOOKKEEPING:
+        while (_step.cursor < _groups_count) {
+            uint16_t group = _step.cursor;
+            if (_groups[group].flags & GROUP_FLAG_RELEASED) {
+                _released_groups_count++;
+            } else if (_is_group_live(group) && (_groups[group].flags & GROUP_FLAG_TOMBSTONE)) {
+                if (_step_force_pending_erase()) {
+                    return;
+                }
+                _push_pending_erase(_groups[group].logical_id);
+            }
+            _step.cursor++;
+        }
+
+        _step.cursor = 0;
+        _step.phase = STEP_INIT_CLAIM;
+        return;
+
+    case STEP_INIT_CLAIM:
+        while (!_thin_provisioning && _step.cursor < _logical_sectors_count) {
+            if (_logical_map[_step.cursor] != NO_GROUP) {
+                _step.cursor++;
+                _step.progress.done++;
+                continue;
+            }
+
+            uint32_t group = _allocate_group();
+            if (group == _upper_bound) {
+                // Like _get_free_group(), a released group is formatted first
+                for (uint16_t released = 0; released < _groups_count; ++released) {
+                    if (_groups[released].flags & GROUP_FLAG_RELEASED) {
+                        _released_groups_count--;
+                        _step_begin_erase(released, true);
+                        return;
+                    }
+                }
+
+                // Retired groups left too few, the rest stays without a group like with thin provisioning
+                _step.failed = true;
+                break;
+            }
+
+            _claim_group(group, _step.cursor++, 0, 0xFFFF);
+            _step.progress.done++;
+            return;
+        }
+
+        _step.phase = STEP_INIT_SNAPSHOT;
+        return;
+
+    case STEP_INIT_SNAPSHOT:
+        _map_built = true;
+        _merkle_rebuild();
+        _tier_mount();
+        if (!_step.mounted) {
+            _step_compact_requested = true;
+        }
+        _step.phase = STEP_INIT_DONE;
+        return;
+
+    case STEP_INIT_DONE:
+        _metadata_mounted = true;
+        _step.finished = true;
+        return;
+    }
+}
+
+/**
+ * @brief Steps of write_sector(): the deferred erase of the logical sector if it is tombstoned,
+ * then one page per step, taken from the pipeline of a pipelined write.
+ */
+void _step_write() {
+    uint16_t logical_sector = _step.logical_sector;
+    if (_step.phase == 0) {
+        _step.phase = 1;
+        if (_is_tombstoned(logical_sector)) {
+            _remove_pending_erase(logical_sector);
+            _step_begin_erase(_logical_map[logical_sector], false);
+            return;
+        }
+    }
+
+    // The digest is marked unknown by a step of its own, before the first program
+    uint16_t group = _logical_map[logical_sector];
+    if (_step.phase == 1) {
+        _step.phase = 2;
+        if (_digests != NULL) {
+            _log_digest(group, DIGEST_UNKNOWN);
+            return;
+        }
+    }
+
+    if (_step.count == 0) {
+        _set_busy_group(NO_GROUP);
+        _log_digest(group, _digests != NULL ? _digests[group] : 0);
+        _step.finished = true;
+        return;
+    }
+
+    const uint8_t *data = _step.data;
+    if (_step.pipeline != NULL) {
+        // The producer is behind, the step does nothing
+        if (_step.pipeline->programmed == _step.pipeline->submitted) {
+            return;
+        }
+        __dmb();
+        data = _step.pipeline->buffers[_step.pipeline->programmed % FLASH_LIB_PIPELINE_DEPTH];
+    }
+
+    uint32_t chunk = FLASH_LIB_PAGE_SIZE - _step.offset_bytes % FLASH_LIB_PAGE_SIZE;
+    if (chunk > _step.count) {
+        chunk = _step.count;
+    }
+
+    // Provisioned by flash_lib_start_write(), the group only changes under the lock of the poll
+    uint32_t first_physical_sector = _get_group_first_sector(group);
+    _set_content_hash(group, CONTENT_HASH_NONE);
+    _set_busy_group(group);
+    _program_group(first_physical_sector, _step.offset_bytes, data, chunk);
+
+    if (_step.pipeline != NULL) {
+        // Hands the buffer back to the producer
+        __dmb();
+        _step.pipeline->programmed++;
+    } else {
+        _step.data += chunk;
+    }
+    _step.offset_bytes += chunk;
+    _step.count -= chunk;
+    _step.progress.done += chunk;
+    if (_step.count == 0) {
+        _set_busy_group(NO_GROUP);
+        _log_digest(group, _digests != NULL ? _digests[group] : 0);
+        _step.finished = true;
+    }
+}
+
+void _step_erase_logical() {
+    uint16_t logical_sector = _step.logical_sector;
+    if (_thin_provisioning) {
+        // A single metadata record, like the tombstone
+        _tombstone_logical_sector(logical_sector);
+    } else if (_logical_map[logical_sector] != NO_GROUP && !_is_tombstoned(logical_sector)) {
+        // Like _tombstone_logical_sector(), a logical sector the init left without a group is already blank
+        if (_step_force_pending_erase()) {
+            return;
+        }
+
+        GroupState *state = &_groups[_logical_map[logical_sector]];
+        _set_group_state(_logical_map[logical_sector], state->logical_id, state->flags | GROUP_FLAG_TOMBSTONE, state->transaction);
+        _push_pending_erase(logical_sector);
+    }
+
+    _step.progress.done = 1;
+    _step.finished = true;
+}
+
+/**
+ * @brief Steps of flash_lib_maintenance(): each deferred erase or released group is erased one
+ * physical sector per step.
+ */
+void _step_maintenance() {
+    if (_step.max_sectors == 0 || (_wear_budget_set && _wear_level() != FLASH_WEAR_OK)) {
+        _step.finished = true;
+        return;
+    }
+
+    if (_pending_erases_count > 0) {
+        uint16_t logical_sector = _pending_erases[0];
+        _remove_pending_erase(logical_sector);
+        _step.max_sectors--;
+        _step.progress.done++;
+        if (_is_tombstoned(logical_sector)) {
+            _step_begin_erase(_logical_map[logical_sector], false);
+        }
+        return;
+    }
+
+    for (uint16_t group = 0; group < _groups_count && _released_groups_count > 0; ++group) {
+        if (_groups[group].flags & GROUP_FLAG_RELEASED) {
+            _released_groups_count--;
+            _step.max_sectors--;
+            _step.progress.done++;
+            _step_begin_erase(group, true);
+            return;
+        }
+    }
+
+    _step.finished = true;
+}
+
+/**
+ * @brief Makes the groups staged by a transaction the current groups of their logical sectors and
+ * releases the groups they replace.
+ *
+ * Only changes the state in RAM, it is persisted by the commit record, whose replay calls this
+ * function again.
+ */
+void _apply_transaction(uint16_t transaction) {
+    _map_update_begin();
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        GroupState *state = &_groups[group];
+        if (!(state->flags & GROUP_FLAG_STAGED) || (state->flags & GROUP_FLAG_RELEASED) || state->transaction != transaction) {
+            continue;
+        }
+
+        for (uint16_t previous = 0; previous < _groups_count; ++previous) {
+            if (_is_group_live(previous) && _groups[previous].logical_id == state->logical_id) {
+                _groups[previous].flags |= GROUP_FLAG_RELEASED;
+                _released_groups_count++;
+            }
+        }
+
+        state->flags &= ~GROUP_FLAG_STAGED;
+        if (state->logical_id < _logical_sectors_count) {
+            _logical_map[state->logical_id] = group;
+            _merkle_update(state->logical_id);
+        }
+    }
+    _map_update_end();
+}
+
+/**
+ * @brief Assigns a free group to a logical ID. Free groups are already erased, so this only costs
+ * a metadata record.
+ */
+void _claim_group(uint32_t first_physical_sector, uint16_t logical_id, uint8_t flags, uint16_t transaction) {
+    assert(first_physical_sector < _upper_bound);
+
+    uint16_t group = _get_group_index(first_physical_sector);
+    _map_update_begin();
+    if (!(flags & GROUP_FLAG_STAGED)) {
+        _logical_map[logical_id] = group;
+    }
+    _set_group_state(group, logical_id, flags, transaction);
+    _map_update_end();
+}
+
+void _release_group(uint32_t first_physical_sector) {
+    uint16_t group = _get_group_index(first_physical_sector);
+    GroupState *state = &_groups[group];
+    _map_update_begin();
+    if (state->logical_id < _logical_sectors_count && _logical_map[state->logical_id] == group) {
+        _logical_map[state->logical_id] = NO_GROUP;
+    }
+
+    _set_group_state(group, state->logical_id, state->flags | GROUP_FLAG_RELEASED, state->transaction);
+    _map_update_end();
+    _released_groups_count++;
+}
+
+/**
+ * @brief Erases the payload of a group and records it as free.
+ */
+void _format_free_group(uint32_t first_physical_sector) {
+    _erase_dirty_slots(first_physical_sector);
+    _set_group_state(_get_group_index(first_physical_sector), FREE_LOGICAL_ID, 0, 0xFFFF);
+}
+
+/**
+ * @brief Retrieves a free group, formatting a released group if none is left.
+ *
+ * @return The first sector of the group, or _upper_bound if every group is in use.
+ */
+uint32_t _get_free_group() {
+    uint32_t group = _allocate_group();
+    if (group != _upper_bound || _released_groups_count == 0) {
+        return group;
+    }
+
+    for (uint16_t released = 0; released < _groups_count; ++released) {
+        if (_groups[released].flags & GROUP_FLAG_RELEASED) {
+            uint32_t first_physical_sector = _get_group_first_sector(released);
+            _format_free_group(first_physical_sector);
+            _released_groups_count--;
+            return first_physical_sector;
+        }
+    }
+    return _upper_bound;
+}
+
+/**
+ * @brief Claims a free group for a logical sector that has none, with thin provisioning. Free
+ * groups are already erased, so the logical sector still reads as blank.
+ *
+ * @return false if no group is free, counted in FlashLibStats.
+ */
+bool _provision_logical_sector(uint16_t logical_sector) {
+    if (_logical_map[logical_sector] != NO_GROUP) {
+        return true;
+    }
+
+    uint32_t group = _get_free_group();
+    if (group == _upper_bound) {
+        _out_of_space_total++;
+        return false;
+    }
+
+    _claim_group(group, logical_sector, 0, 0xFFFF);
+    _merkle_update(logical_sector);
+    return true;
+}
+
+/**
+ * @brief Groups available to new logical sectors and transactions, released ones included.
+ */
+uint16_t _get_free_groups_count() {
+    uint16_t count = 0;
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        if (_is_group_free(group) || (_groups[group].flags & GROUP_FLAG_RELEASED)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Starts a change of the mapping, see _map_sequence. Changes are done by a single writer at
+ * a time, the lock of flash_lock.h or the application serializes them.
+ */
+void _map_update_begin() {
+    if (_map_update_depth++ == 0) {
+        _map_sequence++;
+        __dmb();
+    }
+}
+
+void _map_update_end() {
+    if (--_map_update_depth == 0) {
+        __dmb();
+        _map_sequence++;
+    }
+}
+
+void _set_busy_group(uint16_t group) {
+    _map_update_begin();
+    _busy_group = group;
+    _map_update_end();
+}
+
+/**
+ * @brief Updates the content hash of a group in RAM and in the metadata log, if it changes.
+ */
+void _set_content_hash(uint16_t group, uint32_t hash) {
+    if (_content_hashes == NULL || _content_hashes[group] == hash) {
+        return;
+    }
+
+    _content_hashes[group] = hash;
+    MetadataRecord record;
+    _content_hash_record(group, &record);
+    _metadata_append(&record);
+}
+
+void _content_hash_record(uint16_t group, MetadataRecord *record) {
+    *record = (MetadataRecord){
+        .type = RECORD_HASH,
+        .flags = 0xFF,
+        .index = group,
+        .logical_id = _content_hashes[group] & 0xFFFF,
+        .transaction = _content_hashes[group] >> 16,
+    };
+}
+
+/**
+ * @brief 32-bit hash of a logical sector content, one multiply per word so 4 KB hash in a fraction
+ * of a page program, and a final mix so every input bit affects every output bit.
+ */
+uint32_t _content_hash(const uint8_t *data, uint32_t count) {
+    uint32_t hash = 0x811C9DC5 ^ count;
+    uint32_t i = 0;
+
+    // Cortex-M0+ has no unaligned loads
+    if (((uintptr_t)data & 3) == 0) {
+        const uint32_t *words = (const uint32_t *)data;
+        for (; i + 4 <= count; i += 4) {
+            hash = ((hash << 5 | hash >> 27) ^ words[i / 4]) * 0x9E3779B1;
+        }
+    }
+
+    for (; i < count; ++i) {
+        hash = ((hash << 5 | hash >> 27) ^ data[i]) * 0x9E3779B1;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash != CONTENT_HASH_NONE ? hash : 1;
+}
+
+/**
+ * @brief Share of a word of a group in its digest. The digest of a group is the sum of the shares of
+ * its words, so a program or an erase updates it from the words it changes only, and erased words
+ * weigh nothing.
+ */
+uint32_t _digest_word(uint32_t index, uint32_t word) {
+    if (word == 0xFFFFFFFF) {
+        return 0;
+    }
+
+    uint32_t hash = word ^ (index + 1) * 0x9E3779B1;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * @brief Change of the digest of a group, or of the checksum of a tier slot, when `count` bytes at
+ * `offset_bytes` are programmed with `data`, or erased if `data` is NULL. Must be called before
+ * `content` changes, as it reads the current content.
+ */
+uint32_t _digest_delta(const uint8_t *content, uint32_t offset_bytes, const uint8_t *data, uint32_t count) {
+    uint32_t end = offset_bytes + count;
+    uint32_t delta = 0;
+
+    for (uint32_t word_offset = offset_bytes & ~3u; word_offset < end; word_offset += 4) {
+        uint32_t previous;
+        memcpy(&previous, content + word_offset, sizeof(uint32_t));
+
+        uint32_t word = 0xFFFFFFFF;
+        if (data != NULL) {
+            // Programming only clears bits, the bytes outside of the range keep their value
+            uint8_t bytes[4];
+            memcpy(bytes, &previous, sizeof(uint32_t));
+            for (uint8_t i = 0; i < 4; ++i) {
+                if (word_offset + i >= offset_bytes && word_offset + i < end) {
+                    bytes[i] &= data[word_offset + i - offset_bytes];
+                }
+            }
+            memcpy(&word, bytes, sizeof(uint32_t));
+        }
+
+        delta += _digest_word(word_offset / 4, word) - _digest_word(word_offset / 4, previous);
+    }
+    return delta;
+}
+
+void _add_digest(uint16_t group, uint32_t delta) {
+    _digests[group] += delta;
+    _merkle_update(_groups[group].logical_id);
+}
+
+/**
+ * @brief Appends the digest of a group to the metadata log. Programs are preceded by
+ * DIGEST_UNKNOWN and followed by the new digest, so a power loss in between never leaves a stale
+ * digest in the log.
+ */
+void _log_digest(uint16_t group, uint32_t digest) {
+    if (_digests == NULL) {
+        return;
+    }
+
+    MetadataRecord record;
+    _digest_record(group, digest, &record);
+    _metadata_append(&record);
+}
+
+void _digest_record(uint16_t group, uint32_t digest, MetadataRecord *record) {
+    *record = (MetadataRecord){
+        .type = RECORD_DIGEST,
+        .flags = 0xFF,
+        .index = group,
+        .logical_id = digest & 0xFFFF,
+        .transaction = digest >> 16,
+    };
+}
+
+/**
+ * @brief Updates the leaf of a logical sector and its ancestors. A tombstoned logical sector reads
+ * as blank and has the digest of a blank group.
+ */
+void _merkle_update(uint16_t logical_id) {
+    if (_merkle_nodes == NULL || logical_id >= _logical_sectors_count) {
+        return;
+    }
+
+    uint16_t group = _logical_map[logical_id];
+    uint32_t node = _merkle_leaves + logical_id;
+    _merkle_nodes[node] = group != NO_GROUP && !(_groups[group].flags & GROUP_FLAG_TOMBSTONE) ? _digests[group] : 0;
+    while (node > 1) {
+        node /= 2;
+        _merkle_nodes[node] = _merkle_combine(_merkle_nodes[2 * node], _merkle_nodes[2 * node + 1]);
+    }
+}
+
+/**
+ * @brief Recomputes the digests left unknown by a power loss during a program, from the flash, and
+ * the whole Merkle tree. Called once the mapping is rebuilt by the initialization.
+ */
+void _merkle_rebuild() {
+    if (_merkle_nodes == NULL) {
+        return;
+    }
+
+    for (uint16_t logical_id = 0; logical_id < _logical_sectors_count; ++logical_id) {
+        uint16_t group = _logical_map[logical_id];
+        uint32_t node = _merkle_leaves + logical_id;
+        _merkle_nodes[node] = 0;
+        if (group == NO_GROUP || (_groups[group].flags & GROUP_FLAG_TOMBSTONE)) {
+            continue;
+        }
+
+        if (_digests[group] == DIGEST_UNKNOWN) {
+            // The digest of the content is what erasing all of it takes away
+            _digests[group] = -_digest_delta(get_sector_read_pointer(_get_group_first_sector(group)), 0, NULL, get_logical_sector_size());
+        }
+        _merkle_nodes[node] = _digests[group];
+    }
+
+    for (uint32_t node = _merkle_leaves - 1; node >= 1; --node) {
+        _merkle_nodes[node] = _merkle_combine(_merkle_nodes[2 * node], _merkle_nodes[2 * node + 1]);
+    }
+}
+
+/**
+ * @brief Digest of a node from the digests of its children. Blank subtrees stay 0, so the nodes
+ * past the last logical sector cost nothing to compare.
+ */
+uint32_t _merkle_combine(uint32_t left, uint32_t right) {
+    if (left == 0 && right == 0) {
+        return 0;
+    }
+
+    uint32_t hash = (left * 0x9E3779B1 ^ (right << 15 | right >> 17)) + 0x85EBCA6B;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Rebuilds the slots of the front tier from its directory, or formats it if it is volatile
+ * or was formatted for another logical sector size. Slots whose checksum does not match their
+ * content are dropped and reported, the flash keeps the previous version.
+ */
+void _tier_mount() {
+    if (_tier_slots_count == 0) {
+        return;
+    }
+
+    TierHeader *header = (TierHeader *)_tier_base;
+    volatile TierEntry *entries = _tier_entries();
+    bool formatted = (_tier_persistent || _tier_retained) && header->signature == TIER_SIGNATURE &&
+                     header->slot_size == get_logical_sector_size() && header->slots_count == _tier_slots_count;
+
+    memset(_tier_map, 0xFF, _logical_sectors_count * sizeof(uint16_t));
+    _tier_dropped_total = 0;
+    for (uint16_t slot = 0; slot < _tier_slots_count; ++slot) {
+        _tier_slots[slot] = FREE_LOGICAL_ID;
+        _tier_ages[slot] = 0;
+
+        uint32_t entry = formatted ? entries[slot].logical_id : TIER_ENTRY_FREE;
+        uint16_t logical_id = entry & 0xFFFF;
+        // A slot is provisioned before it is written, one without a group was left by another configuration
+        if ((uint16_t)(entry >> 16) != (uint16_t)~logical_id || logical_id >= _logical_sectors_count ||
+            _tier_map[logical_id] != TIER_NO_SLOT || _logical_map[logical_id] == NO_GROUP) {
+            entries[slot].logical_id = TIER_ENTRY_FREE;
+            continue;
+        }
+
+        if (entries[slot].checksum != _tier_checksum(slot)) {
+            entries[slot].logical_id = TIER_ENTRY_FREE;
+            _tier_dropped_total++;
+            _report_loss(logical_id, FLASH_LOSS_REVERTED);
+            continue;
+        }
+        _tier_set_entry(slot, logical_id);
+    }
+
+    if (!formatted) {
+        *header = (TierHeader){TIER_SIGNATURE, get_logical_sector_size(), _tier_slots_count, 0};
+    }
+    _tier_clock = 0;
+}
+
+volatile TierEntry *__not_in_flash_func(_tier_entries)() {
+    return (volatile TierEntry *)(_tier_base + sizeof(TierHeader));
+}
+
+uint8_t *__not_in_flash_func(_tier_slot_data)(uint16_t slot) {
+    return _tier_base + sizeof(TierHeader) + _tier_slots_count * sizeof(TierEntry) + slot * (FLASH_LIB_SECTOR_SIZE * _group_by);
+}
+
+/**
+ * @brief Checksum of the content of a slot, the sum of the digests of its words like the digest of
+ * a group, so writes update it with _digest_delta() in proportion to their size.
+ */
+uint32_t _tier_checksum(uint16_t slot) {
+    const uint32_t *words = (const uint32_t *)_tier_slot_data(slot);
+    uint32_t checksum = 0;
+    for (uint32_t i = 0; i < get_logical_sector_size() / sizeof(uint32_t); ++i) {
+        checksum += _digest_word(i, words[i]);
+    }
+    return checksum;
+}
+
+/**
+ * @brief Assigns a slot to a logical ID, or frees it with FREE_LOGICAL_ID, in RAM and in the
+ * directory of the tier.
+ */
+void _tier_set_entry(uint16_t slot, uint16_t logical_id) {
+    volatile TierEntry *entries = _tier_entries();
+    if (_tier_slots[slot] != FREE_LOGICAL_ID) {
+        _tier_map[_tier_slots[slot]] = TIER_NO_SLOT;
+    }
+
+    _tier_slots[slot] = logical_id;
+    if (logical_id == FREE_LOGICAL_ID) {
+        entries[slot].logical_id = TIER_ENTRY_FREE;
+        return;
+    }
+
+    entries[slot].logical_id = logical_id | (uint32_t)(uint16_t)~logical_id << 16;
+    _tier_map[logical_id] = slot;
+}
+
+/**
+ * @brief Slot of a logical sector in the front tier, taken if it has none. A new slot starts with
+ * `count` bytes of `data` followed by blank bytes, or with the content of the flash if `data` is
+ * NULL. The slot is only taken once its content is complete, so a power loss before leaves the
+ * flash current.
+ */
+uint16_t _tier_promote(uint16_t logical_sector, const uint8_t *data, uint32_t count) {
+    if (_tier_map[logical_sector] != TIER_NO_SLOT) {
+        return _tier_map[logical_sector];
+    }
+
+    uint16_t slot = _tier_get_free_slot();
+    uint8_t *slot_data = _tier_slot_data(slot);
+    uint32_t sector_size = get_logical_sector_size();
+    if (data != NULL) {
+        memcpy(slot_data, data, count);
+        memset(slot_data + count, 0xFF, sector_size - count);
+    } else if (_is_tombstoned(logical_sector)) {
+        memset(slot_data, 0xFF, sector_size);
+    } else {
+        memcpy(slot_data, get_sector_read_pointer(_get_group_first_sector(_logical_map[logical_sector])), sector_size);
+    }
+    _tier_entries()[slot].checksum = _tier_checksum(slot);
+
+    _tier_ages[slot] = ++_tier_clock;
+    // The content reaches the tier before the directory entry
+    __dmb();
+    _map_update_begin();
+    _tier_set_entry(slot, logical_sector);
+    _map_update_end();
+    return slot;
+}
+
+/**
+ * @brief Free slot of the front tier. When the tier is full, a batch of the least recently written
+ * slots is demoted, which spreads the flash work over the next promotions.
+ */
+uint16_t _tier_get_free_slot() {
+    for (uint16_t slot = 0; slot < _tier_slots_count; ++slot) {
+        if (_tier_slots[slot] == FREE_LOGICAL_ID) {
+            return slot;
+        }
+    }
+
+    // Half of the tier at most, the most recently written slots are likely to be written again. Far
+    // over the wear budget, only one slot is demoted so the tier keeps as many writes as it can.
+    uint16_t batch = FLASH_LIB_TIER_DEMOTE_BATCH < _tier_slots_count / 2 ? FLASH_LIB_TIER_DEMOTE_BATCH : _tier_slots_count / 2;
+    if (_wear_budget_set && _wear_level() == FLASH_WEAR_HOLD) {
+        batch = 1;
+    }
+    _tier_demote_oldest(batch > 0 ? batch : 1);
+    return _tier_get_free_slot();
+}
+
+uint16_t _tier_slots_used() {
+    uint16_t used = 0;
+    for (uint16_t slot = 0; slot < _tier_slots_count; ++slot) {
+        used += _tier_slots[slot] != FREE_LOGICAL_ID;
+    }
+    return used;
+}
+
+/**
+ * @brief Programs data into a slot. Programs only clear bits, as on the flash, so the slot ends up
+ * with the content the flash would have.
+ */
+void _tier_write(uint16_t slot, uint32_t offset_bytes, const uint8_t *data, uint32_t count) {
+    assert(offset_bytes + count <= get_logical_sector_size());
+    uint8_t *slot_data = _tier_slot_data(slot);
+    uint32_t checksum_delta = _digest_delta(slot_data, offset_bytes, data, count);
+
+    _map_update_begin();
+    for (uint32_t i = 0; i < count; ++i) {
+        slot_data[offset_bytes + i] &= data[i];
+    }
+    _tier_entries()[slot].checksum += checksum_delta;
+    _map_update_end();
+    _tier_ages[slot] = ++_tier_clock;
+}
+
+/**
+ * @brief Replaces the content of a slot by `count` bytes of `data` followed by blank bytes.
+ *
+ * @return false if the slot already held that content.
+ */
+bool _tier_fill(uint16_t slot, const uint8_t *data, uint32_t count) {
+    uint8_t *slot_data = _tier_slot_data(slot);
+    uint32_t blank_end = get_logical_sector_size();
+    while (blank_end > count && slot_data[blank_end - 1] == 0xFF) {
+        blank_end--;
+    }
+
+    if (blank_end == count && (count == 0 || memcmp(slot_data, data, count) == 0)) {
+        return false;
+    }
+
+    _map_update_begin();
+    if (count > 0) {
+        memcpy(slot_data, data, count);
+    }
+    memset(slot_data + count, 0xFF, blank_end - count);
+    _tier_entries()[slot].checksum = _tier_checksum(slot);
+    _map_update_end();
+    _tier_ages[slot] = ++_tier_clock;
+    return true;
+}
+
+/**
+ * @brief Checks if the flash can take the content of a slot without an erase: the group is not
+ * tombstoned and the slot only clears bits of it, like appends written to the tier.
+ */
+bool _tier_can_program_in_place(uint16_t slot) {
+    uint16_t logical_sector = _tier_slots[slot];
+    if (_is_tombstoned(logical_sector)) {
+        return false;
+    }
+
+    const uint32_t *flash = (const uint32_t *)get_sector_read_pointer(_get_group_first_sector(_logical_map[logical_sector]));
+    const uint32_t *words = (const uint32_t *)_tier_slot_data(slot);
+    for (uint32_t i = 0; i < get_logical_sector_size() / sizeof(uint32_t); ++i) {
+        if ((flash[i] & words[i]) != words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Estimated duration of _tier_demote() from the costs of the geometry, or UINT32_MAX if the
+ * metadata log is too full for its records, as a compaction erases.
+ */
+uint32_t _tier_demote_cost_us(uint16_t slot) {
+    uint16_t logical_sector = _tier_slots[slot];
+    uint32_t first_physical_sector = _get_group_first_sector(_logical_map[logical_sector]);
+    const uint8_t *flash = get_sector_read_pointer(first_physical_sector);
+    const uint8_t *data = _tier_slot_data(slot);
+    bool in_place = _tier_can_program_in_place(slot);
+
+    uint32_t erases = 0;
+    uint32_t programs = 0;
+    // Digest and content hash records around the programs, plus the group state and erase records
+    // of a rewrite
+    uint32_t records = in_place ? 4 : 4 + _group_by;
+    for (uint32_t offset = 0; offset < get_logical_sector_size(); offset += FLASH_LIB_PAGE_SIZE) {
+        if (offset % FLASH_LIB_SECTOR_SIZE == 0 && !in_place && _is_slot_dirty(first_physical_sector + offset / FLASH_LIB_SECTOR_SIZE)) {
+            erases++;
+        }
+
+        const uint8_t *page = data + offset;
+        bool differs = memcmp(page, flash + offset, FLASH_LIB_PAGE_SIZE) != 0;
+        bool blank = page[0] == 0xFF && memcmp(page, page + 1, FLASH_LIB_PAGE_SIZE - 1) == 0;
+        programs += in_place ? differs : !blank;
+    }
+
+    if (_metadata_head + records * sizeof(MetadataRecord) > _get_metadata_half_size()) {
+        return UINT32_MAX;
+    }
+    return erases * _geometry.erase_units[0].cost_us + (programs + records) * _geometry.program_cost_us;
+}
+
+/**
+ * @brief Writes a slot back to the flash and frees it. Content that only clears bits of the flash,
+ * like appends, is programmed in place over the pages that differ. Otherwise the group is
+ * rewritten if its content differs, and a blank slot becomes a tombstone. The slot stays current
+ * until the flash holds its data, so a power loss during the demotion loses nothing.
+ */
+void _tier_demote(uint16_t slot) {
+    uint16_t logical_sector = _tier_slots[slot];
+    uint16_t group = _logical_map[logical_sector];
+    uint32_t first_physical_sector = _get_group_first_sector(group);
+    const uint8_t *flash = get_sector_read_pointer(first_physical_sector);
+    const uint8_t *data = _tier_slot_data(slot);
+    uint32_t sector_size = get_logical_sector_size();
+    uint32_t count = sector_size;
+    while (count > 0 && data[count - 1] == 0xFF) {
+        count--;
+    }
+    uint32_t hash = _content_hashes != NULL ? _content_hash(data, count) : CONTENT_HASH_NONE;
+
+    if (count == 0) {
+        _tombstone_logical_sector(logical_sector);
+    } else if (memcmp(flash, data, sector_size) == 0 && !_is_tombstoned(logical_sector)) {
+        // Already in the flash
+    } else if (_tier_can_program_in_place(slot)) {
+        _set_content_hash(group, CONTENT_HASH_NONE);
+        _log_digest(group, DIGEST_UNKNOWN);
+        _set_busy_group(group);
+        for (uint32_t offset = 0; offset < count; offset += FLASH_LIB_PAGE_SIZE) {
+            // From the first to the last byte that differs in the page
+            uint32_t begin = offset;
+            uint32_t end = offset + FLASH_LIB_PAGE_SIZE < count ? offset + FLASH_LIB_PAGE_SIZE : count;
+            while (begin < end && flash[begin] == data[begin]) {
+                begin++;
+            }
+            while (end > begin && flash[end - 1] == data[end - 1]) {
+                end--;
+            }
+
+            if (begin < end) {
+                _program_group(first_physical_sector, begin, data + begin, end - begin);
+            }
+        }
+        _set_busy_group(NO_GROUP);
+        _log_digest(group, _digests != NULL ? _digests[group] : 0);
+        _set_content_hash(group, hash);
+    } else {
+        _rewrite_group(logical_sector, data, count, hash);
+    }
+
+    _map_update_begin();
+    _tier_set_entry(slot, FREE_LOGICAL_ID);
+    _map_update_end();
+    _tier_demotions_total++;
+}
+
+/**
+ * @brief Demotes up to `max_sectors` slots, the least recently written first.
+ */
+void _tier_demote_oldest(uint16_t max_sectors) {
+    for (; max_sectors > 0; --max_sectors) {
+        uint16_t oldest = TIER_NO_SLOT;
+        for (uint16_t slot = 0; slot < _tier_slots_count; ++slot) {
+            if (_tier_slots[slot] != FREE_LOGICAL_ID && (oldest == TIER_NO_SLOT || _tier_ages[slot] < _tier_ages[oldest])) {
+                oldest = slot;
+            }
+        }
+
+        if (oldest == TIER_NO_SLOT) {
+            return;
+        }
+        _tier_demote(oldest);
+    }
+}
+
+/**
+ * @brief Makes the flash current for a logical sector, before an operation that works on the flash.
+ */
+void _tier_demote_logical(uint16_t logical_sector) {
+    if (_tier_map != NULL && _tier_map[logical_sector] != TIER_NO_SLOT) {
+        _tier_demote(_tier_map[logical_sector]);
+    }
+}
+
+/**
+ * @brief Frees the slot of a logical sector without writing it back, the flash becomes current.
+ */
+void _tier_discard(uint16_t logical_sector) {
+    if (_tier_map == NULL || _tier_map[logical_sector] == TIER_NO_SLOT) {
+        return;
+    }
+
+    _map_update_begin();
+    _tier_set_entry(_tier_map[logical_sector], FREE_LOGICAL_ID);
+    _map_update_end();
+}
+
+/**
+ * @brief Updates the state of a group in RAM and appends it to the metadata log.
+ */
+void _set_group_state(uint16_t group, uint16_t logical_id, uint8_t flags, uint16_t transaction) {
+    uint16_t previous_logical_id = _groups[group].logical_id;
+    _map_update_begin();
+    _groups[group] = (GroupState){logical_id, transaction, flags};
+    _map_update_end();
+    // Any change of the group makes its content unknown, and so does the replay of the record
+    if (_content_hashes != NULL) {
+        _content_hashes[group] = CONTENT_HASH_NONE;
+    }
+    // A group changes state when it is claimed blank, tombstoned, erased or released, its digest is
+    // the one of a blank group or no longer used
+    if (_digests != NULL) {
+        _digests[group] = 0;
+        _merkle_update(previous_logical_id);
+        _merkle_update(logical_id);
+    }
+
+    MetadataRecord record = {
+        .type = RECORD_GROUP,
+        .flags = flags,
+        .index = group,
+        .logical_id = logical_id,
+        .transaction = transaction,
+    };
+    _metadata_append(&record);
+}
+
+uint32_t _get_metadata_half_size() {
+    return _metadata_sectors_count / 2 * FLASH_LIB_SECTOR_SIZE;
+}
+
+uint32_t _get_metadata_addr(uint8_t half, uint32_t offset) {
+    return get_memory_addr_from_physical_sector(_metadata_lower_bound) + half * _get_metadata_half_size() + offset;
+}
+
+/**
+ * @brief Finds the current half of the metadata log and replays it into the RAM state.
+ *
+ * @return false if no half holds a complete snapshot, the region is then unformatted.
+ */
+bool _metadata_mount() {
+    int8_t current_half = -1;
+    for (uint8_t half = 0; half < 2; ++half) {
+        const MetadataHeader *header = (const MetadataHeader *)(_get_metadata_addr(half, 0) + XIP_BASE);
+        if (header->signature != MEMORY_SIGNATURE || header->complete != 0) {
+            continue;
+        }
+
+        if (current_half < 0 || header->sequence > _metadata_sequence) {
+            current_half = half;
+            _metadata_sequence = header->sequence;
+        }
+    }
+
+    if (current_half < 0) {
+        _metadata_half = 0;
+        _metadata_sequence = 0;
+        return false;
+    }
+
+    _metadata_half = current_half;
+    _next_transaction = 0;
+
+    const MetadataHeader *header = (const MetadataHeader *)(_get_metadata_addr(_metadata_half, 0) + XIP_BASE);
+    _allocation_cursor = header->cursor < _groups_count ? header->cursor : 0;
+
+    const uint8_t *read_pointer = (const uint8_t *)(_get_metadata_addr(_metadata_half, 0) + XIP_BASE);
+    uint32_t offset = sizeof(MetadataHeader);
+    while (offset + sizeof(MetadataRecord) <= _get_metadata_half_size()) {
+        const MetadataRecord *record = (const MetadataRecord *)(read_pointer + offset);
+        if (record->type == RECORD_NONE) {
+            const uint32_t *words = (const uint32_t *)record;
+            if (words[0] == 0xFFFFFFFF && words[1] == 0xFFFFFFFF) {
+                break;
+            }
+
+            // Record torn by a power loss, skipped so the next one is not programmed over it
+            offset += sizeof(MetadataRecord);
+            continue;
+        }
+
+        _metadata_replay(record);
+        offset += sizeof(MetadataRecord);
+    }
+
+    _metadata_head = offset;
+    return true;
+}
+
+void _metadata_replay(const MetadataRecord *record) {
+    uint32_t sectors_count = _upper_bound - _lower_bound;
+
+    if (record->type == RECORD_GROUP && record->index < _groups_count) {
+        if (_content_hashes != NULL) {
+            _content_hashes[record->index] = CONTENT_HASH_NONE;
+        }
+        if (_digests != NULL) {
+            _digests[record->index] = 0;
+        }
+        // A free group being assigned moves the round-robin cursor past it
+        if (_is_group_free(record->index) && record->logical_id != FREE_LOGICAL_ID) {
+            _allocation_cursor = (record->index + 1) % _groups_count;
+        }
+        _groups[record->index] = (GroupState){record->logical_id, record->transaction, record->flags};
+        if (record->flags & GROUP_FLAG_STAGED) {
+            _next_transaction = record->transaction + 1;
+        }
+    } else if (record->type == RECORD_ERASE_COUNT && record->index < sectors_count) {
+        _erase_counts[record->index] = record->logical_id;
+    } else if (record->type == RECORD_ERASE) {
+        for (uint32_t i = record->index; i < (uint32_t)record->index + record->flags && i < sectors_count; ++i) {
+            _erase_counts[i]++;
+        }
+    } else if (record->type == RECORD_HASH && record->index < _groups_count) {
+        if (_content_hashes != NULL) {
+            _content_hashes[record->index] = record->logical_id | (uint32_t)record->transaction << 16;
+        }
+    } else if (record->type == RECORD_DIGEST && record->index < _groups_count) {
+        if (_digests != NULL) {
+            _digests[record->index] = record->logical_id | (uint32_t)record->transaction << 16;
+        }
+    } else if (record->type == RECORD_SCRUB) {
+        _scrub_cursor = record->index <= _groups_count ? record->index : 0;
+        _scrub_passes = record->logical_id | (uint32_t)record->transaction << 16;
+    } else if (record->type == RECORD_WEAR && record->index < WEAR_REGIONS_COUNT) {
+        if (_wear_budget_set) {
+            // The time the device was off is unknown, the debt restarts from the recorded one
+            int32_t debt_s = (int32_t)(record->logical_id | (uint32_t)record->transaction << 16);
+            _wear_debt_us[record->index] = debt_s * US_PER_SECOND;
+            if (_wear_debt_us[record->index] < -_wear_burst_us) {
+                _wear_debt_us[record->index] = -_wear_burst_us;
+            }
+            _wear_last_us = time_us_64();
+        }
+    } else if (record->type == RECORD_COMMIT) {
+        _apply_transaction(record->transaction);
+        _next_transaction = record->transaction + 1;
+    }
+}
+
+/**
+ * @brief Appends a record to the metadata log, the RAM state must already include its change.
+ *
+ * When the current half is full, a snapshot of the RAM state is written to the other half instead,
+ * which persists the change as well. Records are skipped until init_sectors() wrote the first
+ * snapshot of an unformatted region.
+ */
+void _metadata_append(const MetadataRecord *record) {
+    if (!_metadata_mounted) {
+        return;
+    }
+
+    if (_step_defer_records) {
+        assert(_step_records_count < STEP_MAX_RECORDS);
+        _step_records[_step_records_count++] = *record;
+        return;
+    }
+
+    if (_metadata_head + sizeof(MetadataRecord) > _get_metadata_half_size()) {
+        _metadata_compact();
+        return;
+    }
+
+    _program_padded(_get_metadata_addr(_metadata_half, _metadata_head), (const uint8_t *)record, sizeof(MetadataRecord));
+
+    _metadata_head += sizeof(MetadataRecord);
+
+    // Appended after another record rather than by the erase, which may run within a compaction
+    if (_wear_unsaved_erases >= FLASH_LIB_WEAR_CHECKPOINT) {
+        _wear_checkpoint();
+    }
+}
+
+/**
+ * @brief Writes a snapshot of the RAM state to the other half of the metadata region and switches
+ * to it. The snapshot is marked complete last, so a power loss keeps the previous half.
+ */
+void _metadata_compact() {
+    while (!_metadata_compact_step(_metadata_sectors_count / 2)) {
+    }
+}
+
+/**
+ * @brief Does one step of _metadata_compact(): erases up to `max_sectors` sectors of the other
+ * half, or programs one page of the snapshot, or marks it complete and switches to it. The RAM
+ * state must not change between the steps of a compaction.
+ *
+ * @return true once the compaction is complete.
+ */
+bool _metadata_compact_step(uint16_t max_sectors) {
+    uint16_t half_sectors = _metadata_sectors_count / 2;
+    if (_compact_half < 0) {
+        _compact_half = _metadata_half ^ 1;
+        _compact_position = 0;
+    }
+
+    if (_compact_position < half_sectors) {
+        uint16_t sectors = half_sectors - _compact_position;
+        if (sectors > max_sectors) {
+            sectors = max_sectors;
+        }
+        _flash_erase(_get_metadata_addr(_compact_half, _compact_position * FLASH_LIB_SECTOR_SIZE), sectors * FLASH_LIB_SECTOR_SIZE);
+        _compact_position += sectors;
+        return false;
+    }
+
+    // The granule holding the complete flag is programmed once, by the last step
+    uint32_t granularity = _geometry.program_granularity;
+    uint32_t flag_begin = offsetof(MetadataHeader, complete) & ~(granularity - 1);
+    uint32_t flag_end = (offsetof(MetadataHeader, complete) + sizeof(uint32_t) + granularity - 1) & ~(granularity - 1);
+
+    uint8_t pageBuffer[FLASH_LIB_PAGE_SIZE];
+    uint32_t snapshot_size = _get_metadata_snapshot_size();
+    uint32_t page = _compact_position - half_sectors;
+    if (page * FLASH_LIB_PAGE_SIZE < snapshot_size) {
+        _metadata_snapshot_page(page, pageBuffer);
+        uint32_t memory_addr = _get_metadata_addr(_compact_half, page * FLASH_LIB_PAGE_SIZE);
+        // The end of the last page is left to the records appended after the snapshot
+        uint32_t page_end = snapshot_size - page * FLASH_LIB_PAGE_SIZE;
+        page_end = page_end < FLASH_LIB_PAGE_SIZE ? (page_end + granularity - 1) & ~(granularity - 1) : FLASH_LIB_PAGE_SIZE;
+        if (page > 0) {
+            _flash_program(memory_addr, pageBuffer, page_end);
+        } else {
+            if (flag_begin > 0) {
+                _flash_program(memory_addr, pageBuffer, flag_begin);
+            }
+            if (flag_end < page_end) {
+                _flash_program(memory_addr + flag_end, pageBuffer + flag_end, page_end - flag_end);
+            }
+        }
+        _compact_position++;
+        return false;
+    }
+
+    _metadata_snapshot_page(0, pageBuffer);
+    uint32_t complete = 0;
+    memcpy(pageBuffer + offsetof(MetadataHeader, complete), &complete, sizeof(uint32_t));
+    _flash_program(_get_metadata_addr(_compact_half, flag_begin), pageBuffer + flag_begin, flag_end - flag_begin);
+
+    _metadata_half = _compact_half;
+    _metadata_sequence++;
+    _metadata_head = snapshot_size;
+    _compact_half = -1;
+    _wear_unsaved_erases = 0;
+    return true;
+}
+
+/**
+ * @brief Size of a snapshot: the header, the state of every group and the erase count of every
+ * physical sector, then the content hash and the digest of every group if they are enabled.
+ */
+uint32_t _get_metadata_snapshot_size() {
+    uint32_t hashes_count = _content_hashes != NULL ? _groups_count : 0;
+    uint32_t digests_count = _digests != NULL ? _groups_count : 0;
+    uint32_t wear_count = _wear_budget_set ? WEAR_REGIONS_COUNT : 0;
+    // The last records hold the debts of the wear budget and the cursor of the scrubber
+    return sizeof(MetadataHeader) +
+           (_groups_count + _upper_bound - _lower_bound + hashes_count + digests_count + wear_count + 1) * sizeof(MetadataRecord);
+}
+
+/**
+ * @brief Builds one page of the snapshot written by _metadata_compact(), from the RAM state.
+ */
+void _metadata_snapshot_page(uint32_t page, uint8_t *pageBuffer) {
+    memset(pageBuffer, 0xFF, FLASH_LIB_PAGE_SIZE);
+
+    if (page == 0) {
+        MetadataHeader header = {
+            .signature = MEMORY_SIGNATURE,
+            .sequence = _metadata_sequence + 1,
+            .complete = 0xFFFFFFFF,
+            .cursor = _allocation_cursor,
+        };
+        memcpy(pageBuffer, &header, sizeof(MetadataHeader));
+    }
+
+    uint32_t snapshot_size = _get_metadata_snapshot_size();
+    for (uint32_t offset = page * FLASH_LIB_PAGE_SIZE; offset < (page + 1) * FLASH_LIB_PAGE_SIZE && offset < snapshot_size;
+         offset += sizeof(MetadataRecord)) {
+        if (offset < sizeof(MetadataHeader)) {
+            continue;
+        }
+
+        uint32_t i = (offset - sizeof(MetadataHeader)) / sizeof(MetadataRecord);
+        uint32_t from_end = (snapshot_size - offset) / sizeof(MetadataRecord);
+        MetadataRecord record;
+        if (from_end == 1) {
+            _scrub_record(&record);
+        } else if (_wear_budget_set && from_end <= WEAR_REGIONS_COUNT + 1) {
+            _wear_record(WEAR_REGIONS_COUNT + 1 - from_end, &record);
+        } else if (i < _groups_count) {
+            record = (MetadataRecord){
+                .type = RECORD_GROUP,
+                .flags = _groups[i].flags,
+                .index = i,
+                .logical_id = _groups[i].logical_id,
+                .transaction = _groups[i].transaction,
+            };
+        } else if (i < _groups_count + _upper_bound - _lower_bound) {
+            record = (MetadataRecord){
+                .type = RECORD_ERASE_COUNT,
+                .flags = 0xFF,
+                .index = i - _groups_count,
+                .logical_id = _erase_counts[i - _groups_count],
+                .transaction = 0xFFFF,
+            };
+        } else if (_content_hashes != NULL && i < 2 * _groups_count + _upper_bound - _lower_bound) {
+            // After the group records, which clear the hashes and digests when they are replayed
+            _content_hash_record(i - _groups_count - (_upper_bound - _lower_bound), &record);
+        } else {
+            uint16_t group = i - _groups_count - (_upper_bound - _lower_bound) - (_content_hashes != NULL ? _groups_count : 0);
+            _digest_record(group, _digests[group], &record);
+        }
+        memcpy(pageBuffer + offset % FLASH_LIB_PAGE_SIZE, &record, sizeof(MetadataRecord));
+    }
+}
+
+// void write_sector(uint16_t sector, uint32_t logical_sector_offset, const uint8_t *data, uint32_t count) {
+//     uint32_t physical_sector_address;
+//     get_physical_sector_from_logical_id(sector, &physical_sector_address);
+
+//     SectorHeader sectorHeader;
+//     uint8_t headerBuffer[FLASH_LIB_PAGE_SIZE];
+//     read_and_update_header(physical_sector_address, &sectorHeader);
+//     prepare_buffer_to_write(headerBuffer, &sectorHeader, sizeof(SectorHeader));
+//     memcpy(headerBuffer + sizeof(SectorHeader), data, count);
+
+//     uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
+
+//     uint32_t irq_status = save_and_disable_interrupts();
+
+//     flash_range_erase(memory_addr, FLASH_LIB_SECTOR_SIZE);
+//     flash_range_program(memory_addr, headerBuffer, FLASH_LIB_PAGE_SIZE);
+
+//     restore_interrupts(irq_status);
+// }
+
+bool get_first_sector_from_logical_id(uint16_t logical_id, uint32_t *physical_addr) {
+    if (logical_id >= _logical_sectors_count || _logical_map[logical_id] == NO_GROUP) {
+        return false;
+    }
+
+    if (physical_addr != NULL) {
+        *physical_addr = _get_group_first_sector(_logical_map[logical_id]);
+    }
+    return true;
+}
+
+bool get_physical_sector_from_logical_id(uint16_t logical_id, uint8_t physical_sector_id, uint32_t *physical_addr) {
+    uint32_t physical_sector;
+    if (!get_first_sector_from_logical_id(logical_id, &physical_sector)) {
+        return false;
+    }
+
+    if (physical_addr != NULL) {
+        *physical_addr = physical_sector + physical_sector_id;
+    }
+    return true;
+}
+
+void prepare_buffer_to_write(uint8_t *buffer, const void *data, uint8_t data_size) {
+    memset(buffer, 0xFF, FLASH_LIB_PAGE_SIZE);
+    memcpy(buffer, data, data_size);
+}
+
+/**
+ * @brief Retrieves a random free group address.
+ *
+ * This function first generates a random group within the valid range. If the generated group
+ * is not free, the function searches upwards from it until it finds a free group. If no free
+ * group is found going upwards, it then searches downwards.
+ *
+ * @return The first sector of a free group within the range defined by _lower_bound
+ * and _upper_bound, or _upper_bound if every group is in use.
+ */
+uint32_t _get_random_physical_sector() {
+    uint16_t random_group = _random() % _groups_count;
+
+    // Check upwards
+    for (uint16_t group = random_group; group < _groups_count; ++group) {
+        if (_is_group_free(group)) {
+            return _get_group_first_sector(group);
+        }
+    }
+
+    // Check downwards
+    for (uint16_t group = random_group; group > 0;) {
+        --group;
+        if (_is_group_free(group)) {
+            return _get_group_first_sector(group);
+        }
+    }
+
+    // No available sector found
+    return _upper_bound;
+}
+
+/**
+ * @brief Retrieves the first free group at or after the cursor, wrapping around, and moves the
+ * cursor past it. Groups are used in turn, which spreads the wear evenly for rewrite-heavy loads.
+ */
+uint32_t _get_round_robin_group() {
+    for (uint16_t i = 0; i < _groups_count; ++i) {
+        uint16_t group = (_allocation_cursor + i) % _groups_count;
+        if (_is_group_free(group)) {
+            _allocation_cursor = (group + 1) % _groups_count;
+            return _get_group_first_sector(group);
+        }
+    }
+    return _upper_bound;
+}
+
+/**
+ * @brief Retrieves the free group with the lowest wear. The scan starts from a random group so ties
+ * are not always broken in favor of the lowest addresses.
+ */
+uint32_t _get_least_worn_group() {
+    uint16_t start = _random() % _groups_count;
+    uint16_t best_group = NO_GROUP;
+    uint16_t best_wear = 0;
+
+    for (uint16_t i = 0; i < _groups_count; ++i) {
+        uint16_t group = (start + i) % _groups_count;
+        if (!_is_group_free(group)) {
+            continue;
+        }
+
+        uint16_t wear = flash_lib_get_group_wear(group);
+        if (best_group == NO_GROUP || wear < best_wear) {
+            best_group = group;
+            best_wear = wear;
+        }
+    }
+
+    return best_group == NO_GROUP ? _upper_bound : _get_group_first_sector(best_group);
+}
+
+/**
+ * @brief Retrieves a random free group, unless it is worn more than `_wear_hysteresis` erases above
+ * the least worn free group, which is then used instead. Small wear differences are ignored, so the
+ * placement stays spread instead of always hitting the same few groups.
+ */
+uint32_t _get_wear_aware_group() {
+    uint32_t random_group = _get_random_physical_sector();
+    uint32_t least_worn_group = _get_least_worn_group();
+    if (random_group == _upper_bound) {
+        return _upper_bound;
+    }
+
+    uint16_t random_wear = flash_lib_get_group_wear(_get_group_index(random_group));
+    uint16_t least_wear = flash_lib_get_group_wear(_get_group_index(least_worn_group));
+    return random_wear > least_wear + _wear_hysteresis ? least_worn_group : random_group;
+}
+
+/**
+ * @brief Retrieves a free group with the policy selected at init.
+ *
+ * @return The first sector of the group, or _upper_bound if no group is free.
+ */
+uint32_t _allocate_group() {
+    if (_allocator == FLASH_ALLOCATOR_ROUND_ROBIN) {
+        return _get_round_robin_group();
+    } else if (_allocator == FLASH_ALLOCATOR_LEAST_WORN) {
+        return _get_least_worn_group();
+    } else if (_allocator == FLASH_ALLOCATOR_WEAR_AWARE) {
+        return _get_wear_aware_group();
+    } else if (_allocator == FLASH_ALLOCATOR_CUSTOM) {
+        uint16_t group = _custom_allocator(_groups_count, _allocator_context);
+        if (group == NO_GROUP) {
+            return _upper_bound;
+        }
+        assert(group < _groups_count && _is_group_free(group));
+        return _get_group_first_sector(group);
+    }
+    return _get_random_physical_sector();
+}
+
+/**
+ * @brief xorshift32, seeded by init_flash_lib_with_config() so placements can be reproduced.
+ */
+uint32_t _random() {
+    _random_state ^= _random_state << 13;
+    _random_state ^= _random_state >> 17;
+    _random_state ^= _random_state << 5;
+    return _random_state;
+}
+
+/**
+ * @brief Checks if a group can be allocated, for custom allocators.
+ */
+bool flash_lib_is_group_free(uint16_t group) {
+    return group < _groups_count && _is_group_free(group);
+}
 
-uint32_t _lower_bound;
-uint32_t _upper_bound;
-uint16_t _logical_sectors_count;
-uint8_t _group_by;
+/**
+ * @brief Wear of a group: the erase count of its most erased physical sector.
+ */
+uint16_t flash_lib_get_group_wear(uint16_t group) {
+    uint16_t wear = 0;
+    for (uint8_t i = 0; i < _group_by; ++i) {
+        uint16_t erases = _erase_counts[group * _group_by + i];
+        wear = erases > wear ? erases : wear;
+    }
+    return wear;
+}
 
-uint16_t _get_random_physical_sector();
-uint8_t *get_sector_read_pointer(uint32_t physical_sector_address);
-void init_sectors();
-void _write_sector_by_physical_addr(uint32_t physical_sector_address, const uint8_t *data);
-void delete_sectors(uint32_t begin, uint32_t end);
-void delete_sector(uint32_t physical_sector);
-uint32_t get_header_attribute_from_sector(uint32_t physical_sector, uint8_t attribute_id);
-bool get_first_sector_from_logical_id(uint16_t logical_id, uint32_t *physical_addr);
-bool get_physical_sector_from_logical_id(uint16_t logical_id, uint8_t physical_sector_id, uint32_t *physical_addr);
-uint32_t get_memory_addr_from_physical_sector(uint32_t physical_sector);
-void prepare_buffer_to_write(uint8_t *buffer, const void *data, uint8_t data_size);
-void read_and_update_header(uint32_t physical_sector_id, SectorHeader *sectorHeader);
+/**
+ * @brief Digest of the content of a logical sector, 0 for a blank one. Needs `merkle_tree`.
+ */
+uint32_t flash_lib_get_digest(uint16_t logical_sector) {
+    uint32_t digest = 0;
+    flash_lib_get_merkle_node(flash_lib_get_merkle_leaves() + logical_sector, &digest);
+    return digest;
+}
 
 /**
- * @brief Initializes the flash memory library.
- *
- * @param lower_bound The starting sector ID for the library.
- * @param logical_sectors_count The number of logical sectors to be managed.
- * @param group_by Number of physical sectors to group into one logical sector.
+ * @brief Number of leaves of the Merkle tree, the number of logical sectors rounded up to a power
+ * of two, or 0 without `merkle_tree`.
  */
-void init_flash_lib(uint32_t lower_bound, uint16_t logical_sectors_count, uint8_t group_by) {
-    _logical_sectors_count = logical_sectors_count;
-    _lower_bound = lower_bound;
-    _upper_bound = lower_bound + logical_sectors_count * group_by;
-    _group_by = group_by;
+uint32_t flash_lib_get_merkle_leaves() {
+    return _merkle_leaves;
+}
 
-    srand(time_us_32());
+/**
+ * @brief Digest of a node of the Merkle tree. Node FLASH_LIB_MERKLE_ROOT is the root, the children
+ * of node n are 2n and 2n + 1, and logical sector i is the leaf flash_lib_get_merkle_leaves() + i.
+ * Two regions hold the same data where their nodes are equal, so a sync only descends into the
+ * nodes that differ.
+ *
+ * @return false without `merkle_tree` or if the node does not exist.
+ */
+bool flash_lib_get_merkle_node(uint32_t node, uint32_t *digest) {
+    FLASH_LOCK_READ();
+    if (_merkle_nodes == NULL || node < 1 || node >= 2 * _merkle_leaves) {
+        FLASH_UNLOCK_READ();
+        return false;
+    }
 
-    init_sectors();
+    *digest = _merkle_nodes[node];
+    FLASH_UNLOCK_READ();
+    return true;
 }
 
 /**
- * @brief Initializes flash memory sectors during startup.
+ * @brief Tier holding the current version of a logical sector.
  *
- * This function performs the following operations:
+ * @return FLASH_TIER_FRONT if it is in a slot of the front tier, FLASH_TIER_FLASH otherwise.
+ */
+uint8_t flash_lib_get_tier(uint16_t logical_sector) {
+    FLASH_LOCK_READ();
+    bool front = _tier_map != NULL && logical_sector < _logical_sectors_count && _tier_map[logical_sector] != TIER_NO_SLOT;
+    FLASH_UNLOCK_READ();
+    return front ? FLASH_TIER_FRONT : FLASH_TIER_FLASH;
+}
+
+/**
+ * @brief Demotes logical sectors from the front tier to the flash, the least recently written
+ * first. Meant for idle time before a power down with a volatile tier, or before a sync, as the
+ * digests and content hashes describe the flash.
  *
- * 1. **Validation Sweep**: Scans through all logical sector headers to validate their
- *    integrity by checking the sector signature and ID range. It also counts how many
- *    sectors require initialization.
+ * @param max_sectors Maximum number of logical sectors to demote in this call.
+ * @return Number of slots still used.
+ */
+uint16_t flash_lib_tier_flush(uint16_t max_sectors) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+
+    _tier_demote_oldest(max_sectors);
+
+    uint16_t used = _tier_slots_used();
+    FLASH_TRACE_END(FLASH_OP_TIER_FLUSH, used > 0xFF ? 0xFF : used, 0xFFFF, 0, max_sectors);
+    FLASH_UNLOCK_WRITE();
+    return used;
+}
+
+/**
+ * @brief Sets the priority of a logical sector for flash_lib_flush_for_power_loss(), higher first.
+ * All logical sectors start at 0.
+ */
+void flash_lib_set_tier_priority(uint16_t logical_sector, uint8_t priority) {
+    assert(logical_sector < _logical_sectors_count);
+    FLASH_LOCK_WRITE();
+    if (_tier_priorities != NULL) {
+        _tier_priorities[logical_sector] = priority;
+    }
+    FLASH_UNLOCK_WRITE();
+}
+
+/**
+ * @brief Writes back as many slots of the front tier as fit in `budget_us`, meant for the hold-up
+ * time after a brownout is detected. Slots go by decreasing priority, then the least recently
+ * written first, and a slot whose estimated demotion does not fit in what is left of the budget is
+ * skipped for a cheaper one. Appends are programmed in place, without erases.
  *
- * 2. **Initialization**: For sectors that need initialization:
- *    - Finds uninitialized logical IDs by checking the range from 0 to the maximum.
- *    - Configure headers for these uninitialized IDs.
+ * The estimates come from the costs of the FlashGeometry. It must not interrupt another call of
+ * the library, e.g. it should run from the main loop on a flag set by the brownout interrupt.
  *
- * Note: The process of identifying uninitialized IDs has O(n^2) complexity, where n is
- * the number of logical sectors.
+ * @param budget_us Time left before the supply drops below the flash operating voltage.
+ * @return Number of slots still used, lost if the power goes away with a volatile tier.
  */
-void init_sectors() {
-    uint16_t unitialized_sectors_count = 0;
-    for (uint32_t physical_sector = _lower_bound; physical_sector < _upper_bound; physical_sector += _group_by) {
-        if (get_header_attribute_from_sector(physical_sector, 0) != MEMORY_SIGNATURE) {
-            unitialized_sectors_count++;
-            continue;
-        }
+uint16_t flash_lib_flush_for_power_loss(uint32_t budget_us) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+
+    uint32_t start = time_us_32();
+    uint16_t demoted = 0;
+    // Slots already considered: every pass takes the best slot below the previous one
+    uint64_t previous_key = UINT64_MAX;
+    for (;;) {
+        uint16_t best = TIER_NO_SLOT;
+        uint64_t best_key = 0;
+        for (uint16_t slot = 0; slot < _tier_slots_count; ++slot) {
+            if (_tier_slots[slot] == FREE_LOGICAL_ID) {
+                continue;
+            }
 
-        // Invalidates the sector signature, making it available to be reinitialized
-        if (get_header_attribute_from_sector(physical_sector, 1) >= _logical_sectors_count) {
-            delete_sector(physical_sector);
-            unitialized_sectors_count++;
+            uint64_t key = (uint64_t)_tier_priorities[_tier_slots[slot]] << 48 |
+                           (uint64_t)(0xFFFFFFFF - _tier_ages[slot]) << 16 | slot;
+            if (key < previous_key && (best == TIER_NO_SLOT || key > best_key)) {
+                best = slot;
+                best_key = key;
+            }
         }
-    }
 
-    if (unitialized_sectors_count == 0) {
-        return;
-    }
+        if (best == TIER_NO_SLOT) {
+            break;
+        }
+        previous_key = best_key;
 
-    // Checks every logical ID to know which ones needs initialization
-    for (uint32_t logical_id = 0; logical_id < _logical_sectors_count; logical_id++) {
-        bool found_sector = get_first_sector_from_logical_id(logical_id, NULL);
+        uint32_t elapsed = time_us_32() - start;
+        if (elapsed >= budget_us) {
+            break;
+        }
 
-        if (found_sector) {
-            continue;
+        if (_tier_demote_cost_us(best) <= budget_us - elapsed) {
+            _tier_demote(best);
+            demoted++;
         }
+    }
 
-        // Allocates new physical sector for the logical id
-        SectorHeader sectorHeader = {
-            .signature = MEMORY_SIGNATURE,
-            .logicalID = logical_id,
-            .writeCount = 1,
-        };
-        uint8_t headerBuffer[FLASH_PAGE_SIZE];
-        prepare_buffer_to_write(headerBuffer, &sectorHeader, sizeof(SectorHeader));
-        _write_sector_by_physical_addr(_get_random_physical_sector(), headerBuffer);
+    uint16_t used = _tier_slots_used();
+    FLASH_TRACE_END(FLASH_OP_POWER_LOSS_FLUSH, used > 0xFF ? 0xFF : used, 0xFFFF, demoted, budget_us);
+    FLASH_UNLOCK_WRITE();
+    return used;
+}
 
-        // Finished initializing all sectors
-        unitialized_sectors_count--;
-        if (unitialized_sectors_count == 0) {
-            break;
+/**
+ * @brief State of the wear budget governor, see FlashWearBudget. Everything is 0 without a budget.
+ */
+void flash_lib_get_wear_state(FlashWearState *state) {
+    FLASH_LOCK_READ();
+    memset(state, 0, sizeof(FlashWearState));
+    if (_wear_budget_set) {
+        uint64_t now = time_us_64();
+        state->level = _wear_level();
+        FlashWearRegion *regions[WEAR_REGIONS_COUNT] = {&state->payload, &state->metadata};
+        for (uint8_t region = 0; region < WEAR_REGIONS_COUNT; ++region) {
+            regions[region]->sectors_count = _wear_sectors_count[region];
+            regions[region]->erases = _wear_erases[region];
+            regions[region]->allowed_per_day = US_PER_DAY / _wear_us_per_erase[region];
+            regions[region]->balance = -_wear_debt_at(region, now) / (int64_t)_wear_us_per_erase[region];
+        }
+        for (uint32_t sector = 0; sector < _upper_bound - _lower_bound; ++sector) {
+            if (_erase_counts[sector] > state->max_wear) {
+                state->max_wear = _erase_counts[sector];
+            }
         }
+        state->held_writes = _wear_held_total;
+        state->refused_writes = _wear_refused_total;
     }
+    FLASH_UNLOCK_READ();
 }
 
-uint8_t *read_sector(uint16_t logical_sector, uint32_t offset_bytes) {
-    uint32_t physical_sector_address;
-    uint32_t physical_sector_id = offset_bytes / FLASH_SECTOR_SIZE;
-    uint32_t physical_sector_offset = offset_bytes % FLASH_SECTOR_SIZE;
-    get_physical_sector_from_logical_id(logical_sector, physical_sector_id, &physical_sector_address);
-    return (uint8_t *)(get_memory_addr_from_physical_sector(physical_sector_address + physical_sector_offset) + XIP_BASE);
+/**
+ * @brief Whether writes land in the front tier. With a wear budget, the tier only takes the writes
+ * while the erase rate is over budget, so they coalesce in RAM, and writes go through to the flash
+ * otherwise.
+ */
+bool _tier_takes_writes() {
+    return _tier_slots_count > 0 && (!_wear_budget_set || _wear_level() != FLASH_WEAR_OK);
 }
 
-void erase_logical_sector(uint16_t logical_sector) {
-    assert(logical_sector < _logical_sectors_count);
+/**
+ * @brief Spreads the rated cycles of every region evenly over the target lifetime. The budget
+ * starts without debt nor credit, until the mount replays the debts recorded before the reset.
+ */
+void _wear_configure(const FlashWearBudget *budget) {
+    _wear_budget_set = budget != NULL;
+    _wear_held_total = 0;
+    _wear_refused_total = 0;
+    _wear_unsaved_erases = 0;
+    if (budget == NULL) {
+        return;
+    }
 
-    uint32_t irq_status = save_and_disable_interrupts();
+    assert(budget->lifetime_days > 0 && budget->rated_cycles > 0);
+    _wear_sectors_count[WEAR_PAYLOAD] = (_upper_bound - _lower_bound);
+    _wear_sectors_count[WEAR_METADATA] = _metadata_sectors_count;
+    for (uint8_t region = 0; region < WEAR_REGIONS_COUNT; ++region) {
+        uint64_t allowed_erases = (uint64_t)budget->rated_cycles * _wear_sectors_count[region];
+        _wear_us_per_erase[region] = budget->lifetime_days * US_PER_DAY / allowed_erases;
+        if (_wear_us_per_erase[region] == 0) {
+            _wear_us_per_erase[region] = 1;
+        }
+        _wear_debt_us[region] = 0;
+        _wear_erases[region] = 0;
+    }
+    _wear_burst_us = (budget->burst_hours > 0 ? budget->burst_hours : FLASH_LIB_WEAR_BURST_HOURS) * US_PER_HOUR;
+    _wear_last_us = time_us_64();
+}
 
-    SectorHeader *sectorHeaders = (SectorHeader *)malloc(_group_by * sizeof(SectorHeader));
+/**
+ * @brief Debt of a region at time `now`, paid with the time elapsed since the previous update. The
+ * credit of a region idle for a long time is capped to `burst_hours` of its budget.
+ */
+int64_t _wear_debt_at(uint8_t region, uint64_t now) {
+    int64_t debt = _wear_debt_us[region] - (int64_t)(now - _wear_last_us);
+    return debt < -_wear_burst_us ? -_wear_burst_us : debt;
+}
 
-    for (uint8_t i = 0; i < _group_by; ++i) {
-        uint32_t physical_sector_address;
-        get_physical_sector_from_logical_id(logical_sector, i, &physical_sector_address);
-        read_and_update_header(physical_sector_address, &sectorHeaders[i]);
+/**
+ * @brief Pays the debt of every region with the time elapsed since the previous update.
+ */
+void _wear_update() {
+    uint64_t now = time_us_64();
+    for (uint8_t region = 0; region < WEAR_REGIONS_COUNT; ++region) {
+        _wear_debt_us[region] = _wear_debt_at(region, now);
     }
+    _wear_last_us = now;
+}
 
-    uint32_t physical_sector_address;
-    get_first_sector_from_logical_id(logical_sector, &physical_sector_address);
-    uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
-    flash_range_erase(memory_addr, FLASH_SECTOR_SIZE * _group_by);
+/**
+ * @brief Charges an erase to the budget of its region, called for every erase of the library.
+ */
+void _wear_record_erase(uint32_t memory_addr, uint32_t count) {
+    if (!_wear_budget_set) {
+        return;
+    }
 
-    for (uint8_t i = 0; i < _group_by; ++i) {
-        uint8_t headerBuffer[FLASH_PAGE_SIZE];
-        prepare_buffer_to_write(headerBuffer, &sectorHeaders[i], sizeof(SectorHeader));
+    _wear_update();
+    uint8_t region = memory_addr < get_memory_addr_from_physical_sector(_lower_bound) ? WEAR_METADATA : WEAR_PAYLOAD;
+    uint32_t sectors = count / FLASH_LIB_SECTOR_SIZE;
+    _wear_debt_us[region] += (int64_t)(sectors * _wear_us_per_erase[region]);
+    _wear_erases[region] += sectors;
+    _wear_unsaved_erases += sectors;
+}
 
-        get_physical_sector_from_logical_id(logical_sector, i, &physical_sector_address);
-        memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
-        flash_range_program(memory_addr, headerBuffer, FLASH_PAGE_SIZE);
+/**
+ * @brief Level of the governor, set by the region the most over its budget. Leaves the state
+ * untouched, so it can run under the read lock.
+ */
+uint8_t _wear_level() {
+    uint64_t now = time_us_64();
+    int64_t payload = _wear_debt_at(WEAR_PAYLOAD, now);
+    int64_t metadata = _wear_debt_at(WEAR_METADATA, now);
+    int64_t debt = payload > metadata ? payload : metadata;
+    if (debt > _wear_burst_us) {
+        return FLASH_WEAR_HOLD;
     }
+    return debt > 0 ? FLASH_WEAR_DEFER : FLASH_WEAR_OK;
+}
 
-    free(sectorHeaders);
-    restore_interrupts(irq_status);
+/**
+ * @brief Appends the debt of every region to the metadata log, so a reset does not clear it.
+ */
+void _wear_checkpoint() {
+    // Cleared first, the records may trigger a compaction whose erases start the next checkpoint
+    _wear_unsaved_erases = 0;
+    for (uint8_t region = 0; region < WEAR_REGIONS_COUNT; ++region) {
+        MetadataRecord record;
+        _wear_record(region, &record);
+        _metadata_append(&record);
+    }
 }
 
-void erase_physical_sector(uint16_t logical_sector, uint8_t physical_sector_id) {
-    assert(logical_sector < _logical_sectors_count);
-    assert(physical_sector_id < _group_by);
+void _wear_record(uint8_t region, MetadataRecord *record) {
+    // Rounded up, the debt restored by the mount is never lower than the one recorded
+    int64_t debt_us = _wear_debt_at(region, time_us_64());
+    int64_t debt_s = debt_us > 0 ? (debt_us + US_PER_SECOND - 1) / US_PER_SECOND : debt_us / US_PER_SECOND;
+    int32_t debt = debt_s > INT32_MAX ? INT32_MAX : (debt_s < INT32_MIN ? INT32_MIN : (int32_t)debt_s);
+    *record = (MetadataRecord){
+        .type = RECORD_WEAR,
+        .flags = 0xFF,
+        .index = region,
+        .logical_id = (uint32_t)debt & 0xFFFF,
+        .transaction = (uint32_t)debt >> 16,
+    };
+}
 
-    uint32_t irq_status = save_and_disable_interrupts();
+/**
+ * @brief Checks the next `max_sectors` groups of the region, so bit errors and inconsistent states
+ * are found while the data is not needed yet, without a full scan at boot. Meant to be called when
+ * the application is idle, each group costs a read of its payload.
+ *
+ * - The state of every group must agree with the mapping: a live group that is not the group of its
+ *   logical sector (an orphan or a duplicate), or a group staged by a transaction that is no longer
+ *   active, is released.
+ * - A free group must be blank, as it is claimed without an erase. Otherwise it is erased again,
+ *   and retired if it does not come out blank.
+ * - With `merkle_tree`, the payload of a live group must match its digest, and a slot of the front
+ *   tier its checksum. A live group that fails holds a lost logical sector: it is left in place, as
+ *   a copy would carry the errors under a fresh digest, and reported as FLASH_LOSS_CORRUPT until
+ *   the logical sector is written again. A tier slot that fails is dropped, the flash keeps the
+ *   previous version, and it is reported as FLASH_LOSS_REVERTED.
+ * - After the last group, the unused part of the metadata log must be blank, otherwise the next
+ *   records would be programmed over stray bits. The log is then compacted into the other half.
+ *
+ * The cursor is persisted in the metadata log every FLASH_LIB_SCRUB_CHECKPOINT groups and by the
+ * compactions, so the coverage continues across reboots.
+ *
+ * @param max_sectors Maximum number of groups to check in this call.
+ * @return Number of problems found by this call, see flash_lib_get_scrub_stats().
+ */
+uint16_t flash_lib_scrub(uint16_t max_sectors) {
+    assert(_step.operation == FLASH_STEP_NONE);
+    FLASH_LOCK_WRITE();
+    FLASH_TRACE_BEGIN();
+
+    uint32_t problems = _scrub_problems();
+    for (uint16_t i = 0; i < max_sectors; ++i) {
+        if (_scrub_cursor >= _groups_count) {
+            _scrub_metadata();
+            _scrub_cursor = 0;
+            _scrub_passes++;
+        } else {
+            _scrub_group(_scrub_cursor++);
+        }
 
-    uint32_t physical_sector_address;
-    get_physical_sector_from_logical_id(logical_sector, physical_sector_id, &physical_sector_address);
-    uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
-    flash_range_erase(memory_addr, FLASH_SECTOR_SIZE);
+        if (_scrub_cursor % FLASH_LIB_SCRUB_CHECKPOINT == 0) {
+            MetadataRecord record;
+            _scrub_record(&record);
+            _metadata_append(&record);
+        }
+    }
+    problems = _scrub_problems() - problems;
 
-    SectorHeader sectorHeader;
-    uint8_t headerBuffer[FLASH_PAGE_SIZE];
-    read_and_update_header(physical_sector_address, &sectorHeader);
-    prepare_buffer_to_write(headerBuffer, &sectorHeader, sizeof(SectorHeader));
-    flash_range_program(memory_addr, headerBuffer, FLASH_PAGE_SIZE);
+    FLASH_TRACE_END(FLASH_OP_SCRUB, problems > 0xFF ? 0xFF : problems, 0xFFFF, _scrub_cursor, max_sectors);
+    FLASH_UNLOCK_WRITE();
+    return problems > 0xFFFF ? 0xFFFF : problems;
+}
 
-    restore_interrupts(irq_status);
+void flash_lib_get_scrub_stats(FlashScrubStats *stats) {
+    FLASH_LOCK_READ();
+    stats->cursor = _scrub_cursor;
+    stats->groups_count = _groups_count;
+    stats->passes = _scrub_passes;
+    stats->checked = _scrub_checked_total;
+    stats->state_errors = _scrub_state_errors;
+    stats->payload_errors = _scrub_payload_errors;
+    stats->blank_errors = _scrub_blank_errors;
+    stats->repairs = _scrub_repairs;
+    stats->lost_sectors = _scrub_lost_total;
+    stats->reverted_slots = _scrub_reverted_total;
+    stats->retired_groups = 0;
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        stats->retired_groups += (_groups[group].flags & GROUP_FLAG_RETIRED) != 0;
+    }
+    FLASH_UNLOCK_READ();
 }
 
-// void write_sector(uint16_t sector, uint32_t logical_sector_offset, const uint8_t *data, uint32_t count) {
-//     uint32_t physical_sector_address;
-//     get_physical_sector_from_logical_id(sector, &physical_sector_address);
+uint32_t _scrub_problems() {
+    return _scrub_state_errors + _scrub_payload_errors + _scrub_blank_errors;
+}
 
-//     SectorHeader sectorHeader;
-//     uint8_t headerBuffer[FLASH_PAGE_SIZE];
-//     read_and_update_header(physical_sector_address, &sectorHeader);
-//     prepare_buffer_to_write(headerBuffer, &sectorHeader, sizeof(SectorHeader));
-//     memcpy(headerBuffer + sizeof(SectorHeader), data, count);
+/**
+ * @brief Checks one group, see flash_lib_scrub().
+ */
+void _scrub_group(uint16_t group) {
+    GroupState *state = &_groups[group];
+    uint32_t first_physical_sector = _get_group_first_sector(group);
+    _scrub_checked_total++;
 
-//     uint32_t memory_addr = get_memory_addr_from_physical_sector(physical_sector_address);
+    // Released groups are erased before they are used again
+    if (state->flags & (GROUP_FLAG_RELEASED | GROUP_FLAG_RETIRED)) {
+        return;
+    }
 
-//     uint32_t irq_status = save_and_disable_interrupts();
+    if (_is_group_free(group)) {
+        if (_is_group_blank(first_physical_sector)) {
+            return;
+        }
+
+        // The slots may be marked clean, the erase must not skip them
+        _scrub_blank_errors++;
+        for (uint8_t i = 0; i < _group_by; ++i) {
+            _mark_slot_dirty(first_physical_sector + i);
+        }
+        _erase_dirty_slots(first_physical_sector);
+        if (_is_group_blank(first_physical_sector)) {
+            _scrub_repairs++;
+        } else {
+            _scrub_retire(group);
+        }
+        return;
+    }
 
-//     flash_range_erase(memory_addr, FLASH_SECTOR_SIZE);
-//     flash_range_program(memory_addr, headerBuffer, FLASH_PAGE_SIZE);
+    if (state->flags & GROUP_FLAG_STAGED) {
+        // The replay of the log would release it too, as its transaction has no commit record
+        if (!_transaction_active || state->transaction != (uint16_t)(_next_transaction - 1)) {
+            _scrub_state_errors++;
+            _release_group(first_physical_sector);
+            _scrub_repairs++;
+        }
+        return;
+    }
 
-//     restore_interrupts(irq_status);
-// }
+    if (state->logical_id >= _logical_sectors_count || _logical_map[state->logical_id] != group) {
+        _scrub_state_errors++;
+        _release_group(first_physical_sector);
+        _scrub_repairs++;
+        return;
+    }
 
-uint32_t get_header_attribute_from_sector(uint32_t physical_sector, uint8_t attribute_id) {
-    uint8_t *read_pointer = get_sector_read_pointer(physical_sector);
-    uint32_t attribute = 0;
-    if (attribute_id == 0) {
-        memcpy(&attribute, read_pointer, SIGNATURE_SIZE_BYTES);
-    } else if (attribute_id == 1) {
-        memcpy(&attribute, read_pointer + SIGNATURE_SIZE_BYTES, sizeof(uint16_t));
-    } else if (attribute_id == 2) {
-        memcpy(&attribute, read_pointer + SIGNATURE_SIZE_BYTES + sizeof(uint16_t), sizeof(uint16_t));
-    } else {
-        memcpy(&attribute, read_pointer + SIGNATURE_SIZE_BYTES + 2 * sizeof(uint16_t), sizeof(uint8_t));
+    uint16_t slot = _tier_map != NULL ? _tier_map[state->logical_id] : TIER_NO_SLOT;
+    if (slot != TIER_NO_SLOT && _tier_entries()[slot].checksum != _tier_checksum(slot)) {
+        _scrub_payload_errors++;
+        _scrub_reverted_total++;
+        _tier_discard(state->logical_id);
+        _report_loss(state->logical_id, FLASH_LOSS_REVERTED);
+        _scrub_repairs++;
     }
-    return attribute;
-}
 
-bool check_sector_signature(uint32_t physical_sector) {
-    return get_header_attribute_from_sector(physical_sector, SIGNATURE_POSITION) == MEMORY_SIGNATURE;
-}
+    // A tombstoned group is erased before it is read again
+    if (_digests == NULL || _digests[group] == DIGEST_UNKNOWN || (state->flags & GROUP_FLAG_TOMBSTONE)) {
+        return;
+    }
 
-bool get_first_sector_from_logical_id(uint16_t logical_id, uint32_t *physical_addr) {
-    for (uint32_t physical_sector = _lower_bound; physical_sector < _upper_bound; physical_sector += _group_by) {
-        if (!check_sector_signature(physical_sector)) {
-            continue;
+    uint32_t digest = -_digest_delta(get_sector_read_pointer(first_physical_sector), 0, NULL, get_logical_sector_size());
+    if (digest != _digests[group]) {
+        _scrub_payload_errors++;
+        _scrub_lost_total++;
+        // The errors may sit in slots marked clean, the next write of the logical sector must erase them
+        for (uint8_t i = 0; i < _group_by; ++i) {
+            _mark_slot_dirty(first_physical_sector + i);
         }
+        _report_loss(state->logical_id, FLASH_LOSS_CORRUPT);
+    }
+}
 
-        if (get_header_attribute_from_sector(physical_sector, LOGICAL_ID_POSITION) == logical_id) {
-            if (physical_addr != NULL) {
-                *physical_addr = physical_sector;
-            }
-            return true;
+/**
+ * @brief Checks that the metadata log is blank after its last record, see flash_lib_scrub().
+ */
+void _scrub_metadata() {
+    const uint32_t *words = (const uint32_t *)(_get_metadata_addr(_metadata_half, 0) + XIP_BASE);
+    for (uint32_t i = _metadata_head / sizeof(uint32_t); i < _get_metadata_half_size() / sizeof(uint32_t); ++i) {
+        if (words[i] != 0xFFFFFFFF) {
+            _scrub_blank_errors++;
+            _metadata_compact();
+            _scrub_repairs++;
+            return;
         }
     }
+}
 
-    return false;
+void _report_loss(uint16_t logical_sector, uint8_t loss) {
+    if (_loss_callback != NULL) {
+        _loss_callback(logical_sector, loss, _loss_context);
+    }
 }
 
-bool get_physical_sector_from_logical_id(uint16_t logical_id, uint8_t physical_sector_id, uint32_t *physical_addr) {
-    uint32_t physical_sector;
-    bool found = get_first_sector_from_logical_id(logical_id, &physical_sector);
+void _scrub_retire(uint16_t group) {
+    _set_group_state(group, FREE_LOGICAL_ID, GROUP_FLAG_RETIRED, 0xFFFF);
+}
 
+bool _is_group_blank(uint32_t first_physical_sector) {
     for (uint8_t i = 0; i < _group_by; ++i) {
-        if (get_header_attribute_from_sector(physical_sector, PHYSICAL_ID_POSITION) == physical_sector_id) {
-            break;
+        if (!_is_payload_blank(first_physical_sector + i)) {
+            return false;
         }
-
-        physical_sector += FLASH_SECTOR_SIZE;
     }
+    return true;
+}
 
-    if (physical_addr != NULL) {
-        *physical_addr = physical_sector;
+void _scrub_record(MetadataRecord *record) {
+    *record = (MetadataRecord){
+        .type = RECORD_SCRUB,
+        .flags = 0xFF,
+        .index = _scrub_cursor,
+        .logical_id = _scrub_passes & 0xFFFF,
+        .transaction = _scrub_passes >> 16,
+    };
+}
+
+uint32_t get_memory_addr_from_physical_sector(uint32_t physical_sector) {
+    return physical_sector * FLASH_LIB_SECTOR_SIZE;
+}
+
+uint8_t *get_sector_read_pointer(uint32_t physical_sector) {
+    return (uint8_t *)(get_memory_addr_from_physical_sector(physical_sector) + XIP_BASE);
+}
+
+#ifdef FLASH_LIB_FREERTOS
+// Arguments of the flash operations run by flash_safe_execute(), which takes a single pointer
+typedef struct FlashOperation {
+    uint32_t memory_addr;
+    uint32_t count;
+    const uint8_t *data;
+} FlashOperation;
+
+void _flash_erase_callback(void *param) {
+    FlashOperation *operation = (FlashOperation *)param;
+    if (_geometry.erase != NULL) {
+        _geometry.erase(operation->memory_addr, operation->count);
+    } else {
+        flash_range_erase(operation->memory_addr, operation->count);
     }
-    return found;
 }
 
-void prepare_buffer_to_write(uint8_t *buffer, const void *data, uint8_t data_size) {
-    memset(buffer, 0xFF, FLASH_PAGE_SIZE);
-    memcpy(buffer, data, data_size);
+void _flash_program_callback(void *param) {
+    FlashOperation *operation = (FlashOperation *)param;
+    if (_geometry.program != NULL) {
+        _geometry.program(operation->memory_addr, operation->data, operation->count);
+    } else {
+        flash_range_program(operation->memory_addr, operation->data, operation->count);
+    }
 }
+#endif
 
 /**
- * @brief Retrieves a random uninitialized sector address.
- *
- * This function first generates a random sector address within the valid range. If the
- * generated sector is already initialized, the function searches upwards from that address
- * until it finds an uninitialized sector. If no uninitialized sector is found going upwards,
- * it then searches downwards.
- *
- * @return An uninitialized sector address within the range defined by _lower_bound and _upper_bound.
+ * @brief Erases `count` bytes of flash, every erase of the library goes through here. The range is
+ * split into the largest aligned erase units of the geometry that are worth using, and interrupts
+ * are served between the units.
  */
-uint16_t _get_random_physical_sector() {
-    uint16_t random_physical_sector = (rand() % (_upper_bound - _lower_bound)) + _lower_bound;
-
-    // Check upwards
-    for (uint16_t physical_sector = random_physical_sector; physical_sector < _upper_bound; ++physical_sector) {
-        if (!check_sector_signature(physical_sector)) {
-            return physical_sector;
+void _flash_erase(uint32_t memory_addr, uint32_t count) {
+    assert(memory_addr % FLASH_LIB_SECTOR_SIZE == 0 && count % FLASH_LIB_SECTOR_SIZE == 0);
+    _wear_record_erase(memory_addr, count);
+    // Lookups must not touch XIP while it is disabled
+    _map_update_begin();
+
+    while (count > 0) {
+        uint8_t unit = _geometry.erase_units_count - 1;
+        uint32_t size = _geometry.erase_units[unit].size;
+        while (unit > 0 && (!_erase_unit_used[unit] || memory_addr % size != 0 || size > count)) {
+            size = _geometry.erase_units[--unit].size;
         }
+
+        _flash_erase_unit(memory_addr, size);
+        memory_addr += size;
+        count -= size;
     }
+    _map_update_end();
+}
 
-    // Check downwards
-    for (uint16_t physical_sector = random_physical_sector - 1; physical_sector >= _lower_bound; --physical_sector) {
-        if (!check_sector_signature(physical_sector)) {
-            return physical_sector;
-        }
+/**
+ * @brief Erases one erase unit with interrupts disabled.
+ */
+void _flash_erase_unit(uint32_t memory_addr, uint32_t count) {
+    FLASH_TRACE_BEGIN();
+#ifdef FLASH_LIB_FREERTOS
+    // Also parks the other core, which could be running from XIP
+    FlashOperation operation = {memory_addr, count, NULL};
+    int result = flash_safe_execute(_flash_erase_callback, &operation, UINT32_MAX);
+    assert(result == PICO_OK);
+#else
+    uint32_t irq_status = save_and_disable_interrupts();
+    if (_geometry.erase != NULL) {
+        _geometry.erase(memory_addr, count);
+    } else {
+        flash_range_erase(memory_addr, count);
     }
+    restore_interrupts(irq_status);
+#endif
 
-    // No available sector found
+    FLASH_TRACE_END(FLASH_OP_FLASH_ERASE, 0, 0xFFFF, memory_addr, count);
 }
 
-uint32_t get_memory_addr_from_physical_sector(uint32_t physical_sector) {
-    return physical_sector * FLASH_SECTOR_SIZE;
+/**
+ * @brief Programs `count` bytes of flash with interrupts disabled, every program of the library
+ * goes through here. The range must be aligned on the program granularity and fit a burst.
+ */
+void _flash_program(uint32_t memory_addr, const uint8_t *data, uint32_t count) {
+    assert(memory_addr % _geometry.program_granularity == 0 && count % _geometry.program_granularity == 0);
+    assert(count > 0 && count <= _geometry.program_burst);
+    FLASH_TRACE_BEGIN();
+    _map_update_begin();
+
+#ifdef FLASH_LIB_FREERTOS
+    FlashOperation operation = {memory_addr, count, data};
+    int result = flash_safe_execute(_flash_program_callback, &operation, UINT32_MAX);
+    assert(result == PICO_OK);
+#else
+    uint32_t irq_status = save_and_disable_interrupts();
+    if (_geometry.program != NULL) {
+        _geometry.program(memory_addr, data, count);
+    } else {
+        flash_range_program(memory_addr, data, count);
+    }
+    restore_interrupts(irq_status);
+#endif
+    _map_update_end();
+
+    FLASH_TRACE_END(FLASH_OP_FLASH_PROGRAM, 0, 0xFFFF, memory_addr, count);
 }
 
-uint8_t *get_sector_read_pointer(uint32_t physical_sector) {
-    return (uint8_t *)(get_memory_addr_from_physical_sector(physical_sector) + XIP_BASE);
+/**
+ * @brief Programs `count` bytes within one page, padded with 0xFF to the program granularity so
+ * the other bytes of the page are left untouched.
+ */
+void _program_padded(uint32_t memory_addr, const uint8_t *data, uint32_t count) {
+    uint32_t granularity = _geometry.program_granularity;
+    uint32_t begin = memory_addr & ~(granularity - 1);
+    uint32_t end = (memory_addr + count + granularity - 1) & ~(granularity - 1);
+    assert(begin / FLASH_LIB_PAGE_SIZE == (end - 1) / FLASH_LIB_PAGE_SIZE);
+
+    uint8_t pageBuffer[FLASH_LIB_PAGE_SIZE];
+    memset(pageBuffer, 0xFF, end - begin);
+    memcpy(pageBuffer + (memory_addr - begin), data, count);
+    _flash_program(begin, pageBuffer, end - begin);
 }
 
-void _write_sector_by_physical_addr(uint32_t physical_sector_address, const uint8_t *data) {
-    physical_sector_address = get_memory_addr_from_physical_sector(physical_sector_address);
+bool _is_slot_dirty(uint32_t physical_sector) {
+    uint32_t slot = physical_sector - _lower_bound;
+    return _dirty_slots[slot / 8] & (1 << (slot % 8));
+}
 
-    uint32_t irq_status = save_and_disable_interrupts();
+void _mark_slot_dirty(uint32_t physical_sector) {
+    uint32_t slot = physical_sector - _lower_bound;
+    _dirty_slots[slot / 8] |= 1 << (slot % 8);
+}
 
-    flash_range_erase(physical_sector_address, FLASH_SECTOR_SIZE);
-    flash_range_program(physical_sector_address, data, FLASH_PAGE_SIZE);
+void _mark_slot_clean(uint32_t physical_sector) {
+    uint32_t slot = physical_sector - _lower_bound;
+    _dirty_slots[slot / 8] &= ~(1 << (slot % 8));
+}
 
-    restore_interrupts(irq_status);
+/**
+ * @brief Checks if a physical sector is erased.
+ *
+ * Reads word by word through XIP and stops at the first programmed word, so a dirty sector is
+ * usually detected within its first page.
+ */
+bool _is_payload_blank(uint32_t physical_sector) {
+    const uint32_t *read_pointer = (const uint32_t *)get_sector_read_pointer(physical_sector);
+    for (uint32_t i = 0; i < FLASH_LIB_SECTOR_SIZE / sizeof(uint32_t); ++i) {
+        if (read_pointer[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool _is_tombstoned(uint16_t logical_id) {
+    if (logical_id >= _logical_sectors_count || _logical_map[logical_id] == NO_GROUP) {
+        return false;
+    }
+    return _groups[_logical_map[logical_id]].flags & GROUP_FLAG_TOMBSTONE;
+}
+
+/**
+ * @brief Checks if a group holds the current data of its logical ID: assigned, not released and
+ * not staged by a transaction that is still uncommitted.
+ */
+bool _is_group_live(uint16_t group) {
+    GroupState *state = &_groups[group];
+    if (state->logical_id == FREE_LOGICAL_ID) {
+        return false;
+    }
+    return !(state->flags & (GROUP_FLAG_RELEASED | GROUP_FLAG_STAGED | GROUP_FLAG_UNKNOWN));
+}
+
+bool _is_group_free(uint16_t group) {
+    return _groups[group].logical_id == FREE_LOGICAL_ID && _groups[group].flags == 0;
 }
 
-void read_and_update_header(uint32_t physical_sector_id, SectorHeader *sectorHeader) {
-    uint8_t *read_pointer = get_sector_read_pointer(physical_sector_id);
-    memcpy(sectorHeader, read_pointer, sizeof(SectorHeader));
-    sectorHeader->writeCount++;
+uint16_t _get_group_index(uint32_t first_physical_sector) {
+    return (first_physical_sector - _lower_bound) / _group_by;
+}
+
+uint32_t _get_group_first_sector(uint16_t group) {
+    return _lower_bound + group * _group_by;
 }
 
 // **************** DEBUG FUNCTIONS ****************
@@ -325,23 +3925,49 @@ void print_buffer(uint8_t *buffer, size_t size) {
 }
 
 void delete_sectors(uint32_t begin, uint32_t end) {
-    uint8_t cleanHeaderBuffer[FLASH_PAGE_SIZE];
-    memset(cleanHeaderBuffer, 0x00, sizeof(SectorHeader));
-    memset(cleanHeaderBuffer + sizeof(SectorHeader), 0xFF, FLASH_PAGE_SIZE - sizeof(SectorHeader));
-
-    uint8_t *read = get_sector_read_pointer(_lower_bound);
-
-    uint32_t irq_status = save_and_disable_interrupts();
-
-    for (uint32_t physical_sector = begin; physical_sector < end; ++physical_sector) {
-        flash_range_program(get_memory_addr_from_physical_sector(physical_sector), cleanHeaderBuffer, FLASH_PAGE_SIZE);
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        uint32_t physical_sector = _get_group_first_sector(group);
+        if (physical_sector + _group_by > begin && physical_sector < end && !(_groups[group].flags & GROUP_FLAG_RELEASED)) {
+            _release_group(physical_sector);
+        }
     }
-
-    restore_interrupts(irq_status);
 }
 
+/**
+ * @brief Wipes the region: erases the metadata and mounts it again, which formats every group
+ * holding data and drops the front tier. The erase counts are lost with the metadata.
+ */
 void delete_all_sectors() {
-    delete_sectors(_lower_bound, _upper_bound);
+    assert(_step.operation == FLASH_STEP_NONE && !_transaction_active);
+    FLASH_LOCK_WRITE();
+    _map_update_begin();
+    _flash_erase(get_memory_addr_from_physical_sector(_metadata_lower_bound), _metadata_sectors_count * FLASH_LIB_SECTOR_SIZE);
+
+    // Back to the RAM state _configure() leaves before the mount
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        _groups[group] = (GroupState){FREE_LOGICAL_ID, 0xFFFF, GROUP_FLAG_UNKNOWN};
+    }
+    if (_content_hashes != NULL) {
+        memset(_content_hashes, 0, _groups_count * sizeof(uint32_t));
+    }
+    if (_digests != NULL) {
+        memset(_digests, 0, _groups_count * sizeof(uint32_t));
+    }
+    if (_tier_slots_count > 0) {
+        ((TierHeader *)_tier_base)->signature = 0;
+    }
+    memset(_erase_counts, 0, (_upper_bound - _lower_bound) * sizeof(uint16_t));
+    memset(_dirty_slots, 0xFF, (_upper_bound - _lower_bound + 7) / 8);
+    _pending_erases_count = 0;
+    _released_groups_count = 0;
+    _compact_half = -1;
+    _allocation_cursor = 0;
+    _scrub_cursor = 0;
+    _scrub_passes = 0;
+
+    init_sectors();
+    _map_update_end();
+    FLASH_UNLOCK_WRITE();
 }
 
 void delete_sector(uint32_t physical_sector) {
@@ -349,9 +3975,9 @@ void delete_sector(uint32_t physical_sector) {
 }
 
 void print_sector_header() {
-    for (uint32_t physical_sector = _lower_bound; physical_sector < _upper_bound; physical_sector += _group_by) {
-        uint8_t *read_pointer = get_sector_read_pointer(physical_sector);
-        print_buffer(read_pointer, 12);
+    for (uint16_t group = 0; group < _groups_count; ++group) {
+        printf("%u: logical id %u, flags %02x, transaction %u, erase count %u\n", _get_group_first_sector(group), _groups[group].logical_id,
+               _groups[group].flags, _groups[group].transaction, _erase_counts[group * _group_by]);
     }
 }
 
@@ -363,7 +3989,7 @@ void flash_lib_example() {
 
     uint16_t sector_to_write = 0;
     uint32_t my_physical_sector;
-    uint8_t writeBuffer[FLASH_PAGE_SIZE];
+    uint8_t writeBuffer[FLASH_LIB_PAGE_SIZE];
     uint8_t data_to_write[4] = {0x0A, 0xFA, 0xCA, 0xDA};
     prepare_buffer_to_write(writeBuffer, data_to_write, 4);
 
@@ -380,11 +4006,15 @@ void flash_lib_example() {
 
     start_time = get_absolute_time();
     // *** Code ***
-    get_first_sector_from_logical_id(sector_to_write, &my_physical_sector);
+    bool found = get_first_sector_from_logical_id(sector_to_write, &my_physical_sector);
     // *** Code ***
     end_time = get_absolute_time();
     elapsed_time = 1.0 * absolute_time_diff_us(start_time, end_time);
     printf("Time to find sector: %.2fus\n", elapsed_time);
+    if (!found) {
+        printf("Logical id: %d has no group\n", sector_to_write);
+        return;
+    }
     printf("Logical id: %d At physical addr at: %d\n", sector_to_write, my_physical_sector);
 
     // start_time = get_absolute_time();
@@ -394,7 +4024,7 @@ void flash_lib_example() {
 
     // uint32_t irq_status = save_and_disable_interrupts();
 
-    // flash_range_erase(memory_addr, FLASH_SECTOR_SIZE);
+    // flash_range_erase(memory_addr, FLASH_LIB_SECTOR_SIZE);
 
     // restore_interrupts(irq_status);
     // // *** Code ***
@@ -405,11 +4035,11 @@ void flash_lib_example() {
     start_time = get_absolute_time();
     // *** Code ***
     // write_sector(sector_to_write, 0, data_to_write, sizeof(data_to_write));
-    uint32_t memory_addr = get_memory_addr_from_physical_sector(109);
+    // uint32_t memory_addr = get_memory_addr_from_physical_sector(109);
 
     uint32_t irq_status = save_and_disable_interrupts();
 
-    // flash_range_program(memory_addr, writeBuffer, FLASH_PAGE_SIZE);
+    // flash_range_program(memory_addr, writeBuffer, FLASH_LIB_PAGE_SIZE);
 
     restore_interrupts(irq_status);
     // *** Code ***
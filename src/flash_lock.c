@@ -0,0 +1,74 @@
+#include "flash_lock.h"
+
+#if defined(FLASH_LIB_FREERTOS)
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+// Readers-first lock: the first reader takes the writer semaphore for all the readers and the last
+// one gives it back. Read sections are a few table lookups, so writers never wait long.
+SemaphoreHandle_t _lock_readers_mutex = NULL;
+SemaphoreHandle_t _lock_writer = NULL;
+uint16_t _lock_readers_count = 0;
+
+/**
+ * @brief Creates the lock, only the first call does something.
+ */
+void flash_lock_init() {
+    if (_lock_writer != NULL) {
+        return;
+    }
+
+    _lock_readers_mutex = xSemaphoreCreateMutex();
+    // Binary semaphore, the last reader may not be the task that took it
+    _lock_writer = xSemaphoreCreateBinary();
+    xSemaphoreGive(_lock_writer);
+}
+
+void flash_lock_read() {
+    xSemaphoreTake(_lock_readers_mutex, portMAX_DELAY);
+    if (++_lock_readers_count == 1) {
+        xSemaphoreTake(_lock_writer, portMAX_DELAY);
+    }
+    xSemaphoreGive(_lock_readers_mutex);
+}
+
+void flash_unlock_read() {
+    xSemaphoreTake(_lock_readers_mutex, portMAX_DELAY);
+    if (--_lock_readers_count == 0) {
+        xSemaphoreGive(_lock_writer);
+    }
+    xSemaphoreGive(_lock_readers_mutex);
+}
+
+void flash_lock_write() {
+    xSemaphoreTake(_lock_writer, portMAX_DELAY);
+}
+
+void flash_unlock_write() {
+    xSemaphoreGive(_lock_writer);
+}
+
+#elif defined(FLASH_LIB_PTHREAD)
+#include <pthread.h>
+
+pthread_rwlock_t _lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void flash_lock_init() {
+}
+
+void flash_lock_read() {
+    pthread_rwlock_rdlock(&_lock);
+}
+
+void flash_unlock_read() {
+    pthread_rwlock_unlock(&_lock);
+}
+
+void flash_lock_write() {
+    pthread_rwlock_wrlock(&_lock);
+}
+
+void flash_unlock_write() {
+    pthread_rwlock_unlock(&_lock);
+}
+#endif
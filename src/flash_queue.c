@@ -0,0 +1,269 @@
+#include "flash_queue.h"
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#define EMPTY_SEQUENCE 0xFFFFFFFF
+#define ACK_PENDING 0xFF
+
+typedef struct SlotHeader {
+    uint32_t sequence;
+    uint16_t length;
+    uint8_t ack; // ACK_PENDING until the message is popped, any other value once it is
+    uint8_t reserved;
+    uint32_t checksum; // Of the sequence, length and payload
+} SlotHeader;
+
+const SlotHeader *_queue_get_slot(FlashQueue *queue, uint16_t sector, uint32_t slot);
+uint32_t _queue_checksum(const SlotHeader *header, const uint8_t *payload);
+bool _queue_is_valid(FlashQueue *queue, const SlotHeader *header);
+bool _queue_is_blank(FlashQueue *queue, uint16_t sector);
+void _queue_open_sector(FlashQueue *queue, uint16_t sector);
+void _queue_release_acknowledged(FlashQueue *queue);
+
+/**
+ * @brief Mounts a queue over a range of logical sectors, recovering its head and tail from flash.
+ *
+ * @param queue Queue to initialize.
+ * @param first_logical_id First logical sector of the range.
+ * @param sectors_count Number of logical sectors in the range, at least 2.
+ * @param message_size Largest message, up to QUEUE_MAX_MESSAGE_SIZE.
+ */
+void queue_init(FlashQueue *queue, uint16_t first_logical_id, uint16_t sectors_count, uint16_t message_size) {
+    assert(sectors_count >= 2);
+    assert(message_size <= QUEUE_MAX_MESSAGE_SIZE);
+
+    queue->first_logical_id = first_logical_id;
+    queue->sectors_count = sectors_count;
+    queue->message_size = message_size;
+    queue->slot_size = (sizeof(SlotHeader) + message_size + 3) & ~3u;
+    queue->slots_per_sector = get_logical_sector_size() / queue->slot_size;
+
+    // Newest logical sector is the one whose first slot has the highest sequence. A first slot torn
+    // by a power loss does not count, its logical sector is erased before the next push to it.
+    bool found = false;
+    uint32_t newest_sequence = 0;
+    queue->head_sector = 0;
+    for (uint16_t sector = 0; sector < sectors_count; ++sector) {
+        const SlotHeader *slot = _queue_get_slot(queue, sector, 0);
+        if (slot->sequence != EMPTY_SEQUENCE && _queue_is_valid(queue, slot) && (!found || slot->sequence > newest_sequence)) {
+            found = true;
+            newest_sequence = slot->sequence;
+            queue->head_sector = sector;
+        }
+    }
+
+    if (!found) {
+        queue->next_sequence = 0;
+        _queue_open_sector(queue, 0);
+        queue->tail_sector = 0;
+        queue->tail_slot = 0;
+        return;
+    }
+
+    // Slots are pushed in order, so the programmed ones are a prefix of the sector
+    uint32_t low = 1;
+    uint32_t high = queue->slots_per_sector;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (_queue_get_slot(queue, queue->head_sector, middle)->sequence != EMPTY_SEQUENCE) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    queue->head_slot = low;
+    // Sequences are consecutive in a sector, a torn last slot does not matter
+    queue->next_sequence = newest_sequence + low;
+
+    // Acknowledged sectors are erased, the oldest one is the first programmed sector after the head
+    queue->tail_sector = queue->head_sector;
+    for (uint16_t i = 1; i < sectors_count; ++i) {
+        uint16_t sector = (queue->head_sector + i) % sectors_count;
+        const SlotHeader *slot = _queue_get_slot(queue, sector, 0);
+        if (slot->sequence != EMPTY_SEQUENCE && _queue_is_valid(queue, slot)) {
+            queue->tail_sector = sector;
+            break;
+        }
+    }
+
+    // Messages are acknowledged in order too, so the acknowledged slots are a prefix of the sector
+    low = 0;
+    high = queue->tail_sector == queue->head_sector ? queue->head_slot : queue->slots_per_sector;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (_queue_get_slot(queue, queue->tail_sector, middle)->ack != ACK_PENDING) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    queue->tail_slot = low;
+
+    // A power loss may have happened between the last ack of a sector and its erase
+    _queue_release_acknowledged(queue);
+}
+
+/**
+ * @brief Appends a message.
+ *
+ * @return false if the message is larger than `message_size`, the queue is full, or the flash
+ * library had no free group for it (thin provisioning).
+ */
+bool queue_push(FlashQueue *queue, const void *data, uint16_t length) {
+    if (length > queue->message_size) {
+        return false;
+    }
+
+    if (queue->head_slot == queue->slots_per_sector) {
+        uint16_t next_sector = (queue->head_sector + 1) % queue->sectors_count;
+        if (next_sector == queue->tail_sector) {
+            return false;
+        }
+        _queue_open_sector(queue, next_sector);
+    }
+
+    SlotHeader *header = (SlotHeader *)queue->slot_buffer;
+    header->sequence = queue->next_sequence;
+    header->length = length;
+    header->ack = ACK_PENDING;
+    header->reserved = 0xFF;
+    memcpy(queue->slot_buffer + sizeof(SlotHeader), data, length);
+    header->checksum = _queue_checksum(header, queue->slot_buffer + sizeof(SlotHeader));
+
+    // Only the used bytes of the slot are programmed, in a single write
+    if (!write_sector(queue->first_logical_id + queue->head_sector, queue->head_slot * queue->slot_size, queue->slot_buffer,
+                      sizeof(SlotHeader) + length)) {
+        return false;
+    }
+    queue->next_sequence++;
+    queue->head_slot++;
+    return true;
+}
+
+/**
+ * @brief Looks up the oldest message not acknowledged yet. Messages torn by a power loss are
+ * acknowledged and skipped.
+ *
+ * @param data Set to the message, pointing straight into the flash. Valid until it is popped.
+ * @param length Set to the message length.
+ * @return false if the queue is empty.
+ */
+bool queue_peek(FlashQueue *queue, const uint8_t **data, uint16_t *length) {
+    while (queue_get_count(queue) > 0) {
+        const SlotHeader *slot = _queue_get_slot(queue, queue->tail_sector, queue->tail_slot);
+        if (!_queue_is_valid(queue, slot)) {
+            queue_pop(queue);
+            continue;
+        }
+
+        if (data != NULL) {
+            *data = (const uint8_t *)(slot + 1);
+        }
+        if (length != NULL) {
+            *length = slot->length;
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Acknowledges the oldest message by clearing its ack byte. The logical sector is erased
+ * once all its messages are acknowledged.
+ *
+ * @return false if the queue is empty, or if the flash library refused the write.
+ */
+bool queue_pop(FlashQueue *queue) {
+    if (queue_get_count(queue) == 0) {
+        return false;
+    }
+
+    uint8_t ack = 0;
+    uint32_t offset = queue->tail_slot * queue->slot_size + offsetof(SlotHeader, ack);
+    if (!write_sector(queue->first_logical_id + queue->tail_sector, offset, &ack, 1)) {
+        return false;
+    }
+    queue->tail_slot++;
+    _queue_release_acknowledged(queue);
+    return true;
+}
+
+/**
+ * @brief Number of messages not acknowledged yet, torn ones included.
+ */
+uint32_t queue_get_count(FlashQueue *queue) {
+    if (queue->tail_sector == queue->head_sector) {
+        return queue->head_slot - queue->tail_slot;
+    }
+
+    uint16_t full_sectors = (queue->head_sector + queue->sectors_count - queue->tail_sector) % queue->sectors_count - 1;
+    return queue->slots_per_sector - queue->tail_slot + full_sectors * queue->slots_per_sector + queue->head_slot;
+}
+
+const SlotHeader *_queue_get_slot(FlashQueue *queue, uint16_t sector, uint32_t slot) {
+    return (const SlotHeader *)read_sector(queue->first_logical_id + sector, slot * queue->slot_size);
+}
+
+// FNV-1a
+uint32_t _queue_checksum(const SlotHeader *header, const uint8_t *payload) {
+    uint32_t hash = 2166136261u;
+    const uint32_t fields[2] = {header->sequence, header->length};
+    const uint8_t *bytes = (const uint8_t *)fields;
+    for (uint32_t i = 0; i < sizeof(fields); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    for (uint16_t i = 0; i < header->length; ++i) {
+        hash = (hash ^ payload[i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool _queue_is_valid(FlashQueue *queue, const SlotHeader *header) {
+    return header->length <= queue->message_size && header->checksum == _queue_checksum(header, (const uint8_t *)(header + 1));
+}
+
+/**
+ * @brief Checks a logical sector for programmed bytes, one physical sector at a time as a
+ * tombstoned logical sector reads from a single blank sector.
+ */
+bool _queue_is_blank(FlashQueue *queue, uint16_t sector) {
+    for (uint32_t offset = 0; offset < get_logical_sector_size(); offset += FLASH_LIB_SECTOR_SIZE) {
+        const uint32_t *words = (const uint32_t *)read_sector(queue->first_logical_id + sector, offset);
+        for (uint32_t i = 0; i < FLASH_LIB_SECTOR_SIZE / sizeof(uint32_t); ++i) {
+            if (words[i] != 0xFFFFFFFF) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Makes a logical sector the head. It was erased when its messages were acknowledged, unless
+ * it holds data of a previous use of the range or a first push torn by a power loss.
+ */
+void _queue_open_sector(FlashQueue *queue, uint16_t sector) {
+    if (!_queue_is_blank(queue, sector)) {
+        erase_logical_sector(queue->first_logical_id + sector);
+    }
+    queue->head_sector = sector;
+    queue->head_slot = 0;
+}
+
+/**
+ * @brief Erases the tail logical sector while all its messages are acknowledged, and moves the tail
+ * to the next one. A fully acknowledged head sector moves the head along.
+ */
+void _queue_release_acknowledged(FlashQueue *queue) {
+    while (queue->tail_slot == queue->slots_per_sector) {
+        uint16_t sector = queue->tail_sector;
+        erase_logical_sector(queue->first_logical_id + sector);
+
+        queue->tail_sector = (sector + 1) % queue->sectors_count;
+        queue->tail_slot = 0;
+        if (sector == queue->head_sector) {
+            _queue_open_sector(queue, queue->tail_sector);
+        }
+    }
+}
@@ -0,0 +1,435 @@
+#include "flash_records.h"
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SECTOR_MAGIC 0x5245432A
+
+// Cleared when a newer version of the record is written or the record is deleted
+#define RECORD_FLAG_LIVE 0x01
+
+#define BLANK_ID 0xFFFF
+
+typedef struct SectorHeader {
+    uint32_t magic;
+    uint32_t sequence;
+} SectorHeader;
+
+typedef struct RecordHeader {
+    uint16_t id;
+    uint16_t length;
+    uint16_t length_check; // ~length, a torn header is not followed
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t version;
+    uint32_t checksum; // Of the id, length, version and payload
+} RecordHeader;
+
+const SectorHeader *_records_get_sector_header(RecordStore *store, uint16_t sector);
+const RecordHeader *_records_get_header(RecordStore *store, uint32_t location);
+uint32_t _records_get_size(uint16_t length);
+uint32_t _records_get_capacity(RecordStore *store);
+uint32_t _records_checksum(const RecordHeader *header, const uint8_t *payload);
+bool _records_is_valid(const RecordHeader *header);
+uint32_t _records_scan_sector(RecordStore *store, uint16_t sector);
+void _records_mount_record(RecordStore *store, const RecordHeader *header, uint32_t location);
+bool _records_mark_stale(RecordStore *store, uint32_t location);
+uint32_t _records_append(RecordStore *store, const RecordHeader *header, const uint8_t *payload);
+bool _records_open_sector(RecordStore *store, uint16_t sector);
+bool _records_advance(RecordStore *store);
+bool _records_reclaim(RecordStore *store);
+
+/**
+ * @brief Mounts a record store over a range of logical sectors, rebuilding its index from flash.
+ *
+ * @param store Store to initialize.
+ * @param first_logical_id First logical sector of the range.
+ * @param sectors_count Number of logical sectors in the range, at least 2.
+ * @param index RAM index of `ids_count` entries, owned by the store until it is no longer used.
+ * @param ids_count Records of the store, their IDs go from 0 to `ids_count` - 1.
+ */
+void records_init(RecordStore *store, uint16_t first_logical_id, uint16_t sectors_count, uint32_t *index, uint16_t ids_count) {
+    assert(sectors_count >= 2);
+    assert(ids_count < BLANK_ID);
+
+    store->first_logical_id = first_logical_id;
+    store->sectors_count = sectors_count;
+    store->sector_size = get_logical_sector_size();
+    store->index = index;
+    store->ids_count = ids_count;
+    store->live_bytes = 0;
+    store->next_sequence = 0;
+    memset(index, 0xFF, ids_count * sizeof(uint32_t));
+    assert(_records_get_capacity(store) > 0);
+
+    // Newest logical sector is the one with the highest sequence
+    bool found = false;
+    uint32_t newest_sequence = 0;
+    store->head_sector = 0;
+    for (uint16_t sector = 0; sector < sectors_count; ++sector) {
+        const SectorHeader *header = _records_get_sector_header(store, sector);
+        if (header->magic == SECTOR_MAGIC && (!found || header->sequence > newest_sequence)) {
+            found = true;
+            newest_sequence = header->sequence;
+            store->head_sector = sector;
+        }
+    }
+
+    if (!found) {
+        store->oldest_sector = 0;
+        if (!_records_open_sector(store, 0)) {
+            // No group for the head yet, the next write tries the next logical sector
+            store->head_offset = store->sector_size;
+        }
+        return;
+    }
+
+    // Reclaimed sectors are erased, the oldest one is the first programmed sector after the head
+    store->oldest_sector = store->head_sector;
+    for (uint16_t i = 1; i < sectors_count; ++i) {
+        uint16_t sector = (store->head_sector + i) % sectors_count;
+        if (_records_get_sector_header(store, sector)->magic == SECTOR_MAGIC) {
+            store->oldest_sector = sector;
+            break;
+        }
+    }
+
+    // No erased logical sector is left when a power loss interrupted a reclaim. The head only holds
+    // copies of records of the oldest logical sector, maybe a torn one, so it is erased before the
+    // scan marks the originals stale, and the next advance starts the reclaim over
+    if ((store->head_sector + 1) % sectors_count == store->oldest_sector) {
+        erase_logical_sector(first_logical_id + store->head_sector);
+        records_init(store, first_logical_id, sectors_count, index, ids_count);
+        return;
+    }
+
+    // Oldest to newest, so the latest copy of a record wins over the one a reclaim left behind
+    uint16_t used_sectors = (store->head_sector + sectors_count - store->oldest_sector) % sectors_count + 1;
+    for (uint16_t i = 0; i < used_sectors; ++i) {
+        uint16_t sector = (store->oldest_sector + i) % sectors_count;
+        const SectorHeader *header = _records_get_sector_header(store, sector);
+        if (header->sequence >= store->next_sequence) {
+            store->next_sequence = header->sequence + 1;
+        }
+        store->head_offset = _records_scan_sector(store, sector);
+    }
+
+    for (uint16_t id = 0; id < ids_count; ++id) {
+        if (index[id] != RECORDS_NO_RECORD) {
+            store->live_bytes += _records_get_size(_records_get_header(store, index[id])->length);
+        }
+    }
+}
+
+/**
+ * @brief Looks up the current version of a record.
+ *
+ * @param data Set to the payload, pointing straight into the flash. Valid until the next write or
+ * delete, which may move the record.
+ * @param length Set to the payload length.
+ * @return false if the record was never written or was deleted, or if its header no longer
+ * validates, e.g. after its logical sector was erased behind the store.
+ */
+bool records_read(RecordStore *store, uint16_t id, const uint8_t **data, uint16_t *length) {
+    assert(id < store->ids_count);
+    if (store->index[id] == RECORDS_NO_RECORD) {
+        return false;
+    }
+
+    const RecordHeader *header = _records_get_header(store, store->index[id]);
+    if (header->id != id || !_records_is_valid(header)) {
+        return false;
+    }
+    if (data != NULL) {
+        *data = (const uint8_t *)(header + 1);
+    }
+    if (length != NULL) {
+        *length = header->length;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes a new version of a record. The previous version stays current until the new one
+ * is fully programmed, and an unchanged payload is not written again.
+ *
+ * @return false if the payload is larger than RECORDS_MAX_SIZE, the store is out of space, or the
+ * flash library had no free group for it (thin provisioning). The store is unchanged then.
+ */
+bool records_write(RecordStore *store, uint16_t id, const void *data, uint16_t length) {
+    assert(id < store->ids_count);
+    if (length > RECORDS_MAX_SIZE) {
+        return false;
+    }
+
+    uint32_t previous_size = 0;
+    if (store->index[id] != RECORDS_NO_RECORD) {
+        const RecordHeader *previous = _records_get_header(store, store->index[id]);
+        if (previous->length == length && memcmp(previous + 1, data, length) == 0) {
+            return true;
+        }
+        previous_size = _records_get_size(previous->length);
+    }
+
+    uint32_t size = _records_get_size(length);
+    if (store->live_bytes - previous_size + size > _records_get_capacity(store)) {
+        return false;
+    }
+
+    // Every move reclaims a logical sector, once all were compacted the record fits
+    for (uint16_t moves = 0; store->head_offset + size > store->sector_size; ++moves) {
+        if (moves == store->sectors_count || !_records_advance(store)) {
+            return false;
+        }
+    }
+
+    // The previous version may have been moved by a reclaim
+    uint32_t previous_location = store->index[id];
+    RecordHeader header = {
+        .id = id,
+        .length = length,
+        .length_check = (uint16_t)~length,
+        .flags = 0xFF,
+        .reserved = 0xFF,
+        .version = store->next_sequence++,
+    };
+    header.checksum = _records_checksum(&header, (const uint8_t *)data);
+
+    uint32_t location = _records_append(store, &header, (const uint8_t *)data);
+    if (location == RECORDS_NO_RECORD) {
+        return false;
+    }
+
+    // Left live if it fails, records_init() keeps the newer version
+    store->index[id] = location;
+    if (previous_location != RECORDS_NO_RECORD) {
+        _records_mark_stale(store, previous_location);
+    }
+    store->live_bytes += size - previous_size;
+    return true;
+}
+
+/**
+ * @brief Deletes a record by marking its current version stale.
+ *
+ * @return false if the record was not written, or if the flash library refused the write.
+ */
+bool records_delete(RecordStore *store, uint16_t id) {
+    assert(id < store->ids_count);
+    uint32_t location = store->index[id];
+    if (location == RECORDS_NO_RECORD || !_records_mark_stale(store, location)) {
+        return false;
+    }
+
+    store->live_bytes -= _records_get_size(_records_get_header(store, location)->length);
+    store->index[id] = RECORDS_NO_RECORD;
+    return true;
+}
+
+/**
+ * @brief Bytes still available to records, each record taking its payload plus a 16 byte header,
+ * rounded up to 4 bytes.
+ */
+uint32_t records_get_free_bytes(RecordStore *store) {
+    return _records_get_capacity(store) - store->live_bytes;
+}
+
+const SectorHeader *_records_get_sector_header(RecordStore *store, uint16_t sector) {
+    return (const SectorHeader *)read_sector(store->first_logical_id + sector, 0);
+}
+
+const RecordHeader *_records_get_header(RecordStore *store, uint32_t location) {
+    return (const RecordHeader *)read_sector(store->first_logical_id + location / store->sector_size, location % store->sector_size);
+}
+
+uint32_t _records_get_size(uint16_t length) {
+    return (sizeof(RecordHeader) + length + 3) & ~3u;
+}
+
+/**
+ * @brief Live bytes the store accepts: every logical sector but the erased one, less the tail a
+ * sector may leave unused when the next record does not fit.
+ */
+uint32_t _records_get_capacity(RecordStore *store) {
+    uint32_t usable = store->sector_size - sizeof(SectorHeader) - _records_get_size(RECORDS_MAX_SIZE);
+    return (store->sectors_count - 1) * usable;
+}
+
+// FNV-1a
+uint32_t _records_checksum(const RecordHeader *header, const uint8_t *payload) {
+    uint32_t hash = 2166136261u;
+    const uint32_t fields[3] = {header->id, header->length, header->version};
+    const uint8_t *bytes = (const uint8_t *)fields;
+    for (uint32_t i = 0; i < sizeof(fields); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    for (uint16_t i = 0; i < header->length; ++i) {
+        hash = (hash ^ payload[i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool _records_is_valid(const RecordHeader *header) {
+    return (uint16_t)(header->length_check ^ header->length) == 0xFFFF && header->length <= RECORDS_MAX_SIZE;
+}
+
+/**
+ * @brief Adds the records of a logical sector to the index.
+ *
+ * @return Offset after the last record, or the sector size if a torn header closes the sector.
+ */
+uint32_t _records_scan_sector(RecordStore *store, uint16_t sector) {
+    uint32_t offset = sizeof(SectorHeader);
+    while (offset + sizeof(RecordHeader) <= store->sector_size) {
+        uint32_t location = sector * store->sector_size + offset;
+        const RecordHeader *header = _records_get_header(store, location);
+        if (header->id == BLANK_ID && header->length == 0xFFFF) {
+            return offset;
+        }
+
+        uint32_t size = _records_get_size(header->length);
+        if (!_records_is_valid(header) || offset + size > store->sector_size) {
+            return store->sector_size;
+        }
+
+        _records_mount_record(store, header, location);
+        offset += size;
+    }
+    return offset;
+}
+
+/**
+ * @brief Indexes a record found by records_init(). A record torn by a power loss is ignored, and of
+ * two live versions the older one is marked stale.
+ */
+void _records_mount_record(RecordStore *store, const RecordHeader *header, uint32_t location) {
+    // The version of a torn header may still be blank, it would wrap the sequence around
+    if (header->checksum != _records_checksum(header, (const uint8_t *)(header + 1))) {
+        return;
+    }
+
+    if (header->version >= store->next_sequence) {
+        store->next_sequence = header->version + 1;
+    }
+
+    if (header->id >= store->ids_count || !(header->flags & RECORD_FLAG_LIVE)) {
+        return;
+    }
+
+    uint32_t current = store->index[header->id];
+    if (current != RECORDS_NO_RECORD && _records_get_header(store, current)->version > header->version) {
+        _records_mark_stale(store, location);
+        return;
+    }
+
+    if (current != RECORDS_NO_RECORD) {
+        _records_mark_stale(store, current);
+    }
+    store->index[header->id] = location;
+}
+
+/**
+ * @brief Clears the live bit of a record, programming a single byte of its header.
+ *
+ * @return false if the flash library refused the write.
+ */
+bool _records_mark_stale(RecordStore *store, uint32_t location) {
+    uint8_t flags = (uint8_t)~RECORD_FLAG_LIVE;
+    uint32_t offset = location % store->sector_size + offsetof(RecordHeader, flags);
+    return write_sector(store->first_logical_id + location / store->sector_size, offset, &flags, 1);
+}
+
+/**
+ * @brief Programs a record at the head, which must have room for it.
+ *
+ * @return Location of the record, or RECORDS_NO_RECORD if the flash library refused the write.
+ */
+uint32_t _records_append(RecordStore *store, const RecordHeader *header, const uint8_t *payload) {
+    uint32_t size = _records_get_size(header->length);
+    assert(store->head_offset + size <= store->sector_size);
+
+    // The payload may be in the flash, e.g. a record copied by a reclaim
+    memcpy(store->record_buffer, header, sizeof(RecordHeader));
+    memcpy(store->record_buffer + sizeof(RecordHeader), payload, header->length);
+    memset(store->record_buffer + sizeof(RecordHeader) + header->length, 0xFF, size - sizeof(RecordHeader) - header->length);
+    if (!write_sector(store->first_logical_id + store->head_sector, store->head_offset, store->record_buffer, size)) {
+        return RECORDS_NO_RECORD;
+    }
+
+    uint32_t location = store->head_sector * store->sector_size + store->head_offset;
+    store->head_offset += size;
+    return location;
+}
+
+/**
+ * @brief Erases a logical sector and makes it the head.
+ *
+ * @return false if the flash library refused the write of its header, the head did not move.
+ */
+bool _records_open_sector(RecordStore *store, uint16_t sector) {
+    erase_logical_sector(store->first_logical_id + sector);
+
+    SectorHeader header = {SECTOR_MAGIC, store->next_sequence++};
+    if (!write_sector(store->first_logical_id + sector, 0, (const uint8_t *)&header, sizeof(SectorHeader))) {
+        return false;
+    }
+    store->head_sector = sector;
+    store->head_offset = sizeof(SectorHeader);
+    return true;
+}
+
+/**
+ * @brief Moves the head to the next logical sector, which is always erased, then reclaims the
+ * oldest logical sector if it was the last erased one. The live records of a logical sector always
+ * fit in the new head. A reclaim that failed is resumed instead, before its sector is reused.
+ *
+ * @return false if the flash library refused a write.
+ */
+bool _records_advance(RecordStore *store) {
+    if ((store->head_sector + 1) % store->sectors_count != store->oldest_sector &&
+        !_records_open_sector(store, (store->head_sector + 1) % store->sectors_count)) {
+        return false;
+    }
+    if ((store->head_sector + 1) % store->sectors_count == store->oldest_sector) {
+        return _records_reclaim(store);
+    }
+    return true;
+}
+
+/**
+ * @brief Copies the live records of the oldest logical sector to the head, then erases it. A power
+ * loss before the erase leaves no erased logical sector, records_init() then erases the copies.
+ *
+ * @return false if the flash library refused a copy, the oldest logical sector is kept and the
+ * records copied so far are used from the head.
+ */
+bool _records_reclaim(RecordStore *store) {
+    uint16_t sector = store->oldest_sector;
+    uint32_t offset = sizeof(SectorHeader);
+    while (offset + sizeof(RecordHeader) <= store->sector_size) {
+        uint32_t location = sector * store->sector_size + offset;
+        const RecordHeader *header = _records_get_header(store, location);
+        if (header->id == BLANK_ID && header->length == 0xFFFF) {
+            break;
+        }
+
+        uint32_t size = _records_get_size(header->length);
+        if (!_records_is_valid(header) || offset + size > store->sector_size) {
+            break;
+        }
+
+        // Only the indexed version is live, stale and torn records are dropped
+        if (header->id < store->ids_count && store->index[header->id] == location) {
+            uint32_t copy = _records_append(store, header, (const uint8_t *)(header + 1));
+            if (copy == RECORDS_NO_RECORD) {
+                return false;
+            }
+            store->index[header->id] = copy;
+        }
+        offset += size;
+    }
+
+    erase_logical_sector(store->first_logical_id + sector);
+    store->oldest_sector = (sector + 1) % store->sectors_count;
+    return true;
+}
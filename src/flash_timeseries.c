@@ -0,0 +1,339 @@
+#include "flash_timeseries.h"
+#include <assert.h>
+#include <string.h>
+
+#define EMPTY_SEQUENCE 0xFFFFFFFF
+
+
+typedef struct PageHeader {
+    uint32_t sequence;
+    uint32_t first_timestamp;
+    uint32_t last_timestamp;
+    uint16_t count;
+    uint16_t reserved;
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+} PageHeader;
+
+const PageHeader *_timeseries_get_page(TimeSeries *ts, uint16_t sector, uint32_t page);
+const PageHeader *_timeseries_get_ordered_page(TimeSeries *ts, uint32_t index);
+uint32_t _timeseries_get_ordered_pages_count(TimeSeries *ts);
+uint32_t _timeseries_get_page_offset(uint32_t page);
+const uint8_t *_timeseries_get_record(TimeSeries *ts, const PageHeader *page, uint16_t index);
+void _timeseries_add_to_summary(TimeSeriesSummary *summary, int32_t value);
+bool _timeseries_visit_page(TimeSeries *ts, const PageHeader *page, uint32_t t1, uint32_t t2, timeseries_callback_t callback, void *context, uint32_t *found);
+void _timeseries_aggregate_page(TimeSeries *ts, const PageHeader *page, uint32_t t1, uint32_t t2, TimeSeriesSummary *summary);
+
+/**
+ * @brief Mounts a time series over a range of logical sectors, recovering its state from flash.
+ *
+ * @param ts Time series to initialize.
+ * @param first_logical_id First logical sector of the range.
+ * @param sectors_count Number of logical sectors in the range.
+ * @param record_size Payload bytes of each record, the timestamp is not included.
+ * @param value_offset Offset of an int32_t in the payload summarized per page, or TIMESERIES_NO_SUMMARY.
+ */
+void timeseries_init(TimeSeries *ts, uint16_t first_logical_id, uint16_t sectors_count, uint16_t record_size, int16_t value_offset) {
+    assert(sectors_count > 0);
+    assert(value_offset == TIMESERIES_NO_SUMMARY || value_offset + sizeof(int32_t) <= record_size);
+
+    ts->first_logical_id = first_logical_id;
+    ts->sectors_count = sectors_count;
+    ts->record_size = record_size;
+    ts->value_offset = value_offset;
+    ts->records_per_page = (FLASH_LIB_PAGE_SIZE - sizeof(PageHeader)) / (sizeof(uint32_t) + record_size);
+    ts->pages_per_sector = get_logical_sector_size() / FLASH_LIB_PAGE_SIZE;
+    ts->buffered_records = 0;
+    assert(ts->records_per_page > 0);
+
+    // Newest logical sector is the one whose first page has the highest sequence
+    bool found = false;
+    uint32_t newest_sequence = 0;
+    ts->head_sector = 0;
+    for (uint16_t sector = 0; sector < sectors_count; ++sector) {
+        const PageHeader *page = _timeseries_get_page(ts, sector, 0);
+        if (page->sequence != EMPTY_SEQUENCE && (!found || page->sequence > newest_sequence)) {
+            found = true;
+            newest_sequence = page->sequence;
+            ts->head_sector = sector;
+        }
+    }
+
+    if (!found) {
+        ts->oldest_sector = 0;
+        ts->head_page = 0;
+        ts->next_sequence = 0;
+        return;
+    }
+
+    // Pages are programmed in order, so the programmed ones are a prefix of the sector
+    uint32_t low = 1;
+    uint32_t high = ts->pages_per_sector;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (_timeseries_get_page(ts, ts->head_sector, middle)->sequence != EMPTY_SEQUENCE) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    ts->head_page = low;
+    ts->next_sequence = _timeseries_get_page(ts, ts->head_sector, low - 1)->sequence + 1;
+
+    // Once the ring wrapped, the sector after the newest one holds the oldest data
+    uint16_t next_sector = (ts->head_sector + 1) % sectors_count;
+    bool wrapped = next_sector != ts->head_sector && _timeseries_get_page(ts, next_sector, 0)->sequence != EMPTY_SEQUENCE;
+    ts->oldest_sector = wrapped ? next_sector : 0;
+}
+
+/**
+ * @brief Appends a record. Timestamps must not decrease.
+ *
+ * @return false if the timestamp is older than the last record, or if the RAM page is still full
+ * because the flash library refused to program it (thin provisioning without a free group).
+ */
+bool timeseries_append(TimeSeries *ts, uint32_t timestamp, const void *payload) {
+    PageHeader *header = (PageHeader *)ts->page_buffer;
+    if (ts->buffered_records == ts->records_per_page && !timeseries_flush(ts)) {
+        return false;
+    }
+
+    if (ts->buffered_records > 0) {
+        if (timestamp < header->last_timestamp) {
+            return false;
+        }
+    } else {
+        uint32_t pages_count = _timeseries_get_ordered_pages_count(ts);
+        if (pages_count > 0 && timestamp < _timeseries_get_ordered_page(ts, pages_count - 1)->last_timestamp) {
+            return false;
+        }
+
+        memset(ts->page_buffer, 0xFF, FLASH_LIB_PAGE_SIZE);
+        header->first_timestamp = timestamp;
+        header->count = 0;
+        header->min = INT32_MAX;
+        header->max = INT32_MIN;
+        header->sum = 0;
+    }
+
+    uint8_t *record = ts->page_buffer + sizeof(PageHeader) + ts->buffered_records * (sizeof(uint32_t) + ts->record_size);
+    memcpy(record, &timestamp, sizeof(uint32_t));
+    memcpy(record + sizeof(uint32_t), payload, ts->record_size);
+
+    header->last_timestamp = timestamp;
+    header->count = ++ts->buffered_records;
+    if (ts->value_offset != TIMESERIES_NO_SUMMARY) {
+        int32_t value;
+        memcpy(&value, (const uint8_t *)payload + ts->value_offset, sizeof(int32_t));
+        TimeSeriesSummary summary = {header->count - 1, header->min, header->max, header->sum};
+        _timeseries_add_to_summary(&summary, value);
+        header->min = summary.min;
+        header->max = summary.max;
+        header->sum = summary.sum;
+    }
+
+    // Kept in RAM if the program fails, the next append or flush tries again
+    if (ts->buffered_records == ts->records_per_page) {
+        timeseries_flush(ts);
+    }
+    return true;
+}
+
+/**
+ * @brief Programs the buffered records. A partially filled page is closed, the next record starts
+ * a new page.
+ *
+ * @return false if the flash library refused the write, the records stay buffered.
+ */
+bool timeseries_flush(TimeSeries *ts) {
+    if (ts->buffered_records == 0) {
+        return true;
+    }
+
+    // Moves to the next logical sector, dropping its oldest data
+    if (ts->head_page == ts->pages_per_sector) {
+        ts->head_sector = (ts->head_sector + 1) % ts->sectors_count;
+        ts->head_page = 0;
+        if (ts->head_sector == ts->oldest_sector && ts->sectors_count > 1) {
+            ts->oldest_sector = (ts->oldest_sector + 1) % ts->sectors_count;
+        }
+        erase_logical_sector(ts->first_logical_id + ts->head_sector);
+    }
+
+    PageHeader *header = (PageHeader *)ts->page_buffer;
+    header->sequence = ts->next_sequence;
+    if (!write_sector(ts->first_logical_id + ts->head_sector, _timeseries_get_page_offset(ts->head_page), ts->page_buffer,
+                      FLASH_LIB_PAGE_SIZE)) {
+        return false;
+    }
+
+    ts->next_sequence++;
+    ts->head_page++;
+    ts->buffered_records = 0;
+    return true;
+}
+
+/**
+ * @brief Calls the callback for every record with a timestamp between t1 and t2, inclusive.
+ *
+ * The first page is found with a binary search over the page headers, payloads are passed
+ * straight from the flash.
+ *
+ * @return Number of records visited.
+ */
+uint32_t timeseries_query(TimeSeries *ts, uint32_t t1, uint32_t t2, timeseries_callback_t callback, void *context) {
+    uint32_t found = 0;
+    uint32_t pages_count = _timeseries_get_ordered_pages_count(ts);
+
+    // First page that may hold records at or after t1
+    uint32_t low = 0;
+    uint32_t high = pages_count;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (_timeseries_get_ordered_page(ts, middle)->last_timestamp < t1) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (uint32_t i = low; i < pages_count; ++i) {
+        if (!_timeseries_visit_page(ts, _timeseries_get_ordered_page(ts, i), t1, t2, callback, context, &found)) {
+            return found;
+        }
+    }
+
+    if (ts->buffered_records > 0) {
+        _timeseries_visit_page(ts, (const PageHeader *)ts->page_buffer, t1, t2, callback, context, &found);
+    }
+    return found;
+}
+
+/**
+ * @brief Computes count, min, max and sum of the summarized field for records between t1 and t2.
+ *
+ * Pages entirely inside the range use their stored summary, only the boundary pages are decoded,
+ * so downsampling a long history costs a few page reads per bucket.
+ *
+ * @return false if the time series has no summarized field or no record is in the range.
+ */
+bool timeseries_aggregate(TimeSeries *ts, uint32_t t1, uint32_t t2, TimeSeriesSummary *summary) {
+    summary->count = 0;
+    summary->min = INT32_MAX;
+    summary->max = INT32_MIN;
+    summary->sum = 0;
+
+    if (ts->value_offset == TIMESERIES_NO_SUMMARY) {
+        return false;
+    }
+
+    uint32_t pages_count = _timeseries_get_ordered_pages_count(ts);
+    uint32_t low = 0;
+    uint32_t high = pages_count;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (_timeseries_get_ordered_page(ts, middle)->last_timestamp < t1) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (uint32_t i = low; i < pages_count; ++i) {
+        const PageHeader *page = _timeseries_get_ordered_page(ts, i);
+        if (page->first_timestamp > t2) {
+            break;
+        }
+        _timeseries_aggregate_page(ts, page, t1, t2, summary);
+    }
+
+    if (ts->buffered_records > 0) {
+        _timeseries_aggregate_page(ts, (const PageHeader *)ts->page_buffer, t1, t2, summary);
+    }
+    return summary->count > 0;
+}
+
+uint32_t _timeseries_get_page_offset(uint32_t page) {
+    return page * FLASH_LIB_PAGE_SIZE;
+}
+
+const PageHeader *_timeseries_get_page(TimeSeries *ts, uint16_t sector, uint32_t page) {
+    return (const PageHeader *)read_sector(ts->first_logical_id + sector, _timeseries_get_page_offset(page));
+}
+
+uint32_t _timeseries_get_ordered_pages_count(TimeSeries *ts) {
+    uint16_t full_sectors = (ts->head_sector + ts->sectors_count - ts->oldest_sector) % ts->sectors_count;
+    return full_sectors * ts->pages_per_sector + ts->head_page;
+}
+
+/**
+ * @brief Retrieves a programmed page by its position in time order, 0 being the oldest page.
+ */
+const PageHeader *_timeseries_get_ordered_page(TimeSeries *ts, uint32_t index) {
+    uint16_t sector = (ts->oldest_sector + index / ts->pages_per_sector) % ts->sectors_count;
+    return _timeseries_get_page(ts, sector, index % ts->pages_per_sector);
+}
+
+const uint8_t *_timeseries_get_record(TimeSeries *ts, const PageHeader *page, uint16_t index) {
+    return (const uint8_t *)page + sizeof(PageHeader) + index * (sizeof(uint32_t) + ts->record_size);
+}
+
+void _timeseries_add_to_summary(TimeSeriesSummary *summary, int32_t value) {
+    summary->count++;
+    summary->sum += value;
+    if (value < summary->min) {
+        summary->min = value;
+    }
+    if (value > summary->max) {
+        summary->max = value;
+    }
+}
+
+bool _timeseries_visit_page(TimeSeries *ts, const PageHeader *page, uint32_t t1, uint32_t t2, timeseries_callback_t callback, void *context, uint32_t *found) {
+    for (uint16_t i = 0; i < page->count; ++i) {
+        const uint8_t *record = _timeseries_get_record(ts, page, i);
+        uint32_t timestamp;
+        memcpy(&timestamp, record, sizeof(uint32_t));
+
+        if (timestamp > t2) {
+            return false;
+        }
+        if (timestamp < t1) {
+            continue;
+        }
+
+        (*found)++;
+        if (!callback(timestamp, record + sizeof(uint32_t), context)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void _timeseries_aggregate_page(TimeSeries *ts, const PageHeader *page, uint32_t t1, uint32_t t2, TimeSeriesSummary *summary) {
+    if (page->first_timestamp >= t1 && page->last_timestamp <= t2) {
+        summary->count += page->count;
+        summary->sum += page->sum;
+        if (page->min < summary->min) {
+            summary->min = page->min;
+        }
+        if (page->max > summary->max) {
+            summary->max = page->max;
+        }
+        return;
+    }
+
+    for (uint16_t i = 0; i < page->count; ++i) {
+        const uint8_t *record = _timeseries_get_record(ts, page, i);
+        uint32_t timestamp;
+        memcpy(&timestamp, record, sizeof(uint32_t));
+        if (timestamp < t1 || timestamp > t2) {
+            continue;
+        }
+
+        int32_t value;
+        memcpy(&value, record + sizeof(uint32_t) + ts->value_offset, sizeof(int32_t));
+        _timeseries_add_to_summary(summary, value);
+    }
+}
@@ -0,0 +1,94 @@
+#include "flash_trace.h"
+#include <stdio.h>
+
+#ifdef FLASH_LIB_TRACE
+// Ring of the newest entries, _trace_first is the oldest one
+FlashTraceEntry _trace_entries[FLASH_LIB_TRACE_ENTRIES];
+uint16_t _trace_first = 0;
+uint16_t _trace_count = 0;
+uint32_t _trace_dropped = 0;
+#endif
+
+/**
+ * @brief Adds an entry to the trace, overwriting the oldest one if the ring is full.
+ *
+ * @param start time_us_32() at the start of the operation, the duration is measured from it.
+ */
+void flash_trace_record(uint8_t op, uint8_t arg, uint16_t logical_id, uint32_t offset, uint32_t length, uint32_t start) {
+#ifdef FLASH_LIB_TRACE
+    if (_trace_count == FLASH_LIB_TRACE_ENTRIES) {
+        _trace_first = (_trace_first + 1) % FLASH_LIB_TRACE_ENTRIES;
+        _trace_count--;
+        _trace_dropped++;
+    }
+
+    FlashTraceEntry *entry = &_trace_entries[(_trace_first + _trace_count) % FLASH_LIB_TRACE_ENTRIES];
+    entry->timestamp = start;
+    entry->duration = time_us_32() - start;
+    entry->offset = offset;
+    entry->length = length;
+    entry->logical_id = logical_id;
+    entry->op = op;
+    entry->arg = arg;
+    _trace_count++;
+#else
+    (void)op;
+    (void)arg;
+    (void)logical_id;
+    (void)offset;
+    (void)length;
+    (void)start;
+#endif
+}
+
+/**
+ * @brief Removes the oldest entries from the trace.
+ *
+ * @return Number of entries copied to `entries`.
+ */
+uint16_t flash_trace_read(FlashTraceEntry *entries, uint16_t max_entries) {
+    uint16_t count = 0;
+#ifdef FLASH_LIB_TRACE
+    while (count < max_entries && _trace_count > 0) {
+        entries[count++] = _trace_entries[_trace_first];
+        _trace_first = (_trace_first + 1) % FLASH_LIB_TRACE_ENTRIES;
+        _trace_count--;
+    }
+#else
+    (void)entries;
+    (void)max_entries;
+#endif
+    return count;
+}
+
+/**
+ * @brief Prints and removes every entry of the trace, one line per entry:
+ * "FLT op arg logical_id offset length timestamp duration", all in decimal.
+ *
+ * Entries dropped since the last drain are reported first with "FLT-DROPPED count".
+ */
+void flash_trace_drain() {
+#ifdef FLASH_LIB_TRACE
+    if (_trace_dropped > 0) {
+        printf("FLT-DROPPED %lu\n", (unsigned long)_trace_dropped);
+        _trace_dropped = 0;
+    }
+
+    FlashTraceEntry entry;
+    while (flash_trace_read(&entry, 1) == 1) {
+        printf("FLT %u %u %u %lu %lu %lu %lu\n", entry.op, entry.arg, entry.logical_id, (unsigned long)entry.offset,
+               (unsigned long)entry.length, (unsigned long)entry.timestamp, (unsigned long)entry.duration);
+    }
+#endif
+}
+
+/**
+ * @brief Number of entries overwritten before being read since the last drain.
+ */
+uint32_t flash_trace_dropped() {
+#ifdef FLASH_LIB_TRACE
+    return _trace_dropped;
+#else
+    return 0;
+#endif
+}
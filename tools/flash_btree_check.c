@@ -0,0 +1,271 @@
+/**
+ * @brief Randomized check of the B+tree (flash_btree.h) against a model, on an emulated flash.
+ *
+ * *** Overview ***
+ * - Draws `--keys` random keys of BTREE_MAX_KEY_SIZE bytes, then runs `--ops` random puts of
+ *   BTREE_MAX_VALUE_SIZE random bytes, deletes and gets on them, on the flash emulated by
+ *   tools/host/flash_emu.c, and applies the same operations to a model kept in RAM.
+ * - Full size entries split nodes every few commits, and the commits go around the ring of
+ *   `--sectors` logical sectors many times, so the run goes through splits of every level and
+ *   reclaims of the oldest logical sector.
+ * - Every `--remount` operations, mounts the library and the tree again, as after a reset, then
+ *   gets every key, scans the whole tree and a random range, and compares them with the model.
+ * - Reports the first operation whose result differs from the model, and fails if there is one.
+ *
+ * *** Build ***
+ *     gcc -O2 -Itools/host/include -Itools/host -Iinclude tools/flash_btree_check.c tools/host/flash_emu.c \
+ *         src/flash_lib.c src/flash_trace.c src/flash_btree.c -o flash_btree_check
+ *
+ * *** Usage ***
+ *     flash_btree_check --sectors 250 --keys 400 --ops 5000 --remount 100
+ */
+
+#include "flash_btree.h"
+#include "flash_emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct CheckConfig {
+    FlashLibConfig flash;
+    uint16_t sectors_count;
+    uint16_t keys_count;
+    uint32_t ops;
+    uint32_t remount;
+    uint32_t seed;
+} CheckConfig;
+
+typedef struct CheckEntry {
+    uint8_t key[BTREE_MAX_KEY_SIZE];
+    bool present;
+    uint8_t value[BTREE_MAX_VALUE_SIZE];
+} CheckEntry;
+
+// State of a scan compared with the model, entries are expected in the order of the sorted keys
+typedef struct CheckScan {
+    uint16_t next;
+    uint16_t end;
+    bool valid;
+} CheckScan;
+
+CheckConfig _check;
+BTree _tree;
+CheckEntry *_model;
+uint16_t _live;
+uint32_t _reclaims;
+uint32_t _check_random_state;
+
+void _check_usage();
+bool _check_parse_args(int argc, char **argv);
+void _check_mount();
+bool _check_operation(uint32_t op);
+bool _check_all();
+bool _check_scan_entry(const uint8_t *key, uint8_t key_len, const uint8_t *value, uint8_t value_len, void *context);
+bool _check_scan(uint16_t first, uint16_t last);
+int _check_compare_keys(const void *a, const void *b);
+uint32_t _check_random();
+
+int main(int argc, char **argv) {
+    if (!_check_parse_args(argc, argv)) {
+        _check_usage();
+        return 1;
+    }
+
+    // Sorted keys give the order the scans must follow
+    _model = (CheckEntry *)calloc(_check.keys_count, sizeof(CheckEntry));
+    _check_random_state = _check.seed;
+    for (uint16_t i = 0; i < _check.keys_count; ++i) {
+        for (uint8_t j = 0; j < BTREE_MAX_KEY_SIZE; ++j) {
+            _model[i].key[j] = _check_random();
+        }
+    }
+    qsort(_model, _check.keys_count, sizeof(CheckEntry), _check_compare_keys);
+
+    flash_emu_reset(0xFF);
+    _check_mount();
+
+    uint32_t remounts = 0;
+    int32_t failed = -1;
+    for (uint32_t op = 0; op < _check.ops && failed < 0; ++op) {
+        uint16_t oldest_sector = _tree.oldest_sector;
+        if (!_check_operation(op)) {
+            failed = op;
+        }
+        _reclaims += (_tree.oldest_sector + _check.sectors_count - oldest_sector) % _check.sectors_count;
+
+        if (failed < 0 && (op + 1) % _check.remount == 0) {
+            _check_mount();
+            remounts++;
+            if (!_check_all()) {
+                printf("after remount at operation %u: tree differs from the model\n", op);
+                failed = op;
+            }
+        }
+    }
+
+    printf("%u operations, %u remounts, %u reclaimed sectors, %u live keys, %s\n", failed < 0 ? _check.ops : (uint32_t)failed,
+           remounts, _reclaims, _live, failed < 0 ? "ok" : "FAILED");
+    free(_model);
+    return failed < 0 ? 0 : 1;
+}
+
+void _check_usage() {
+    fprintf(stderr, "usage: flash_btree_check [--lower N] [--group-by N] [--sectors N] [--keys N] [--ops N] [--remount N]\n"
+                    "                         [--seed N]\n");
+}
+
+bool _check_parse_args(int argc, char **argv) {
+    _check = (CheckConfig){
+        .flash = {.lower_bound = 256, .group_by = 1, .seed = 1},
+        .sectors_count = 250,
+        .keys_count = 400,
+        .ops = 5000,
+        .remount = 100,
+        .seed = 7,
+    };
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *value = argv[i + 1];
+        if (strcmp(argv[i], "--lower") == 0) {
+            _check.flash.lower_bound = atoi(value);
+        } else if (strcmp(argv[i], "--group-by") == 0) {
+            _check.flash.group_by = atoi(value);
+        } else if (strcmp(argv[i], "--sectors") == 0) {
+            _check.sectors_count = atoi(value);
+        } else if (strcmp(argv[i], "--keys") == 0) {
+            _check.keys_count = atoi(value);
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            _check.ops = atoi(value);
+        } else if (strcmp(argv[i], "--remount") == 0) {
+            _check.remount = atoi(value);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            _check.seed = strtoul(value, NULL, 0);
+        } else {
+            return false;
+        }
+    }
+
+    // The tree spans every logical sector of the region
+    _check.flash.logical_sectors_count = _check.sectors_count;
+    return argc % 2 == 1 && _check.sectors_count >= 3 && _check.keys_count > 0 && _check.remount > 0 &&
+           _check.flash.group_by > 0 && _check.seed != 0;
+}
+
+/**
+ * @brief Runs the init of the library and of the tree, as after a reset.
+ */
+void _check_mount() {
+    init_flash_lib_with_config(&_check.flash);
+    btree_init(&_tree, 0, _check.sectors_count);
+}
+
+/**
+ * @brief Runs a random put, delete or get on the tree and on the model.
+ *
+ * @return false if the tree result differs from the model.
+ */
+bool _check_operation(uint32_t op) {
+    uint16_t index = _check_random() % _check.keys_count;
+    CheckEntry *entry = &_model[index];
+    uint32_t kind = _check_random() % 4;
+
+    if (kind < 2) {
+        uint8_t value[BTREE_MAX_VALUE_SIZE];
+        for (uint8_t j = 0; j < BTREE_MAX_VALUE_SIZE; ++j) {
+            value[j] = _check_random();
+        }
+        if (!btree_put(&_tree, entry->key, BTREE_MAX_KEY_SIZE, value, BTREE_MAX_VALUE_SIZE)) {
+            printf("operation %u: put of key %u failed\n", op, index);
+            return false;
+        }
+        memcpy(entry->value, value, BTREE_MAX_VALUE_SIZE);
+        _live += entry->present ? 0 : 1;
+        entry->present = true;
+    } else if (kind == 2) {
+        if (btree_delete(&_tree, entry->key, BTREE_MAX_KEY_SIZE) != entry->present) {
+            printf("operation %u: delete of key %u returned %s\n", op, index, entry->present ? "false" : "true");
+            return false;
+        }
+        _live -= entry->present ? 1 : 0;
+        entry->present = false;
+    }
+
+    // Gets the key after every operation, which also checks the one just changed
+    const uint8_t *value;
+    uint8_t value_len;
+    bool found = btree_get(&_tree, entry->key, BTREE_MAX_KEY_SIZE, &value, &value_len);
+    if (found != entry->present ||
+        (found && (value_len != BTREE_MAX_VALUE_SIZE || memcmp(value, entry->value, BTREE_MAX_VALUE_SIZE) != 0))) {
+        printf("operation %u: get of key %u differs from the model\n", op, index);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Gets every key, then scans the whole tree and a random range.
+ *
+ * @return false if any of them differs from the model.
+ */
+bool _check_all() {
+    for (uint16_t i = 0; i < _check.keys_count; ++i) {
+        const uint8_t *value;
+        uint8_t value_len;
+        bool found = btree_get(&_tree, _model[i].key, BTREE_MAX_KEY_SIZE, &value, &value_len);
+        if (found != _model[i].present ||
+            (found && (value_len != BTREE_MAX_VALUE_SIZE || memcmp(value, _model[i].value, BTREE_MAX_VALUE_SIZE) != 0))) {
+            printf("get of key %u differs from the model\n", i);
+            return false;
+        }
+    }
+
+    uint16_t first = _check_random() % _check.keys_count;
+    uint16_t last = first + _check_random() % (_check.keys_count - first);
+    return _check_scan(0, _check.keys_count - 1) && _check_scan(first, last);
+}
+
+/**
+ * @brief Scans the keys between the sorted keys `first` and `last`, inclusive.
+ */
+bool _check_scan(uint16_t first, uint16_t last) {
+    CheckScan scan = {.next = first, .end = last + 1, .valid = true};
+    uint32_t visited = btree_scan(&_tree, _model[first].key, BTREE_MAX_KEY_SIZE, _model[last].key, BTREE_MAX_KEY_SIZE,
+                                  _check_scan_entry, &scan);
+
+    // Every present key left after the last visited entry was missed
+    for (; scan.valid && scan.next < scan.end; ++scan.next) {
+        scan.valid = !_model[scan.next].present;
+    }
+    if (!scan.valid) {
+        printf("scan of keys %u to %u differs from the model after %u entries\n", first, last, visited);
+    }
+    return scan.valid;
+}
+
+/**
+ * @brief Matches a scanned entry with the next present key of the model.
+ */
+bool _check_scan_entry(const uint8_t *key, uint8_t key_len, const uint8_t *value, uint8_t value_len, void *context) {
+    CheckScan *scan = (CheckScan *)context;
+    while (scan->next < scan->end && !_model[scan->next].present) {
+        scan->next++;
+    }
+
+    const CheckEntry *expected = scan->next < scan->end ? &_model[scan->next] : NULL;
+    scan->valid = expected != NULL && key_len == BTREE_MAX_KEY_SIZE && memcmp(key, expected->key, key_len) == 0 &&
+                  value_len == BTREE_MAX_VALUE_SIZE && memcmp(value, expected->value, value_len) == 0;
+    scan->next++;
+    return scan->valid;
+}
+
+int _check_compare_keys(const void *a, const void *b) {
+    return memcmp(((const CheckEntry *)a)->key, ((const CheckEntry *)b)->key, BTREE_MAX_KEY_SIZE);
+}
+
+// xorshift32
+uint32_t _check_random() {
+    _check_random_state ^= _check_random_state << 13;
+    _check_random_state ^= _check_random_state >> 17;
+    _check_random_state ^= _check_random_state << 5;
+    return _check_random_state;
+}
@@ -0,0 +1,230 @@
+/**
+ * @brief Power loss test of the record store (flash_records.h) on an emulated flash.
+ *
+ * *** Overview ***
+ * - Runs a workload of `--writes` random record writes on the flash emulated by
+ *   tools/host/flash_emu.c, from the same erased region every time, and cuts the power before its
+ *   first, second, ... `--points`th erase or program (see flash_emu_set_power_loss()).
+ * - After every cut, mounts the library and the store again and checks that every record holds its
+ *   last written version, or for the write that was cut, the version it was replacing.
+ * - Then writes `--after` more times to the first few records only, which advances the head over
+ *   the whole ring and reclaims every logical sector, remounts and checks every record again. A
+ *   record the mount did not recover, e.g. left behind by an interrupted reclaim, shows up there.
+ * - Reports the cut points that lost or corrupted a record, and fails if there is any.
+ *
+ * *** Build ***
+ *     gcc -O2 -Itools/host/include -Itools/host -Iinclude tools/flash_crash.c tools/host/flash_emu.c \
+ *         src/flash_lib.c src/flash_trace.c src/flash_records.c -o flash_crash
+ *
+ * *** Usage ***
+ *     flash_crash --sectors 3 --ids 24 --writes 400 --points 1500
+ */
+
+#include "flash_emu.h"
+#include "flash_records.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Records the writes after a cut go to, few enough that the others are only moved by reclaims
+#define CRASH_HOT_IDS 4
+
+typedef struct CrashConfig {
+    FlashLibConfig flash;
+    uint16_t sectors_count;
+    uint16_t ids_count;
+    uint32_t writes;
+    uint32_t after;
+    uint32_t points;
+    uint32_t seed;
+} CrashConfig;
+
+typedef struct CrashRecord {
+    int16_t length; // -1 if never written
+    uint8_t data[RECORDS_MAX_SIZE];
+} CrashRecord;
+
+CrashConfig _crash;
+RecordStore _store;
+uint32_t *_index;
+CrashRecord *_model;
+// Write in progress, which may or may not have made it to the flash
+uint16_t _pending_id;
+CrashRecord _pending;
+bool _pending_set;
+uint32_t _crash_random_state;
+jmp_buf _power_loss;
+
+void _crash_usage();
+bool _crash_parse_args(int argc, char **argv);
+void _crash_mount();
+void _crash_write(uint16_t ids_count, uint32_t count);
+int32_t _crash_check();
+void _crash_on_power_loss();
+uint32_t _crash_random();
+
+int main(int argc, char **argv) {
+    if (!_crash_parse_args(argc, argv)) {
+        _crash_usage();
+        return 1;
+    }
+
+    _index = (uint32_t *)malloc(_crash.ids_count * sizeof(uint32_t));
+    _model = (CrashRecord *)malloc(_crash.ids_count * sizeof(CrashRecord));
+    uint8_t *initial = (uint8_t *)malloc(PICO_FLASH_SIZE_BYTES);
+    flash_emu_reset(0xFF);
+    _crash_mount();
+    memcpy(initial, flash_emu_image, PICO_FLASH_SIZE_BYTES);
+
+    uint32_t failures = 0;
+    uint32_t cuts = 0;
+    for (uint32_t point = 0; point < _crash.points; ++point) {
+        memcpy(flash_emu_image, initial, PICO_FLASH_SIZE_BYTES);
+        for (uint16_t id = 0; id < _crash.ids_count; ++id) {
+            _model[id].length = -1;
+        }
+        _crash_mount();
+
+        _crash_random_state = _crash.seed;
+        if (setjmp(_power_loss) == 0) {
+            flash_emu_set_power_loss(point, _crash_on_power_loss);
+            _crash_write(_crash.ids_count, _crash.writes);
+            flash_emu_set_power_loss(0, NULL);
+            _pending_set = false;
+        } else {
+            cuts++;
+        }
+
+        _crash_mount();
+        int32_t lost = _crash_check();
+        if (lost < 0) {
+            _crash_write(CRASH_HOT_IDS < _crash.ids_count ? CRASH_HOT_IDS : _crash.ids_count, _crash.after);
+            _crash_mount();
+            lost = _crash_check();
+        }
+
+        if (lost >= 0) {
+            if (failures < 10) {
+                printf("power loss before operation %u: record %d lost\n", point, lost);
+            }
+            failures++;
+        }
+    }
+
+    printf("%u power losses, %u lost records\n", cuts, failures);
+    free(initial);
+    free(_model);
+    free(_index);
+    return failures > 0 ? 1 : 0;
+}
+
+void _crash_usage() {
+    fprintf(stderr, "usage: flash_crash [--lower N] [--group-by N] [--sectors N] [--ids N] [--writes N] [--after N]\n"
+                    "                   [--points N] [--seed N]\n");
+}
+
+bool _crash_parse_args(int argc, char **argv) {
+    _crash = (CrashConfig){
+        .flash = {.lower_bound = 256, .group_by = 1, .seed = 1},
+        .sectors_count = 3,
+        .ids_count = 24,
+        .writes = 400,
+        .after = 200,
+        .points = 1500,
+        .seed = 7,
+    };
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *value = argv[i + 1];
+        if (strcmp(argv[i], "--lower") == 0) {
+            _crash.flash.lower_bound = atoi(value);
+        } else if (strcmp(argv[i], "--group-by") == 0) {
+            _crash.flash.group_by = atoi(value);
+        } else if (strcmp(argv[i], "--sectors") == 0) {
+            _crash.sectors_count = atoi(value);
+        } else if (strcmp(argv[i], "--ids") == 0) {
+            _crash.ids_count = atoi(value);
+        } else if (strcmp(argv[i], "--writes") == 0) {
+            _crash.writes = atoi(value);
+        } else if (strcmp(argv[i], "--after") == 0) {
+            _crash.after = atoi(value);
+        } else if (strcmp(argv[i], "--points") == 0) {
+            _crash.points = atoi(value);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            _crash.seed = strtoul(value, NULL, 0);
+        } else {
+            return false;
+        }
+    }
+
+    // The store starts at logical sector 0 of the region
+    _crash.flash.logical_sectors_count = _crash.sectors_count;
+    return argc % 2 == 1 && _crash.sectors_count >= 2 && _crash.ids_count > 0 && _crash.flash.group_by > 0 &&
+           _crash.seed != 0;
+}
+
+/**
+ * @brief Runs the init of the library and of the store, as after a reset.
+ */
+void _crash_mount() {
+    init_flash_lib_with_config(&_crash.flash);
+    records_init(&_store, 0, _crash.sectors_count, _index, _crash.ids_count);
+}
+
+/**
+ * @brief Writes random payloads to random records below `ids_count`, updating the model.
+ */
+void _crash_write(uint16_t ids_count, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        _pending_id = _crash_random() % ids_count;
+        _pending.length = 16 + _crash_random() % (RECORDS_MAX_SIZE / 4);
+        for (int16_t j = 0; j < _pending.length; ++j) {
+            _pending.data[j] = _crash_random();
+        }
+
+        _pending_set = true;
+        if (records_write(&_store, _pending_id, _pending.data, _pending.length)) {
+            _model[_pending_id] = _pending;
+        }
+        _pending_set = false;
+    }
+}
+
+/**
+ * @brief Compares every record with the model. The record of a write cut by the power loss may
+ * hold either version, the model follows the one that was mounted.
+ *
+ * @return ID of the first record that differs, -1 if none.
+ */
+int32_t _crash_check() {
+    for (uint16_t id = 0; id < _crash.ids_count; ++id) {
+        const uint8_t *data;
+        uint16_t length;
+        bool found = records_read(&_store, id, &data, &length);
+        const CrashRecord *expected = &_model[id];
+        if (_pending_set && id == _pending_id && found && length == _pending.length &&
+            memcmp(data, _pending.data, length) == 0) {
+            _model[id] = _pending;
+            continue;
+        }
+
+        if (found != (expected->length >= 0) || (found && (length != expected->length || memcmp(data, expected->data, length) != 0))) {
+            return id;
+        }
+    }
+    _pending_set = false;
+    return -1;
+}
+
+void _crash_on_power_loss() {
+    longjmp(_power_loss, 1);
+}
+
+// xorshift32
+uint32_t _crash_random() {
+    _crash_random_state ^= _crash_random_state << 13;
+    _crash_random_state ^= _crash_random_state >> 17;
+    _crash_random_state ^= _crash_random_state << 5;
+    return _crash_random_state;
+}
@@ -0,0 +1,426 @@
+/**
+ * @brief Endurance and wear-leveling simulation of the library on an emulated flash.
+ *
+ * *** Overview ***
+ * - Drives a large number of logical sector rewrites through the real library code (allocation,
+ *   deferred erases, metadata log, transactions) on the flash emulated by tools/host/flash_emu.c.
+ * - Every rewrite replaces the content of one logical sector with `--size` bytes. With
+ *   `--mode inplace` it is erase_logical_sector() followed by write_sector(), with
+ *   `--mode transaction` it goes through a transaction, which moves the logical sector to a spare
+ *   group (requires `--spares`).
+ * - Access patterns, picking the logical sector of every rewrite:
+ *   - `uniform`: every logical sector with the same probability.
+ *   - `zipf`: Zipfian distribution of exponent `--zipf-s`, logical sector 0 being the hottest.
+ *   - `hotspot`: `--hot-share` of the rewrites go to the first `--hot-fraction` of the sectors.
+ *   - `append`: logical sectors rewritten in order, like a log.
+ *   - `static`: the first `--static-fraction` of the sectors are written once and never again,
+ *     the others are rewritten uniformly.
+ * - `--tier-slots` puts a front tier of that many logical sectors in RAM ahead of the flash, as a
+ *   stand-in for PSRAM or FRAM. Rewrites land in the tier and only the demotions reach the flash,
+ *   the tier is flushed at the end so every rewrite is accounted for.
+ * - `--allocator` selects the placement policy of the library (random, round-robin, least-worn,
+ *   wear-aware with `--hysteresis`), `--seed` seeds both the access pattern and the library.
+ * - Runs until `--writes` rewrites were done or the most erased physical sector of the region
+ *   (metadata included) reaches `--cycles` erases.
+ * - Reports the erase count distribution of the physical sectors, the number of rewrites until the
+ *   first sector reaches `--cycles` (extrapolated if the run stopped before) and the field life it
+ *   means at `--writes-per-day`, and the write amplification: bytes programmed and erased on the
+ *   flash per byte rewritten by the application. `--csv` saves the erase count of every sector.
+ *
+ * *** Build ***
+ *     gcc -O2 -Itools/host/include -Itools/host -Iinclude tools/flash_endurance.c \
+ *         tools/host/flash_emu.c src/flash_lib.c src/flash_trace.c -lm -o flash_endurance
+ *
+ * *** Usage ***
+ *     flash_endurance --pattern zipf --count 32 --group-by 1 --writes 2000000 --writes-per-day 5000
+ *     flash_endurance --pattern hotspot --mode transaction --spares 4 --allocator least-worn
+ *     flash_endurance --pattern zipf --count 32 --tier-slots 8
+ */
+
+#include "flash_emu.h"
+#include "flash_lib.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATTERN_UNIFORM 0
+#define PATTERN_ZIPF 1
+#define PATTERN_HOTSPOT 2
+#define PATTERN_APPEND 3
+#define PATTERN_STATIC 4
+
+typedef struct SimConfig {
+    FlashLibConfig flash;
+    uint8_t pattern;
+    bool transactions;
+    uint32_t size;
+    uint64_t writes;
+    uint32_t cycles;
+    uint32_t maintenance_every;
+    double writes_per_day;
+    double zipf_s;
+    double hot_fraction;
+    double hot_share;
+    double static_fraction;
+    uint64_t seed;
+    const char *csv_path;
+    uint16_t tier_slots;
+} SimConfig;
+
+SimConfig _sim = {
+    .flash = {.lower_bound = 256, .logical_sectors_count = 32, .group_by = 1, .spare_sectors_count = 0, .metadata_sectors_count = 0},
+    .pattern = PATTERN_UNIFORM,
+    .transactions = false,
+    .size = FLASH_SECTOR_SIZE,
+    .writes = 1000000,
+    .cycles = 100000,
+    .maintenance_every = 16,
+    .writes_per_day = 1000,
+    .zipf_s = 1.0,
+    .hot_fraction = 0.1,
+    .hot_share = 0.9,
+    .static_fraction = 0.8,
+    .seed = 1,
+    .csv_path = NULL,
+    .tier_slots = 0,
+};
+
+uint64_t _rng_state;
+double *_zipf_cdf = NULL;
+uint64_t _sim_writes_done = 0;
+FlashTier _sim_tier;
+
+uint64_t _sim_random() {
+    // xorshift64*, fixed seed so runs are reproducible
+    _rng_state ^= _rng_state >> 12;
+    _rng_state ^= _rng_state << 25;
+    _rng_state ^= _rng_state >> 27;
+    return _rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+double _sim_random_unit() {
+    return (_sim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void _sim_init_zipf() {
+    uint16_t count = _sim.flash.logical_sectors_count;
+    _zipf_cdf = (double *)malloc(count * sizeof(double));
+
+    double total = 0;
+    for (uint16_t i = 0; i < count; ++i) {
+        total += 1.0 / pow(i + 1, _sim.zipf_s);
+        _zipf_cdf[i] = total;
+    }
+    for (uint16_t i = 0; i < count; ++i) {
+        _zipf_cdf[i] /= total;
+    }
+}
+
+uint16_t _sim_next_logical_id() {
+    uint16_t count = _sim.flash.logical_sectors_count;
+
+    if (_sim.pattern == PATTERN_ZIPF) {
+        double value = _sim_random_unit();
+        uint16_t low = 0;
+        uint16_t high = count - 1;
+        while (low < high) {
+            uint16_t middle = (low + high) / 2;
+            if (_zipf_cdf[middle] < value) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    if (_sim.pattern == PATTERN_HOTSPOT) {
+        uint16_t hot_count = count * _sim.hot_fraction;
+        hot_count = hot_count == 0 ? 1 : hot_count;
+        if (_sim_random_unit() < _sim.hot_share || hot_count == count) {
+            return _sim_random() % hot_count;
+        }
+        return hot_count + _sim_random() % (count - hot_count);
+    }
+
+    if (_sim.pattern == PATTERN_APPEND) {
+        return _sim_writes_done % count;
+    }
+
+    if (_sim.pattern == PATTERN_STATIC) {
+        uint16_t static_count = count * _sim.static_fraction;
+        if (static_count >= count) {
+            static_count = count - 1;
+        }
+        return static_count + _sim_random() % (count - static_count);
+    }
+
+    return _sim_random() % count;
+}
+
+void _sim_rewrite(uint16_t logical_id, const uint8_t *data) {
+    if (!_sim.transactions) {
+        erase_logical_sector(logical_id);
+        write_sector(logical_id, 0, data, _sim.size);
+        return;
+    }
+
+    FlashTransaction transaction;
+    transaction_begin(&transaction);
+    if (!transaction_write(&transaction, logical_id, 0, data, _sim.size)) {
+        // Out of spare groups, the released ones are formatted first
+        transaction_abort(&transaction);
+        flash_lib_maintenance(_sim.flash.spare_sectors_count);
+        transaction_begin(&transaction);
+        transaction_write(&transaction, logical_id, 0, data, _sim.size);
+    }
+    transaction_commit(&transaction);
+}
+
+uint32_t _sim_first_sector() {
+    return _sim.flash.lower_bound;
+}
+
+uint32_t _sim_end_sector() {
+    uint32_t metadata_sectors = _sim.flash.metadata_sectors_count > 0 ? _sim.flash.metadata_sectors_count : FLASH_LIB_METADATA_SECTORS;
+    return _sim.flash.lower_bound + metadata_sectors + (_sim.flash.logical_sectors_count + _sim.flash.spare_sectors_count) * _sim.flash.group_by;
+}
+
+uint32_t _sim_max_erases() {
+    uint32_t max_erases = 0;
+    for (uint32_t sector = _sim_first_sector(); sector < _sim_end_sector(); ++sector) {
+        if (flash_emu_sector_erases[sector] > max_erases) {
+            max_erases = flash_emu_sector_erases[sector];
+        }
+    }
+    return max_erases;
+}
+
+void _sim_report(const FlashEmuStats *stats) {
+    uint32_t first_sector = _sim_first_sector();
+    uint32_t end_sector = _sim_end_sector();
+    uint32_t metadata_sectors = end_sector - first_sector - (_sim.flash.logical_sectors_count + _sim.flash.spare_sectors_count) * _sim.flash.group_by;
+    uint32_t sectors_count = end_sector - first_sector;
+
+    uint32_t min_erases = UINT32_MAX;
+    uint32_t max_erases = 0;
+    uint32_t max_sector = first_sector;
+    uint32_t metadata_max_erases = 0;
+    double total = 0;
+    double squares = 0;
+    for (uint32_t sector = first_sector; sector < end_sector; ++sector) {
+        uint32_t erases = flash_emu_sector_erases[sector];
+        total += erases;
+        squares += (double)erases * erases;
+        min_erases = erases < min_erases ? erases : min_erases;
+        if (erases > max_erases) {
+            max_erases = erases;
+            max_sector = sector;
+        }
+        if (sector < first_sector + metadata_sectors && erases > metadata_max_erases) {
+            metadata_max_erases = erases;
+        }
+    }
+    double mean = total / sectors_count;
+    double deviation = sqrt(squares / sectors_count - mean * mean);
+
+    printf("rewrites:            %llu of %u bytes\n", (unsigned long long)_sim_writes_done, _sim.size);
+    printf("sectors:             %u (%u metadata)\n", sectors_count, metadata_sectors);
+    printf("erases per sector:   min %u, mean %.1f, max %u (sector %u), stddev %.1f\n", min_erases, mean, max_erases, max_sector,
+           deviation);
+    printf("metadata max erases: %u\n", metadata_max_erases);
+    printf("wear evenness:       %.3f (mean / max, 1 is perfect)\n", max_erases > 0 ? mean / max_erases : 1.0);
+
+    // Histogram of the erase counts, 10 buckets from 0 to the max
+    uint32_t buckets[10] = {0};
+    for (uint32_t sector = first_sector; sector < end_sector; ++sector) {
+        uint32_t bucket = max_erases > 0 ? (uint64_t)flash_emu_sector_erases[sector] * 10 / (max_erases + 1) : 0;
+        buckets[bucket]++;
+    }
+    printf("histogram:\n");
+    for (uint8_t i = 0; i < 10; ++i) {
+        printf("  %8u - %-8u %u\n", (uint32_t)((uint64_t)(max_erases + 1) * i / 10), (uint32_t)((uint64_t)(max_erases + 1) * (i + 1) / 10),
+               buckets[i]);
+    }
+
+    double user_bytes = (double)_sim_writes_done * _sim.size;
+    double programmed_bytes = (double)stats->page_programs * FLASH_PAGE_SIZE;
+    double erased_bytes = (double)stats->sector_erases * FLASH_SECTOR_SIZE;
+    printf("write amplification: %.3f programmed, %.3f erased (bytes per byte rewritten)\n", programmed_bytes / user_bytes,
+           erased_bytes / user_bytes);
+
+    if (_sim.tier_slots > 0) {
+        FlashLibStats lib_stats;
+        get_flash_lib_stats(&lib_stats);
+        printf("front tier:          %u slots, %u demotions (%.3f per rewrite)\n", lib_stats.tier_slots_count,
+               lib_stats.tier_demotions, (double)lib_stats.tier_demotions / _sim_writes_done);
+    }
+
+    if (max_erases == 0) {
+        printf("first sector limit:  never reached, no erase was done\n");
+        return;
+    }
+
+    double writes_to_limit = (double)_sim_writes_done * _sim.cycles / max_erases;
+    const char *reached = max_erases >= _sim.cycles ? "reached" : "extrapolated";
+    printf("first sector limit:  %.0f rewrites to %u cycles (%s)\n", writes_to_limit, _sim.cycles, reached);
+    printf("field life:          %.1f years at %.0f rewrites per day\n", writes_to_limit / _sim.writes_per_day / 365.0, _sim.writes_per_day);
+
+    if (_sim.csv_path != NULL) {
+        FILE *csv = fopen(_sim.csv_path, "w");
+        if (csv == NULL) {
+            fprintf(stderr, "cannot write %s\n", _sim.csv_path);
+            return;
+        }
+        fprintf(csv, "sector,erases\n");
+        for (uint32_t sector = first_sector; sector < end_sector; ++sector) {
+            fprintf(csv, "%u,%u\n", sector, flash_emu_sector_erases[sector]);
+        }
+        fclose(csv);
+    }
+}
+
+bool _sim_parse_option(const char *name, const char *value) {
+    const char *patterns[] = {"uniform", "zipf", "hotspot", "append", "static"};
+    const char *allocators[] = {"random", "round-robin", "least-worn", "wear-aware"};
+
+    if (strcmp(name, "--pattern") == 0) {
+        for (uint8_t i = 0; i < 5; ++i) {
+            if (strcmp(value, patterns[i]) == 0) {
+                _sim.pattern = i;
+                return true;
+            }
+        }
+        return false;
+    } else if (strcmp(name, "--allocator") == 0) {
+        for (uint8_t i = 0; i < 4; ++i) {
+            if (strcmp(value, allocators[i]) == 0) {
+                _sim.flash.allocator = i;
+                return true;
+            }
+        }
+        return false;
+    } else if (strcmp(name, "--hysteresis") == 0) {
+        _sim.flash.wear_hysteresis = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--mode") == 0) {
+        _sim.transactions = strcmp(value, "transaction") == 0;
+        return _sim.transactions || strcmp(value, "inplace") == 0;
+    } else if (strcmp(name, "--lower") == 0) {
+        _sim.flash.lower_bound = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--count") == 0) {
+        _sim.flash.logical_sectors_count = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--group-by") == 0) {
+        _sim.flash.group_by = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--spares") == 0) {
+        _sim.flash.spare_sectors_count = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--metadata") == 0) {
+        _sim.flash.metadata_sectors_count = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--size") == 0) {
+        _sim.size = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--writes") == 0) {
+        _sim.writes = strtoull(value, NULL, 0);
+    } else if (strcmp(name, "--cycles") == 0) {
+        _sim.cycles = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--maintenance-every") == 0) {
+        _sim.maintenance_every = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--writes-per-day") == 0) {
+        _sim.writes_per_day = strtod(value, NULL);
+    } else if (strcmp(name, "--zipf-s") == 0) {
+        _sim.zipf_s = strtod(value, NULL);
+    } else if (strcmp(name, "--hot-fraction") == 0) {
+        _sim.hot_fraction = strtod(value, NULL);
+    } else if (strcmp(name, "--hot-share") == 0) {
+        _sim.hot_share = strtod(value, NULL);
+    } else if (strcmp(name, "--static-fraction") == 0) {
+        _sim.static_fraction = strtod(value, NULL);
+    } else if (strcmp(name, "--seed") == 0) {
+        _sim.seed = strtoull(value, NULL, 0);
+    } else if (strcmp(name, "--tier-slots") == 0) {
+        _sim.tier_slots = strtoul(value, NULL, 0);
+    } else if (strcmp(name, "--csv") == 0) {
+        _sim.csv_path = value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc || !_sim_parse_option(argv[i], argv[i + 1])) {
+            fprintf(stderr, "invalid option %s, see the header of %s for the options\n", argv[i], __FILE__);
+            return 1;
+        }
+    }
+
+    if (_sim.transactions && _sim.flash.spare_sectors_count == 0) {
+        fprintf(stderr, "--mode transaction requires --spares\n");
+        return 1;
+    }
+    if (_sim.size == 0 || _sim.size > FLASH_SECTOR_SIZE * _sim.flash.group_by) {
+        fprintf(stderr, "--size must be between 1 and the logical sector size\n");
+        return 1;
+    }
+    if (_sim_end_sector() > FLASH_EMU_SECTORS_COUNT) {
+        fprintf(stderr, "the region does not fit in the emulated flash\n");
+        return 1;
+    }
+
+    _rng_state = _sim.seed * 0x9E3779B97F4A7C15ULL + 1;
+    _sim.flash.seed = (uint32_t)_rng_state | 1;
+    if (_sim.pattern == PATTERN_ZIPF) {
+        _sim_init_zipf();
+    }
+
+    uint8_t *data = (uint8_t *)malloc(_sim.size);
+    for (uint32_t i = 0; i < _sim.size; ++i) {
+        data[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    if (_sim.tier_slots > 0) {
+        _sim_tier.size = FLASH_LIB_TIER_SIZE(_sim.tier_slots, FLASH_SECTOR_SIZE * _sim.flash.group_by);
+        _sim_tier.base = (uint8_t *)malloc(_sim_tier.size);
+        _sim.flash.tier = &_sim_tier;
+    }
+
+    flash_emu_reset(0xFF);
+    init_flash_lib_with_config(&_sim.flash);
+
+    if (_sim.pattern == PATTERN_STATIC) {
+        uint16_t static_count = _sim.flash.logical_sectors_count * _sim.static_fraction;
+        for (uint16_t logical_id = 0; logical_id < static_count; ++logical_id) {
+            write_sector(logical_id, 0, data, _sim.size);
+        }
+    }
+
+    // Erases done by the initialization are left out of the statistics
+    flash_emu_reset_stats();
+
+    uint32_t max_erases = 0;
+    while (_sim_writes_done < _sim.writes && max_erases < _sim.cycles) {
+        _sim_rewrite(_sim_next_logical_id(), data);
+        _sim_writes_done++;
+
+        if (_sim.maintenance_every > 0 && _sim_writes_done % _sim.maintenance_every == 0) {
+            flash_lib_maintenance(_sim.flash.logical_sectors_count);
+        }
+
+        // The max is only scanned from time to time, it moves slowly
+        if (_sim_writes_done % 1024 == 0) {
+            max_erases = _sim_max_erases();
+        }
+    }
+
+    if (_sim.tier_slots > 0) {
+        flash_lib_tier_flush(_sim.tier_slots);
+    }
+
+    FlashEmuStats stats;
+    flash_emu_get_stats(&stats);
+    _sim_report(&stats);
+
+    free(data);
+    free(_zipf_cdf);
+    return 0;
+}
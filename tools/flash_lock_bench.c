@@ -0,0 +1,246 @@
+/**
+ * @brief Contention benchmark of the reader/writer lock of the library, on the host with pthreads.
+ *
+ * *** Overview ***
+ * - Runs the library on the flash emulated by tools/host/flash_emu.c, built with FLASH_LIB_PTHREAD
+ *   so every API call takes the lock of flash_lock.h.
+ * - For 1, 2, 4 ... `--readers` reader threads, calls read_sector() on random logical sectors for
+ *   `--duration` milliseconds, first alone and then next to a writer thread that keeps rewriting
+ *   random logical sectors (erase_logical_sector(), write_sector() of `--size` bytes and
+ *   flash_lib_maintenance()).
+ * - The flash operations sleep for their modeled duration (see flash_emu_set_realtime()), so the
+ *   writer holds the lock as long as on the device. `--no-realtime` makes them instantaneous,
+ *   which measures the cost of the lock itself.
+ * - `--wait-free` makes the readers use flash_lib_lookup() instead of read_sector(), which takes
+ *   no lock and reports the lookups that were busy instead of waiting.
+ * - Reports the lookups per second, in total and per reader, the worst lookup latency, the share
+ *   of busy lookups and the rewrites per second of the writer.
+ *
+ * *** Build ***
+ *     gcc -O2 -DFLASH_LIB_PTHREAD -Itools/host/include -Itools/host -Iinclude tools/flash_lock_bench.c \
+ *         tools/host/flash_emu.c src/flash_lib.c src/flash_trace.c src/flash_lock.c -lpthread \
+ *         -o flash_lock_bench
+ *
+ * *** Usage ***
+ *     flash_lock_bench --readers 8 --duration 1000
+ */
+
+#include "flash_emu.h"
+#include "flash_lib.h"
+#include "flash_lock.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef FLASH_LIB_LOCKING
+#error "Build with -DFLASH_LIB_PTHREAD"
+#endif
+
+#define BENCH_MAX_READERS 64
+
+typedef struct BenchConfig {
+    FlashLibConfig flash;
+    uint16_t readers;
+    uint32_t duration_ms;
+    uint32_t size;
+    bool realtime;
+    bool wait_free;
+} BenchConfig;
+
+typedef struct BenchThread {
+    pthread_t thread;
+    uint32_t random_state;
+    uint64_t operations;
+    uint64_t busy;
+    uint64_t max_latency_ns;
+} BenchThread;
+
+BenchConfig _bench;
+volatile bool _bench_running;
+// Sink of the bytes read, so the reads are not optimized away
+volatile uint8_t _bench_sink;
+
+void _bench_usage();
+bool _bench_parse_args(int argc, char **argv);
+void _bench_run(uint16_t readers, bool writer);
+void *_bench_reader(void *param);
+void *_bench_writer(void *param);
+uint64_t _bench_now_ns();
+uint32_t _bench_random(uint32_t *state);
+
+int main(int argc, char **argv) {
+    if (!_bench_parse_args(argc, argv)) {
+        _bench_usage();
+        return 1;
+    }
+
+    flash_emu_reset(0xFF);
+    init_flash_lib_with_config(&_bench.flash);
+    flash_emu_set_realtime(_bench.realtime);
+
+    printf("%-8s %-7s %14s %14s %14s %8s %12s\n", "readers", "writer", "lookups/s", "per reader/s", "worst lookup", "busy",
+           "rewrites/s");
+    for (uint16_t readers = 1; readers <= _bench.readers; readers *= 2) {
+        _bench_run(readers, false);
+        _bench_run(readers, true);
+    }
+
+    return 0;
+}
+
+void _bench_usage() {
+    fprintf(stderr, "usage: flash_lock_bench [--readers N] [--duration MS] [--count N] [--group-by N]\n"
+                    "                        [--size BYTES] [--no-realtime] [--wait-free]\n");
+}
+
+bool _bench_parse_args(int argc, char **argv) {
+    _bench = (BenchConfig){
+        .flash = {.lower_bound = 256, .logical_sectors_count = 64, .group_by = 1, .seed = 1},
+        .readers = 8,
+        .duration_ms = 1000,
+        .size = 256,
+        .realtime = true,
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--no-realtime") == 0) {
+            _bench.realtime = false;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--wait-free") == 0) {
+            _bench.wait_free = true;
+            continue;
+        }
+
+        if (value == NULL) {
+            return false;
+        }
+
+        if (strcmp(argv[i], "--readers") == 0) {
+            _bench.readers = atoi(value);
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            _bench.duration_ms = atoi(value);
+        } else if (strcmp(argv[i], "--count") == 0) {
+            _bench.flash.logical_sectors_count = atoi(value);
+        } else if (strcmp(argv[i], "--group-by") == 0) {
+            _bench.flash.group_by = atoi(value);
+        } else if (strcmp(argv[i], "--size") == 0) {
+            _bench.size = atoi(value);
+        } else {
+            return false;
+        }
+        i++;
+    }
+
+    return _bench.readers > 0 && _bench.readers <= BENCH_MAX_READERS && _bench.flash.logical_sectors_count > 0 &&
+           _bench.flash.group_by > 0 && _bench.size > 0 && _bench.size <= _bench.flash.group_by * FLASH_SECTOR_SIZE;
+}
+
+/**
+ * @brief Runs `readers` reader threads, and a writer thread if `writer`, for the configured duration
+ * and prints one line of results.
+ */
+void _bench_run(uint16_t readers, bool writer) {
+    BenchThread reader_threads[BENCH_MAX_READERS];
+    BenchThread writer_thread = {.random_state = 0x9E3779B9};
+
+    _bench_running = true;
+    for (uint16_t i = 0; i < readers; ++i) {
+        reader_threads[i] = (BenchThread){.random_state = 2654435761u * (i + 1)};
+        pthread_create(&reader_threads[i].thread, NULL, _bench_reader, &reader_threads[i]);
+    }
+    if (writer) {
+        pthread_create(&writer_thread.thread, NULL, _bench_writer, &writer_thread);
+    }
+
+    struct timespec duration = {_bench.duration_ms / 1000, _bench.duration_ms % 1000 * 1000000L};
+    nanosleep(&duration, NULL);
+    _bench_running = false;
+
+    uint64_t lookups = 0;
+    uint64_t busy = 0;
+    uint64_t max_latency_ns = 0;
+    for (uint16_t i = 0; i < readers; ++i) {
+        pthread_join(reader_threads[i].thread, NULL);
+        lookups += reader_threads[i].operations;
+        busy += reader_threads[i].busy;
+        if (reader_threads[i].max_latency_ns > max_latency_ns) {
+            max_latency_ns = reader_threads[i].max_latency_ns;
+        }
+    }
+    if (writer) {
+        pthread_join(writer_thread.thread, NULL);
+    }
+
+    double seconds = _bench.duration_ms / 1000.0;
+    printf("%-8u %-7s %14.0f %14.0f %11.1f us %7.3f%% %12.1f\n", readers, writer ? "yes" : "no", lookups / seconds,
+           lookups / seconds / readers, max_latency_ns / 1000.0, lookups > 0 ? 100.0 * busy / lookups : 0.0,
+           writer_thread.operations / seconds);
+}
+
+void *_bench_reader(void *param) {
+    BenchThread *thread = (BenchThread *)param;
+    uint8_t sink = 0;
+
+    while (_bench_running) {
+        uint16_t logical_id = _bench_random(&thread->random_state) % _bench.flash.logical_sectors_count;
+
+        uint64_t start = _bench_now_ns();
+        if (_bench.wait_free) {
+            const uint8_t *data;
+            if (flash_lib_lookup(logical_id, 0, &data) == FLASH_LOOKUP_OK) {
+                sink ^= *data;
+            } else {
+                thread->busy++;
+            }
+        } else {
+            sink ^= *read_sector(logical_id, 0);
+        }
+        uint64_t latency = _bench_now_ns() - start;
+
+        if (latency > thread->max_latency_ns) {
+            thread->max_latency_ns = latency;
+        }
+        thread->operations++;
+    }
+
+    _bench_sink = sink;
+    return NULL;
+}
+
+void *_bench_writer(void *param) {
+    BenchThread *thread = (BenchThread *)param;
+    uint8_t *data = (uint8_t *)malloc(_bench.size);
+
+    while (_bench_running) {
+        uint16_t logical_id = _bench_random(&thread->random_state) % _bench.flash.logical_sectors_count;
+        memset(data, (uint8_t)thread->operations, _bench.size);
+
+        erase_logical_sector(logical_id);
+        write_sector(logical_id, 0, data, _bench.size);
+        flash_lib_maintenance(1);
+        thread->operations++;
+    }
+
+    free(data);
+    return NULL;
+}
+
+uint64_t _bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// xorshift32, one state per thread
+uint32_t _bench_random(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
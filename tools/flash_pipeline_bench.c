@@ -0,0 +1,214 @@
+/**
+ * @brief Write throughput of sequential and pipelined bulk writes, on the host with pthreads.
+ *
+ * *** Overview ***
+ * - Runs the library on the flash emulated by tools/host/flash_emu.c, with the flash operations
+ *   sleeping for their modeled duration (see flash_emu_set_realtime()).
+ * - Every page is prepared before being programmed: generated, CRC-32 computed, then `--prepare-us`
+ *   microseconds of busy work that stand for a compression.
+ * - `sequential` prepares a page then programs it with write_sector(), one after the other.
+ * - `polled` uses flash_lib_start_pipelined_write() from a single thread and prepares the next
+ *   pages between the polls, as firmware without core1 would.
+ * - `core1` prepares the pages in a producer thread, standing for core1, while the main thread
+ *   polls. The preparation overlaps the programs, so the throughput approaches the program
+ *   bandwidth of the flash as long as a page is prepared faster than it is programmed.
+ * - Each write fills `--size` bytes of an erased logical sector, the erases are not timed.
+ *
+ * *** Build ***
+ *     gcc -O2 -Itools/host/include -Itools/host -Iinclude tools/flash_pipeline_bench.c \
+ *         tools/host/flash_emu.c src/flash_lib.c src/flash_trace.c -lpthread -o flash_pipeline_bench
+ *
+ * *** Usage ***
+ *     flash_pipeline_bench --size 65536 --writes 4 --prepare-us 300
+ */
+
+#include "flash_emu.h"
+#include "flash_lib.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct BenchConfig {
+    uint32_t size;
+    uint32_t writes;
+    uint32_t prepare_us;
+} BenchConfig;
+
+BenchConfig _bench;
+FlashPipeline _pipeline;
+uint32_t _bench_random_state = 1;
+// Sink of the CRCs, so the preparation is not optimized away
+volatile uint32_t _bench_sink;
+
+void _bench_usage();
+bool _bench_parse_args(int argc, char **argv);
+void _bench_prepare(uint8_t *buffer, uint32_t count);
+double _bench_sequential();
+double _bench_polled();
+double _bench_core1();
+void *_bench_producer(void *param);
+void _bench_erase();
+uint32_t _bench_crc32(const uint8_t *data, uint32_t count);
+uint64_t _bench_now_us();
+void _bench_print(const char *mode, double seconds);
+
+int main(int argc, char **argv) {
+    if (!_bench_parse_args(argc, argv)) {
+        _bench_usage();
+        return 1;
+    }
+
+    uint8_t group_by = (_bench.size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    FlashLibConfig config = {.lower_bound = 64, .logical_sectors_count = 2, .group_by = group_by, .seed = 1};
+    flash_emu_reset(0xFF);
+    init_flash_lib_with_config(&config);
+    flash_emu_set_realtime(true);
+
+    printf("%-12s %12s %12s\n", "mode", "KB/s", "bandwidth");
+    _bench_print("sequential", _bench_sequential());
+    _bench_print("polled", _bench_polled());
+    _bench_print("core1", _bench_core1());
+    return 0;
+}
+
+void _bench_usage() {
+    fprintf(stderr, "usage: flash_pipeline_bench [--size BYTES] [--writes N] [--prepare-us N]\n");
+}
+
+bool _bench_parse_args(int argc, char **argv) {
+    _bench = (BenchConfig){.size = 65536, .writes = 4, .prepare_us = 300};
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--size") == 0) {
+            _bench.size = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--writes") == 0) {
+            _bench.writes = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--prepare-us") == 0) {
+            _bench.prepare_us = atoi(argv[i + 1]);
+        } else {
+            return false;
+        }
+    }
+
+    return argc % 2 == 1 && _bench.size > 0 && _bench.size <= 255 * FLASH_SECTOR_SIZE && _bench.writes > 0;
+}
+
+/**
+ * @brief Generates a page, computes its CRC and spins for the modeled compression.
+ */
+void _bench_prepare(uint8_t *buffer, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        _bench_random_state ^= _bench_random_state << 13;
+        _bench_random_state ^= _bench_random_state >> 17;
+        _bench_random_state ^= _bench_random_state << 5;
+        buffer[i] = _bench_random_state;
+    }
+    _bench_sink = _bench_crc32(buffer, count);
+
+    uint64_t end = _bench_now_us() + _bench.prepare_us;
+    while (_bench_now_us() < end) {
+    }
+}
+
+double _bench_sequential() {
+    uint8_t page[FLASH_PAGE_SIZE];
+    uint64_t busy_us = 0;
+
+    for (uint32_t write = 0; write < _bench.writes; ++write) {
+        _bench_erase();
+        uint64_t start = _bench_now_us();
+        for (uint32_t offset = 0; offset < _bench.size; offset += FLASH_PAGE_SIZE) {
+            uint32_t count = _bench.size - offset < FLASH_PAGE_SIZE ? _bench.size - offset : FLASH_PAGE_SIZE;
+            _bench_prepare(page, count);
+            write_sector(0, offset, page, count);
+        }
+        busy_us += _bench_now_us() - start;
+    }
+    return busy_us / 1e6;
+}
+
+double _bench_polled() {
+    uint64_t busy_us = 0;
+
+    for (uint32_t write = 0; write < _bench.writes; ++write) {
+        _bench_erase();
+        uint64_t start = _bench_now_us();
+        flash_lib_start_pipelined_write(0, 0, _bench.size, &_pipeline);
+        do {
+            uint32_t count;
+            uint8_t *buffer = flash_pipeline_acquire(&_pipeline, &count);
+            if (buffer != NULL) {
+                _bench_prepare(buffer, count);
+                flash_pipeline_submit(&_pipeline);
+            }
+        } while (flash_lib_poll(NULL) != FLASH_POLL_DONE);
+        busy_us += _bench_now_us() - start;
+    }
+    return busy_us / 1e6;
+}
+
+double _bench_core1() {
+    uint64_t busy_us = 0;
+
+    for (uint32_t write = 0; write < _bench.writes; ++write) {
+        _bench_erase();
+        uint64_t start = _bench_now_us();
+        flash_lib_start_pipelined_write(0, 0, _bench.size, &_pipeline);
+
+        pthread_t producer;
+        pthread_create(&producer, NULL, _bench_producer, NULL);
+        while (flash_lib_poll(NULL) != FLASH_POLL_DONE) {
+        }
+        pthread_join(producer, NULL);
+        busy_us += _bench_now_us() - start;
+    }
+    return busy_us / 1e6;
+}
+
+void *_bench_producer(void *param) {
+    (void)param;
+    while (_pipeline.submitted_bytes < _pipeline.count) {
+        uint32_t count;
+        uint8_t *buffer = flash_pipeline_acquire(&_pipeline, &count);
+        if (buffer == NULL) {
+            continue;
+        }
+        _bench_prepare(buffer, count);
+        flash_pipeline_submit(&_pipeline);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Erases logical sector 0 outside of the measures.
+ */
+void _bench_erase() {
+    erase_logical_sector(0);
+    flash_lib_maintenance(0xFFFF);
+}
+
+// Bitwise CRC-32 (IEEE), as small firmware without a table would compute it
+uint32_t _bench_crc32(const uint8_t *data, uint32_t count) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < count; ++i) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+            crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+uint64_t _bench_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000u + now.tv_nsec / 1000;
+}
+
+void _bench_print(const char *mode, double seconds) {
+    double bytes_per_s = (double)_bench.size * _bench.writes / seconds;
+    double bandwidth = (double)FLASH_PAGE_SIZE * 1e6 / FLASH_EMU_PAGE_PROGRAM_US;
+    printf("%-12s %12.1f %11.1f%%\n", mode, bytes_per_s / 1024, 100.0 * bytes_per_s / bandwidth);
+}
@@ -0,0 +1,352 @@
+/**
+ * @brief Replays a trace recorded with FLASH_LIB_TRACE against the library on an emulated flash.
+ *
+ * *** Overview ***
+ * - Reads the "FLT" lines printed by flash_trace_drain(), from a captured serial log or any text
+ *   file, other lines are ignored. Every API call of the trace is run again, in order, on the flash
+ *   emulated by tools/host/flash_emu.c. Writes replay the same ranges with a fixed pattern.
+ * - Reports, per operation, the erases, programs and time recorded on the device next to the ones
+ *   of the replay, and the wear of the region at the end. Changes to the library (allocator, erase
+ *   strategy, ...) can then be compared on real workloads by replaying the same trace.
+ * - The configuration comes from the init entries of the trace. Options override it, to compare
+ *   configurations, or provide it when the trace starts after the init.
+ * - The front tier of the device is not part of the trace either, its writes replay on the flash.
+ * - `--allocator` (0 random, 1 round-robin, 2 least-worn, 3 wear-aware) and `--seed` select the
+ *   placement policy of the replay, the device settings are not part of the trace.
+ * - Rewrites that were skipped on the device replay the current content of the logical sector, and
+ *   the others a pattern changed at every call, so `--hashes 1` (content_hashes of the device,
+ *   not part of the trace) reproduces the skips.
+ * - The replay starts from an erased flash, or from an image dumped from the device with --image,
+ *   and the final image can be saved with --save.
+ *
+ * *** Build ***
+ *     gcc -O2 -DFLASH_LIB_TRACE -Itools/host/include -Itools/host -Iinclude tools/flash_replay.c \
+ *         tools/host/flash_emu.c src/flash_lib.c src/flash_trace.c -o flash_replay
+ *
+ * *** Usage ***
+ *     flash_replay [--image in.bin] [--save out.bin] [--lower N] [--count N] [--group-by N]
+ *                  [--spares N] [--metadata N] [--allocator N] [--seed N] [--hashes 0|1] trace.txt
+ */
+
+#include "flash_emu.h"
+#include "flash_lib.h"
+#include "flash_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OPS_COUNT 14
+#define NOT_SET 0xFFFFFFFF
+
+typedef struct OpReport {
+    uint32_t count;
+    uint64_t recorded_us;
+    uint32_t recorded_max_us;
+    uint64_t recorded_erases;
+    uint64_t recorded_programs;
+    uint64_t replayed_us;
+    uint32_t replayed_max_us;
+    uint64_t replayed_erases;
+    uint64_t replayed_programs;
+} OpReport;
+
+const char *_op_names[OPS_COUNT] = {
+    "", "init", "write", "erase_logical", "erase_physical", "maintenance", "txn_begin", "txn_write", "txn_commit", "txn_abort",
+    "rewrite", "tier_flush", "power_flush", "scrub",
+};
+
+OpReport _reports[OPS_COUNT];
+FlashLibConfig _config;
+uint32_t _overrides[8] = {NOT_SET, NOT_SET, NOT_SET, NOT_SET, NOT_SET, NOT_SET, NOT_SET, NOT_SET};
+bool _initialized = false;
+FlashTransaction _transaction;
+
+// Flash operations recorded since the previous API entry, they belong to the next one
+uint64_t _replay_pending_erases = 0;
+uint64_t _replay_pending_programs = 0;
+
+void _apply_overrides() {
+    if (_overrides[0] != NOT_SET) {
+        _config.lower_bound = _overrides[0];
+    }
+    if (_overrides[1] != NOT_SET) {
+        _config.logical_sectors_count = _overrides[1];
+    }
+    if (_overrides[2] != NOT_SET) {
+        _config.group_by = _overrides[2];
+    }
+    if (_overrides[3] != NOT_SET) {
+        _config.spare_sectors_count = _overrides[3];
+    }
+    if (_overrides[4] != NOT_SET) {
+        _config.metadata_sectors_count = _overrides[4];
+    }
+    if (_overrides[5] != NOT_SET) {
+        _config.allocator = _overrides[5];
+    }
+    if (_overrides[6] != NOT_SET) {
+        _config.seed = _overrides[6];
+    }
+    if (_overrides[7] != NOT_SET) {
+        _config.content_hashes = _overrides[7] != 0;
+    }
+}
+
+void _replay_rewrite(const FlashTraceEntry *entry) {
+    static uint32_t rewrites = 0;
+    uint8_t *content = (uint8_t *)malloc(entry->length);
+
+    if (entry->arg == 0) {
+        // One physical sector at a time, a blank logical sector reads from a single blank sector
+        for (uint32_t offset = 0; offset < entry->length; offset += FLASH_SECTOR_SIZE) {
+            uint32_t count = entry->length - offset < FLASH_SECTOR_SIZE ? entry->length - offset : FLASH_SECTOR_SIZE;
+            memcpy(content + offset, read_sector(entry->logical_id, offset), count);
+        }
+    } else {
+        rewrites++;
+        for (uint32_t i = 0; i < entry->length; ++i) {
+            content[i] = (uint8_t)(i * 31 + 7 + rewrites);
+        }
+    }
+
+    rewrite_sector(entry->logical_id, content, entry->length, 0);
+    free(content);
+}
+
+bool _replay_entry(const FlashTraceEntry *entry) {
+    static uint8_t *data = NULL;
+    static uint32_t data_size = 0;
+    if (entry->length > data_size && entry->op != FLASH_OP_INIT && entry->op != FLASH_OP_MAINTENANCE &&
+        entry->op != FLASH_OP_TIER_FLUSH && entry->op != FLASH_OP_POWER_LOSS_FLUSH && entry->op != FLASH_OP_SCRUB) {
+        data_size = entry->length;
+        data = (uint8_t *)realloc(data, data_size);
+        for (uint32_t i = 0; i < data_size; ++i) {
+            data[i] = (uint8_t)(i * 31 + 7);
+        }
+    }
+
+    if (entry->op == FLASH_OP_INIT) {
+        _config.lower_bound = entry->offset;
+        _config.logical_sectors_count = entry->logical_id;
+        _config.group_by = entry->arg;
+        _config.spare_sectors_count = entry->length & 0xFFFF;
+        _config.metadata_sectors_count = entry->length >> 16;
+        _apply_overrides();
+        init_flash_lib_with_config(&_config);
+        _initialized = true;
+        return true;
+    }
+
+    if (!_initialized) {
+        if (_overrides[0] == NOT_SET || _overrides[1] == NOT_SET || _overrides[2] == NOT_SET) {
+            fprintf(stderr, "The trace does not start with an init, --lower, --count and --group-by are required\n");
+            exit(1);
+        }
+        _config.spare_sectors_count = 0;
+        _config.metadata_sectors_count = 0;
+        _apply_overrides();
+        init_flash_lib_with_config(&_config);
+        _initialized = true;
+    }
+
+    switch (entry->op) {
+    case FLASH_OP_WRITE:
+        write_sector(entry->logical_id, entry->offset, data, entry->length);
+        return true;
+    case FLASH_OP_ERASE_LOGICAL:
+        erase_logical_sector(entry->logical_id);
+        return true;
+    case FLASH_OP_ERASE_PHYSICAL:
+        erase_physical_sector(entry->logical_id, entry->arg);
+        return true;
+    case FLASH_OP_MAINTENANCE:
+        flash_lib_maintenance(entry->length);
+        return true;
+    case FLASH_OP_TRANSACTION_BEGIN:
+        transaction_begin(&_transaction);
+        return true;
+    case FLASH_OP_TRANSACTION_WRITE:
+        transaction_write(&_transaction, entry->logical_id, entry->offset, data, entry->length);
+        return true;
+    case FLASH_OP_TRANSACTION_COMMIT:
+        transaction_commit(&_transaction);
+        return true;
+    case FLASH_OP_TRANSACTION_ABORT:
+        transaction_abort(&_transaction);
+        return true;
+    case FLASH_OP_REWRITE:
+        _replay_rewrite(entry);
+        return true;
+    case FLASH_OP_TIER_FLUSH:
+        flash_lib_tier_flush(entry->length);
+        return true;
+    case FLASH_OP_POWER_LOSS_FLUSH:
+        flash_lib_flush_for_power_loss(entry->length);
+        return true;
+    case FLASH_OP_SCRUB:
+        flash_lib_scrub(entry->length);
+        return true;
+    }
+    return false;
+}
+
+void _process_entry(const FlashTraceEntry *entry) {
+    if (entry->op == FLASH_OP_FLASH_ERASE) {
+        _replay_pending_erases += entry->length / FLASH_SECTOR_SIZE;
+        return;
+    }
+    if (entry->op == FLASH_OP_FLASH_PROGRAM) {
+        _replay_pending_programs += (entry->length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+        return;
+    }
+    if (entry->op >= OPS_COUNT) {
+        return;
+    }
+
+    FlashEmuStats before;
+    FlashEmuStats after;
+    flash_emu_get_stats(&before);
+    uint64_t start = time_us_64();
+    if (!_replay_entry(entry)) {
+        return;
+    }
+    uint32_t elapsed = time_us_64() - start;
+    flash_emu_get_stats(&after);
+
+    OpReport *report = &_reports[entry->op];
+    report->count++;
+    report->recorded_us += entry->duration;
+    report->recorded_max_us = entry->duration > report->recorded_max_us ? entry->duration : report->recorded_max_us;
+    report->recorded_erases += _replay_pending_erases;
+    report->recorded_programs += _replay_pending_programs;
+    report->replayed_us += elapsed;
+    report->replayed_max_us = elapsed > report->replayed_max_us ? elapsed : report->replayed_max_us;
+    report->replayed_erases += after.sector_erases - before.sector_erases;
+    report->replayed_programs += after.page_programs - before.page_programs;
+    _replay_pending_erases = 0;
+    _replay_pending_programs = 0;
+}
+
+void _print_report() {
+    printf("%-15s %8s | %12s %10s %10s %10s | %12s %10s %10s %10s\n", "operation", "count", "rec avg us", "rec max us", "rec erases",
+           "rec progs", "rep avg us", "rep max us", "rep erases", "rep progs");
+    for (uint8_t op = 1; op < OPS_COUNT; ++op) {
+        OpReport *report = &_reports[op];
+        if (report->count == 0) {
+            continue;
+        }
+        printf("%-15s %8u | %12llu %10u %10llu %10llu | %12llu %10u %10llu %10llu\n", _op_names[op], report->count,
+               (unsigned long long)(report->recorded_us / report->count), report->recorded_max_us,
+               (unsigned long long)report->recorded_erases, (unsigned long long)report->recorded_programs,
+               (unsigned long long)(report->replayed_us / report->count), report->replayed_max_us,
+               (unsigned long long)report->replayed_erases, (unsigned long long)report->replayed_programs);
+    }
+
+    if (!_initialized) {
+        return;
+    }
+
+    uint32_t metadata_sectors = _config.metadata_sectors_count > 0 ? _config.metadata_sectors_count : FLASH_LIB_METADATA_SECTORS;
+    uint32_t first_sector = _config.lower_bound;
+    uint32_t end_sector = first_sector + metadata_sectors +
+                          (_config.logical_sectors_count + _config.spare_sectors_count) * _config.group_by;
+    uint64_t total = 0;
+    uint32_t max_sector = first_sector;
+    for (uint32_t sector = first_sector; sector < end_sector; ++sector) {
+        total += flash_emu_sector_erases[sector];
+        if (flash_emu_sector_erases[sector] > flash_emu_sector_erases[max_sector]) {
+            max_sector = sector;
+        }
+    }
+    printf("\nwear: %llu erases over %u sectors, mean %.2f, max %u (sector %u)\n", (unsigned long long)total,
+           end_sector - first_sector, (double)total / (end_sector - first_sector), flash_emu_sector_erases[max_sector], max_sector);
+}
+
+int main(int argc, char **argv) {
+    const char *image_path = NULL;
+    const char *save_path = NULL;
+    const char *trace_path = NULL;
+    const char *options[8] = {"--lower", "--count", "--group-by", "--spares", "--metadata", "--allocator", "--seed", "--hashes"};
+
+    for (int i = 1; i < argc; ++i) {
+        bool matched = false;
+        for (uint8_t option = 0; option < 8 && i + 1 < argc; ++option) {
+            if (strcmp(argv[i], options[option]) == 0) {
+                _overrides[option] = strtoul(argv[++i], NULL, 0);
+                matched = true;
+            }
+        }
+
+        if (matched) {
+            continue;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else {
+            trace_path = argv[i];
+        }
+    }
+
+    if (trace_path == NULL) {
+        fprintf(stderr, "usage: %s [--image in.bin] [--save out.bin] [--lower N] [--count N] [--group-by N] "
+                        "[--spares N] [--metadata N] [--allocator N] [--seed N] [--hashes 0|1] trace.txt\n", argv[0]);
+        return 1;
+    }
+
+    FILE *trace = strcmp(trace_path, "-") == 0 ? stdin : fopen(trace_path, "r");
+    if (trace == NULL) {
+        fprintf(stderr, "cannot open %s\n", trace_path);
+        return 1;
+    }
+
+    flash_emu_reset(0xFF);
+    if (image_path != NULL && !flash_emu_load(image_path)) {
+        fprintf(stderr, "cannot load %s\n", image_path);
+        return 1;
+    }
+
+    char line[256];
+    uint32_t dropped = 0;
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        char *marker = strstr(line, "FLT");
+        unsigned long count;
+        if (marker != NULL && sscanf(marker, "FLT-DROPPED %lu", &count) == 1) {
+            dropped += count;
+            continue;
+        }
+
+        unsigned op, arg, logical_id;
+        unsigned long offset, length, timestamp, duration;
+        if (marker == NULL ||
+            sscanf(marker, "FLT %u %u %u %lu %lu %lu %lu", &op, &arg, &logical_id, &offset, &length, &timestamp, &duration) != 7) {
+            continue;
+        }
+
+        FlashTraceEntry entry = {
+            .timestamp = timestamp,
+            .duration = duration,
+            .offset = offset,
+            .length = length,
+            .logical_id = logical_id,
+            .op = op,
+            .arg = arg,
+        };
+        _process_entry(&entry);
+    }
+
+    if (trace != stdin) {
+        fclose(trace);
+    }
+
+    if (dropped > 0) {
+        printf("warning: %u entries were dropped on the device, drain the trace more often\n\n", dropped);
+    }
+    _print_report();
+
+    if (save_path != NULL && !flash_emu_save(save_path)) {
+        fprintf(stderr, "cannot save %s\n", save_path);
+        return 1;
+    }
+    return 0;
+}
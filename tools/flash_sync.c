@@ -0,0 +1,311 @@
+/**
+ * @brief Incremental backup of a region with the Merkle tree of the library, against a local
+ * stand-in for the backup peer, on the host.
+ *
+ * *** Overview ***
+ * - The device is the library with `merkle_tree` set, on the flash emulated by
+ *   tools/host/flash_emu.c, or on an image dumped from a device with --image.
+ * - The peer stands in for the gateway: it keeps a copy of every logical sector and the tree nodes
+ *   it got from the device at the previous sync. It starts empty, which matches a blank region.
+ * - A sync walks the tree of the device from the root and only descends into the nodes whose digest
+ *   differs from the copy of the peer, then transfers the logical sectors whose leaf differs. Its
+ *   cost scales with the number of changed logical sectors, not with the size of the region.
+ * - Each round changes `--changes` random logical sectors (rewrites, appends and erases), syncs,
+ *   and checks the copy of the peer against the device, byte for byte. `--reinit` initializes the
+ *   library again before every sync, so the tree comes from the metadata persisted in flash.
+ * - Reports, per sync, the nodes compared, the logical sectors and bytes transferred, and the
+ *   share of a full transfer of the region.
+ *
+ * *** Build ***
+ *     gcc -O2 -Itools/host/include -Itools/host -Iinclude tools/flash_sync.c tools/host/flash_emu.c \
+ *         src/flash_lib.c src/flash_trace.c -o flash_sync
+ *
+ * *** Usage ***
+ *     flash_sync [--image in.bin] [--lower N] [--count N] [--group-by N] [--rounds N]
+ *                [--changes N] [--seed N] [--reinit]
+ */
+
+#include "flash_emu.h"
+#include "flash_lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Protocol overhead of every node or logical sector requested from the device
+#define SYNC_REQUEST_BYTES 8
+
+typedef struct SyncConfig {
+    FlashLibConfig flash;
+    const char *image_path;
+    uint32_t rounds;
+    uint32_t changes;
+    uint32_t random_state;
+    bool reinit;
+} SyncConfig;
+
+typedef struct SyncPeer {
+    uint32_t *nodes;   // Tree nodes of the device at the previous sync
+    uint8_t *sectors;  // Copy of every logical sector
+} SyncPeer;
+
+typedef struct SyncReport {
+    uint32_t nodes;
+    uint32_t sectors;
+    uint64_t bytes;
+} SyncReport;
+
+SyncConfig _sync;
+SyncPeer _peer;
+// Bytes written to every logical sector since its last erase, appends go after them
+uint32_t *_fill;
+
+void _sync_usage();
+bool _sync_parse_args(int argc, char **argv);
+void _sync_run(SyncReport *report);
+bool _sync_check();
+void _sync_change();
+void _sync_print(const char *label, const SyncReport *report);
+void _sync_read(uint16_t logical_id, uint8_t *buffer);
+uint32_t _sync_random();
+
+int main(int argc, char **argv) {
+    if (!_sync_parse_args(argc, argv)) {
+        _sync_usage();
+        return 1;
+    }
+
+    flash_emu_reset(0xFF);
+    if (_sync.image_path != NULL && !flash_emu_load(_sync.image_path)) {
+        fprintf(stderr, "cannot load %s\n", _sync.image_path);
+        return 1;
+    }
+    init_flash_lib_with_config(&_sync.flash);
+
+    uint32_t sector_size = get_logical_sector_size();
+    _peer.nodes = (uint32_t *)calloc(2 * flash_lib_get_merkle_leaves(), sizeof(uint32_t));
+    _peer.sectors = (uint8_t *)malloc(_sync.flash.logical_sectors_count * sector_size);
+    memset(_peer.sectors, 0xFF, _sync.flash.logical_sectors_count * sector_size);
+    _fill = (uint32_t *)calloc(_sync.flash.logical_sectors_count, sizeof(uint32_t));
+
+    printf("%-8s %10s %10s %14s %10s\n", "sync", "nodes", "sectors", "bytes", "of full");
+
+    // The first sync transfers whatever the region already holds
+    SyncReport report;
+    _sync_run(&report);
+    _sync_print("initial", &report);
+    if (!_sync_check()) {
+        return 1;
+    }
+
+    SyncReport total = {0};
+    for (uint32_t round = 0; round < _sync.rounds; ++round) {
+        for (uint32_t i = 0; i < _sync.changes; ++i) {
+            _sync_change();
+        }
+
+        if (_sync.reinit) {
+            uint32_t root;
+            flash_lib_get_merkle_node(FLASH_LIB_MERKLE_ROOT, &root);
+            init_flash_lib_with_config(&_sync.flash);
+
+            uint32_t persisted_root;
+            flash_lib_get_merkle_node(FLASH_LIB_MERKLE_ROOT, &persisted_root);
+            if (persisted_root != root) {
+                fprintf(stderr, "round %u: root %08x after init, %08x before\n", round, persisted_root, root);
+                return 1;
+            }
+        }
+
+        _sync_run(&report);
+        char label[16];
+        snprintf(label, sizeof(label), "%u", round + 1);
+        _sync_print(label, &report);
+        if (!_sync_check()) {
+            return 1;
+        }
+
+        total.nodes += report.nodes;
+        total.sectors += report.sectors;
+        total.bytes += report.bytes;
+    }
+
+    if (_sync.rounds > 0) {
+        total.nodes /= _sync.rounds;
+        total.sectors /= _sync.rounds;
+        total.bytes /= _sync.rounds;
+        _sync_print("average", &total);
+    }
+    return 0;
+}
+
+void _sync_usage() {
+    fprintf(stderr, "usage: flash_sync [--image in.bin] [--lower N] [--count N] [--group-by N] [--rounds N]\n"
+                    "                  [--changes N] [--seed N] [--reinit]\n");
+}
+
+bool _sync_parse_args(int argc, char **argv) {
+    _sync = (SyncConfig){
+        .flash = {.lower_bound = 256, .logical_sectors_count = 64, .group_by = 1, .seed = 1, .merkle_tree = true},
+        .rounds = 10,
+        .changes = 4,
+        .random_state = 1,
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--reinit") == 0) {
+            _sync.reinit = true;
+            continue;
+        }
+
+        if (value == NULL) {
+            return false;
+        }
+
+        if (strcmp(argv[i], "--image") == 0) {
+            _sync.image_path = value;
+        } else if (strcmp(argv[i], "--lower") == 0) {
+            _sync.flash.lower_bound = atoi(value);
+        } else if (strcmp(argv[i], "--count") == 0) {
+            _sync.flash.logical_sectors_count = atoi(value);
+        } else if (strcmp(argv[i], "--group-by") == 0) {
+            _sync.flash.group_by = atoi(value);
+        } else if (strcmp(argv[i], "--rounds") == 0) {
+            _sync.rounds = atoi(value);
+        } else if (strcmp(argv[i], "--changes") == 0) {
+            _sync.changes = atoi(value);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            _sync.random_state = strtoul(value, NULL, 0);
+        } else {
+            return false;
+        }
+        i++;
+    }
+
+    // The snapshot holds a group record, a digest record and the erase counts of every group
+    uint32_t snapshot_size = 16 + _sync.flash.logical_sectors_count * (2 + _sync.flash.group_by) * 8;
+    uint32_t metadata_sectors = 2;
+    while (metadata_sectors / 2 * FLASH_SECTOR_SIZE < 2 * snapshot_size) {
+        metadata_sectors += 2;
+    }
+    _sync.flash.metadata_sectors_count = metadata_sectors;
+
+    uint32_t end = _sync.flash.lower_bound + metadata_sectors + _sync.flash.logical_sectors_count * _sync.flash.group_by;
+    return _sync.flash.logical_sectors_count > 0 && _sync.flash.group_by > 0 && _sync.random_state != 0 &&
+           end <= FLASH_EMU_SECTORS_COUNT;
+}
+
+/**
+ * @brief Syncs the peer with the device: compares the tree from the root down, updates the nodes
+ * that differ and copies the logical sectors of the leaves that differ.
+ */
+void _sync_run(SyncReport *report) {
+    *report = (SyncReport){0};
+    uint32_t leaves = flash_lib_get_merkle_leaves();
+    uint32_t sector_size = get_logical_sector_size();
+
+    // Depth first, at most one pending sibling per level plus the current node
+    uint32_t stack[64];
+    uint8_t stack_size = 0;
+    stack[stack_size++] = FLASH_LIB_MERKLE_ROOT;
+
+    while (stack_size > 0) {
+        uint32_t node = stack[--stack_size];
+        uint32_t digest;
+        flash_lib_get_merkle_node(node, &digest);
+        report->nodes++;
+        report->bytes += SYNC_REQUEST_BYTES + sizeof(uint32_t);
+
+        if (digest == _peer.nodes[node]) {
+            continue;
+        }
+        _peer.nodes[node] = digest;
+
+        if (node < leaves) {
+            stack[stack_size++] = 2 * node + 1;
+            stack[stack_size++] = 2 * node;
+            continue;
+        }
+
+        // A blank logical sector has a zero digest and needs no transfer
+        uint16_t logical_id = node - leaves;
+        if (digest == 0) {
+            memset(_peer.sectors + logical_id * sector_size, 0xFF, sector_size);
+        } else if (logical_id < _sync.flash.logical_sectors_count) {
+            _sync_read(logical_id, _peer.sectors + logical_id * sector_size);
+            report->sectors++;
+            report->bytes += SYNC_REQUEST_BYTES + sector_size;
+        }
+    }
+}
+
+/**
+ * @brief Checks that the copy of the peer holds the data of the device.
+ */
+bool _sync_check() {
+    uint32_t sector_size = get_logical_sector_size();
+    uint8_t *buffer = (uint8_t *)malloc(sector_size);
+    bool identical = true;
+    for (uint16_t logical_id = 0; logical_id < _sync.flash.logical_sectors_count && identical; ++logical_id) {
+        _sync_read(logical_id, buffer);
+        if (memcmp(_peer.sectors + logical_id * sector_size, buffer, sector_size) != 0) {
+            fprintf(stderr, "logical sector %u differs after the sync\n", logical_id);
+            identical = false;
+        }
+    }
+
+    free(buffer);
+    return identical;
+}
+
+/**
+ * @brief Copies a logical sector, one physical sector at a time as a tombstoned logical sector
+ * reads from a single blank sector.
+ */
+void _sync_read(uint16_t logical_id, uint8_t *buffer) {
+    for (uint32_t offset = 0; offset < get_logical_sector_size(); offset += FLASH_SECTOR_SIZE) {
+        memcpy(buffer + offset, read_sector(logical_id, offset), FLASH_SECTOR_SIZE);
+    }
+}
+
+/**
+ * @brief Changes a random logical sector: rewrites it, appends to it or erases it.
+ */
+void _sync_change() {
+    uint16_t logical_id = _sync_random() % _sync.flash.logical_sectors_count;
+    uint32_t sector_size = get_logical_sector_size();
+    uint32_t count = 1 + _sync_random() % (sector_size / 4);
+    uint8_t *data = (uint8_t *)malloc(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        data[i] = _sync_random();
+    }
+
+    uint32_t action = _sync_random() % 4;
+    if (action == 0) {
+        erase_logical_sector(logical_id);
+        _fill[logical_id] = 0;
+    } else if (action == 1 && _fill[logical_id] + count <= sector_size) {
+        write_sector(logical_id, _fill[logical_id], data, count);
+        _fill[logical_id] += count;
+    } else {
+        rewrite_sector(logical_id, data, count, 0);
+        _fill[logical_id] = count;
+    }
+
+    free(data);
+}
+
+void _sync_print(const char *label, const SyncReport *report) {
+    uint64_t full = (uint64_t)_sync.flash.logical_sectors_count * (SYNC_REQUEST_BYTES + get_logical_sector_size());
+    printf("%-8s %10u %10u %14llu %9.2f%%\n", label, report->nodes, report->sectors, (unsigned long long)report->bytes,
+           100.0 * report->bytes / full);
+}
+
+// xorshift32
+uint32_t _sync_random() {
+    _sync.random_state ^= _sync.random_state << 13;
+    _sync.random_state ^= _sync.random_state >> 17;
+    _sync.random_state ^= _sync.random_state << 5;
+    return _sync.random_state;
+}
@@ -0,0 +1,150 @@
+#include "flash_emu.h"
+#include "pico/time.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+uint8_t flash_emu_image[PICO_FLASH_SIZE_BYTES];
+uint32_t flash_emu_sector_erases[FLASH_EMU_SECTORS_COUNT];
+
+FlashEmuStats _emu_stats;
+uint64_t _emu_time_us = 0;
+bool _emu_realtime = false;
+uint64_t _emu_operations_left = 0;
+void (*_emu_power_loss)(void) = NULL;
+
+void _emu_busy(uint64_t duration_us);
+void _emu_check_power_loss();
+
+/**
+ * @brief Fills the image with `fill` and clears the statistics. 0xFF is an erased flash, any other
+ * value is a flash holding garbage.
+ */
+void flash_emu_reset(uint8_t fill) {
+    memset(flash_emu_image, fill, sizeof(flash_emu_image));
+    flash_emu_reset_stats();
+}
+
+/**
+ * @brief Clears the statistics and erase counts, keeping the image.
+ */
+void flash_emu_reset_stats() {
+    memset(flash_emu_sector_erases, 0, sizeof(flash_emu_sector_erases));
+    memset(&_emu_stats, 0, sizeof(_emu_stats));
+}
+
+/**
+ * @brief Loads an image dumped from a device (picotool save --all) or saved by flash_emu_save().
+ * Images shorter than the flash are padded with erased bytes.
+ */
+bool flash_emu_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    size_t read = fread(flash_emu_image, 1, sizeof(flash_emu_image), file);
+    memset(flash_emu_image + read, 0xFF, sizeof(flash_emu_image) - read);
+    fclose(file);
+    return true;
+}
+
+bool flash_emu_save(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    size_t written = fwrite(flash_emu_image, 1, sizeof(flash_emu_image), file);
+    fclose(file);
+    return written == sizeof(flash_emu_image);
+}
+
+void flash_emu_get_stats(FlashEmuStats *stats) {
+    *stats = _emu_stats;
+}
+
+/**
+ * @brief When enabled, the flash operations sleep for their modeled duration, so threads waiting
+ * for the library see the same delays as on the device.
+ */
+void flash_emu_set_realtime(bool realtime) {
+    _emu_realtime = realtime;
+}
+
+/**
+ * @brief Cuts the power before the erase or program that follows `operations` other ones: the
+ * operation is not done and `handler` is called instead. The handler must not return, it typically
+ * calls longjmp() back to the test, which then runs the init of the library again on the image.
+ */
+void flash_emu_set_power_loss(uint64_t operations, void (*handler)(void)) {
+    _emu_operations_left = operations;
+    _emu_power_loss = handler;
+}
+
+void _emu_check_power_loss() {
+    if (_emu_power_loss == NULL) {
+        return;
+    }
+    if (_emu_operations_left > 0) {
+        _emu_operations_left--;
+        return;
+    }
+
+    void (*handler)(void) = _emu_power_loss;
+    _emu_power_loss = NULL;
+    handler();
+}
+
+void _emu_busy(uint64_t duration_us) {
+    _emu_time_us += duration_us;
+    _emu_stats.busy_us += duration_us;
+
+    if (_emu_realtime) {
+        struct timespec duration = {duration_us / 1000000, duration_us % 1000000 * 1000};
+        nanosleep(&duration, NULL);
+    }
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    assert(flash_offs % FLASH_SECTOR_SIZE == 0 && count % FLASH_SECTOR_SIZE == 0);
+    assert(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+    _emu_check_power_loss();
+
+    memset(flash_emu_image + flash_offs, 0xFF, count);
+
+    // Same choice as the SDK: block erases for aligned 64 KB blocks, sector erases otherwise
+    for (uint32_t offset = flash_offs; offset < flash_offs + count;) {
+        bool block = offset % FLASH_BLOCK_SIZE == 0 && flash_offs + count - offset >= FLASH_BLOCK_SIZE;
+        uint32_t size = block ? FLASH_BLOCK_SIZE : FLASH_SECTOR_SIZE;
+        _emu_busy(block ? FLASH_EMU_BLOCK_ERASE_US : FLASH_EMU_SECTOR_ERASE_US);
+
+        for (uint32_t sector = offset / FLASH_SECTOR_SIZE; sector < (offset + size) / FLASH_SECTOR_SIZE; ++sector) {
+            flash_emu_sector_erases[sector]++;
+            _emu_stats.sector_erases++;
+        }
+        offset += size;
+    }
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    assert(flash_offs % FLASH_PAGE_SIZE == 0 && count % FLASH_PAGE_SIZE == 0);
+    assert(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+    _emu_check_power_loss();
+
+    for (size_t i = 0; i < count; ++i) {
+        flash_emu_image[flash_offs + i] &= data[i];
+    }
+
+    _emu_stats.page_programs += count / FLASH_PAGE_SIZE;
+    _emu_busy(count / FLASH_PAGE_SIZE * FLASH_EMU_PAGE_PROGRAM_US);
+}
+
+uint32_t time_us_32(void) {
+    return (uint32_t)++_emu_time_us;
+}
+
+uint64_t time_us_64(void) {
+    return ++_emu_time_us;
+}
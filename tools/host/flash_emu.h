@@ -0,0 +1,62 @@
+/**
+ * @brief Emulated flash for running the library on a host, used by the tools in tools/.
+ *
+ * *** Overview ***
+ * - Implements the SDK functions used by the library (flash_range_erase, flash_range_program,
+ *   time_us_32) on a RAM image of the flash. Reads go through XIP_BASE, which points to the image.
+ * - Programming only clears bits, like the real flash, and the alignment rules of the SDK are
+ *   checked with assert.
+ * - Time only advances by the modeled duration of the flash operations, plus one microsecond per
+ *   time_us_32() call, so runs are reproducible. The durations are the typical values of the
+ *   W25Q16JV used on the Pico and can be overridden at build time. flash_emu_set_realtime() also
+ *   makes the operations sleep for their duration, for benchmarks with several threads.
+ * - flash_emu_set_power_loss() cuts the power before a given erase or program, for crash tests.
+ * - The include directory next to this file holds stand-ins for the SDK headers.
+ */
+
+#ifndef FLASH_EMU_H
+#define FLASH_EMU_H
+
+#include "hardware/flash.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef FLASH_EMU_SECTOR_ERASE_US
+#define FLASH_EMU_SECTOR_ERASE_US 45000
+#endif
+
+#ifndef FLASH_EMU_BLOCK_ERASE_US
+#define FLASH_EMU_BLOCK_ERASE_US 150000
+#endif
+
+#ifndef FLASH_EMU_PAGE_PROGRAM_US
+#define FLASH_EMU_PAGE_PROGRAM_US 400
+#endif
+
+#define FLASH_EMU_SECTORS_COUNT (PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE)
+
+typedef struct FlashEmuStats {
+    uint64_t sector_erases; // Sectors erased, a block erase counts all its sectors
+    uint64_t page_programs;
+    uint64_t busy_us;       // Modeled time spent in flash operations
+} FlashEmuStats;
+
+// Number of erases of every sector since flash_emu_reset()
+extern uint32_t flash_emu_sector_erases[FLASH_EMU_SECTORS_COUNT];
+
+void flash_emu_reset(uint8_t fill);
+void flash_emu_reset_stats();
+bool flash_emu_load(const char *path);
+bool flash_emu_save(const char *path);
+void flash_emu_get_stats(FlashEmuStats *stats);
+void flash_emu_set_realtime(bool realtime);
+void flash_emu_set_power_loss(uint64_t operations, void (*handler)(void));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
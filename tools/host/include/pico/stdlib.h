@@ -0,0 +1,13 @@
+// Host stand-in for the Pico SDK header, only what the library uses
+#ifndef HOST_PICO_STDLIB_H
+#define HOST_PICO_STDLIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pico/time.h"
+
+// Everything runs from RAM on the host
+#define __not_in_flash_func(name) name
+
+#endif